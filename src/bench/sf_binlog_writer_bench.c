@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fastcommon/logger.h"
+#include "fastcommon/shared_func.h"
+#include "fastcommon/pthread_func.h"
+#include "sf/sf_global.h"
+#include "sf/sf_binlog_writer.h"
+
+typedef struct {
+    int producers;
+    int64_t records;      //records per producer
+    int min_record_size;
+    int max_record_size;
+    bool by_version;
+    int disorder_percent; //the rate of swapping the adjacent versions
+    int flags;
+    int buffer_size;
+    const char *data_path;
+} BenchConfig;
+
+static BenchConfig config = {4, 100000, 64, 64, false, 0,
+    SF_BINLOG_WRITER_FLAGS_STATS, 256 * 1024, "/tmp/sf_binlog_bench"};
+
+static SFBinlogWriterContext context;
+static volatile int64_t next_version = 1;
+static volatile int64_t pushed_records = 0;
+static volatile int push_fails = 0;
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "\t-p <producer threads>, default: %d\n"
+            "\t-n <records per producer>, default: %"PRId64"\n"
+            "\t-s <min record size>, default: %d\n"
+            "\t-S <max record size>, default: %d\n"
+            "\t-v: order by version\n"
+            "\t-o <out of order percent>, order by version only\n"
+            "\t-D: write with O_DIRECT\n"
+            "\t-F: write the framed records\n"
+            "\t-b <writer buffer size>, default: %d\n"
+            "\t-d <data path> such as the tmpfs or local disk, "
+            "default: %s\n", program, config.producers, config.records,
+            config.min_record_size, config.max_record_size,
+            config.buffer_size, config.data_path);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+    int ch;
+
+    while ((ch=getopt(argc, argv, "p:n:s:S:vo:DFb:d:h")) != -1) {
+        switch (ch) {
+            case 'p':
+                config.producers = atoi(optarg);
+                break;
+            case 'n':
+                config.records = strtoll(optarg, NULL, 10);
+                break;
+            case 's':
+                config.min_record_size = atoi(optarg);
+                break;
+            case 'S':
+                config.max_record_size = atoi(optarg);
+                break;
+            case 'v':
+                config.by_version = true;
+                break;
+            case 'o':
+                config.disorder_percent = atoi(optarg);
+                break;
+            case 'D':
+                config.flags |= SF_BINLOG_WRITER_FLAGS_DIRECT_IO;
+                break;
+            case 'F':
+                config.flags |= SF_BINLOG_WRITER_FLAGS_FRAMED;
+                break;
+            case 'b':
+                config.buffer_size = atoi(optarg);
+                break;
+            case 'd':
+                config.data_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EINVAL;
+        }
+    }
+
+    if (config.producers <= 0 || config.records <= 0 ||
+            config.min_record_size < 2 || config.max_record_size <
+            config.min_record_size || config.buffer_size <= 0)
+    {
+        usage(argv[0]);
+        return EINVAL;
+    }
+    return 0;
+}
+
+static int push_record(const int64_t version, unsigned int *seed)
+{
+    SFBinlogWriterBuffer *wbuffer;
+    int size;
+
+    size = config.min_record_size;
+    if (config.max_record_size > config.min_record_size) {
+        size += rand_r(seed) % (config.max_record_size -
+                config.min_record_size + 1);
+    }
+
+    if (config.by_version) {
+        wbuffer = sf_binlog_writer_alloc_versioned_sized_buffer(
+                &context.writer, version, version, size);
+    } else {
+        wbuffer = sf_binlog_writer_alloc_sized_buffer(
+                &context.thread, size);
+    }
+    if (wbuffer == NULL) {
+        return ENOMEM;
+    }
+
+    memset(wbuffer->bf.buff, 'r', size - 1);
+    wbuffer->bf.buff[size - 1] = '\n';
+    wbuffer->bf.length = size;
+    sf_push_to_binlog_write_queue(&context.writer, wbuffer);
+    __sync_add_and_fetch(&pushed_records, 1);
+    return 0;
+}
+
+static void *producer_thread(void *arg)
+{
+    int64_t i;
+    int64_t version;
+    unsigned int seed;
+    int result;
+
+    seed = (unsigned int)(long)arg;
+    for (i=0; i<config.records; i++) {
+        if (config.by_version && config.disorder_percent > 0 &&
+                i + 1 < config.records && rand_r(&seed) % 100 <
+                config.disorder_percent)
+        {
+            version = __sync_fetch_and_add(&next_version, 2);
+            if ((result=push_record(version + 1, &seed)) != 0 ||
+                    (result=push_record(version, &seed)) != 0)
+            {
+                break;
+            }
+            i++;
+            continue;
+        }
+
+        version = __sync_fetch_and_add(&next_version, 1);
+        if ((result=push_record(version, &seed)) != 0) {
+            break;
+        }
+    }
+
+    if (i < config.records) {
+        __sync_add_and_fetch(&push_fails, 1);
+        fprintf(stderr, "producer stopped after %"PRId64" records, "
+                "errno: %d, error info: %s\n", i, result, STRERROR(result));
+    }
+    return NULL;
+}
+
+/* remove the binlog files of the former run */
+static int remove_dir(const char *path)
+{
+    DIR *dir;
+    struct dirent *ent;
+    struct stat stbuf;
+    char full_path[PATH_MAX];
+    int result;
+
+    if ((dir=opendir(path)) == NULL) {
+        result = errno != 0 ? errno : EPERM;
+        if (result == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "open dir %s fail, errno: %d, error info: %s\n",
+                path, result, STRERROR(result));
+        return result;
+    }
+
+    result = 0;
+    while ((ent=readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 ||
+                strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        snprintf(full_path, sizeof(full_path), "%s/%s", path, ent->d_name);
+        if (lstat(full_path, &stbuf) != 0) {
+            result = errno != 0 ? errno : EPERM;
+        } else if (S_ISDIR(stbuf.st_mode)) {
+            result = remove_dir(full_path);
+        } else if (unlink(full_path) != 0) {
+            result = errno != 0 ? errno : EPERM;
+        }
+        if (result != 0) {
+            fprintf(stderr, "remove %s fail, errno: %d, error info: %s\n",
+                    full_path, result, STRERROR(result));
+            break;
+        }
+    }
+    closedir(dir);
+
+    if (result == 0 && rmdir(path) != 0) {
+        result = errno != 0 ? errno : EPERM;
+        fprintf(stderr, "remove dir %s fail, errno: %d, error info: %s\n",
+                path, result, STRERROR(result));
+    }
+    return result;
+}
+
+static void print_histogram(const char *caption,
+        const SFBinlogHistogram *histogram)
+{
+    printf("%-16s count: %"PRId64", avg: %.2f, p50: %"PRId64", "
+            "p99: %"PRId64", p999: %"PRId64", max: %"PRId64"\n",
+            caption, histogram->count, histogram->count > 0 ?
+            (double)histogram->total / histogram->count : 0.00,
+            sf_binlog_histogram_percentile(histogram, 50.00),
+            sf_binlog_histogram_percentile(histogram, 99.00),
+            sf_binlog_histogram_percentile(histogram, 99.90),
+            histogram->max);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *subdir_name = "bench";
+    pthread_t *tids;
+    int64_t total_records;
+    int64_t start_us;
+    int64_t elapsed_us;
+    SFBinlogWriterStats stats;
+    SFBinlogWriterThreadStats thread_stats;
+    char bench_path[PATH_MAX];
+    bool create;
+    int result;
+    int i;
+
+    if ((result=parse_args(argc, argv)) != 0) {
+        return result;
+    }
+
+    log_init();
+    snprintf(bench_path, sizeof(bench_path), "%s/%s",
+            config.data_path, subdir_name);
+    if ((result=remove_dir(bench_path)) != 0) {
+        return result;
+    }
+    if ((result=fc_check_mkdir_ex(config.data_path, 0755, &create)) != 0) {
+        return result;
+    }
+    g_sf_binlog_data_path = (char *)config.data_path;
+
+    if (config.by_version) {
+        result = sf_binlog_writer_init_by_version_ex(&context.writer,
+                subdir_name, next_version, config.buffer_size,
+                4096, config.flags);
+    } else {
+        result = sf_binlog_writer_init_normal_ex(&context.writer,
+                subdir_name, config.buffer_size, config.flags);
+    }
+    if (result != 0) {
+        return result;
+    }
+    if ((result=sf_binlog_writer_init_thread(&context.thread,
+                    &context.writer, config.by_version ?
+                    SF_BINLOG_THREAD_TYPE_ORDER_BY_VERSION :
+                    SF_BINLOG_THREAD_TYPE_ORDER_BY_NONE,
+                    config.max_record_size)) != 0)
+    {
+        return result;
+    }
+
+    tids = (pthread_t *)fc_malloc(sizeof(pthread_t) * config.producers);
+    if (tids == NULL) {
+        return ENOMEM;
+    }
+
+    start_us = get_current_time_us();
+    for (i=0; i<config.producers; i++) {
+        if ((result=fc_create_thread(tids + i, producer_thread,
+                        (void *)(long)(i + 1), SF_G_THREAD_STACK_SIZE)) != 0)
+        {
+            return result;
+        }
+    }
+    for (i=0; i<config.producers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    /* the version taken by the failed push is never written, so the
+       writer ordered by version waits for it forever */
+    total_records = __sync_add_and_fetch(&pushed_records, 0);
+    if (config.by_version && push_fails > 0) {
+        fprintf(stderr, "%d producers stopped, the records ordered by "
+                "version can't be all written\n", push_fails);
+        free(tids);
+        return ENOMEM;
+    }
+    while (__sync_add_and_fetch(&context.writer.total_count, 0) <
+            total_records)
+    {
+        fc_sleep_ms(1);
+    }
+    SF_G_CONTINUE_FLAG = false;
+    sf_binlog_writer_finish(&context.writer);
+    elapsed_us = get_current_time_us() - start_us;
+
+    sf_binlog_writer_get_stats(&context.writer, &stats);
+    sf_binlog_writer_thread_get_stats(&context.thread, &thread_stats);
+
+    printf("producers: %d, records: %"PRId64", record size: %d ~ %d, "
+            "order by: %s, out of order: %d%%, flags: %d\n",
+            config.producers, total_records, config.min_record_size,
+            config.max_record_size, config.by_version ? "version" : "none",
+            config.disorder_percent, config.flags);
+    printf("time used: %.3f s, records/s: %.0f, MB/s: %.2f\n",
+            elapsed_us / 1000000.00, total_records * 1000000.00 /
+            elapsed_us, stats.flush_bytes.total / (double)elapsed_us);
+    printf("flush count: %"PRId64", rotate count: %"PRId64", "
+            "max ring waitings: %d\n", stats.flush_count,
+            stats.rotate_count, context.writer.version_ctx.ring.max_waitings);
+    print_histogram("flush records", &stats.flush_records);
+    print_histogram("flush bytes", &stats.flush_bytes);
+    print_histogram("queue delay(us)", &stats.queue_delay);
+    print_histogram("write delay(us)", &stats.write_delay);
+    print_histogram("fsync time(us)", &stats.fsync_time);
+    print_histogram("queue depth", &thread_stats.queue_depth);
+
+    free(tids);
+    return 0;
+}
@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "fastcommon/logger.h"
+#include "fastcommon/shared_func.h"
+#include "fastcommon/pthread_func.h"
+#include "sf/sf_global.h"
+#include "sf/sf_binlog_writer.h"
+#include "sf/sf_sharding_htable.h"
+
+#define MAX_THREAD_ROUNDS  16
+
+typedef struct {
+    int sharding_count;
+    int64_t capacity;
+    int64_t inodes;
+    int blocks;      //blocks per inode
+    bool one_id;
+    bool chain_test;
+    int round_count;
+    int threads[MAX_THREAD_ROUNDS];  //the thread count of each round
+    int64_t ops;     //operations per thread
+    int insert_percent;
+    double zipf_theta;  //0 for the uniform keys
+    int flags;
+} BenchConfig;
+
+/* the zipfian generator of Gray et al., the key index 0 is the hottest */
+typedef struct {
+    int64_t count;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} ZipfGenerator;
+
+typedef struct {
+    int index;
+    int64_t misses;   //the finds of the keys not exist
+    SFBinlogHistogram find_latency;    //in nanosecond
+    SFBinlogHistogram insert_latency;  //in nanosecond
+} BenchThread;
+
+static BenchConfig config = {163, 1403641, 10000, 64, false, false,
+    1, {4}, 1000000, 10, 0.00, 0};
+
+static SFHtableShardingContext htable_ctx;
+static ZipfGenerator zipf;
+static int64_t key_count;
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "\t-s <sharding count>, default: %d\n"
+            "\t-c <htable capacity>, default: %"PRId64"\n"
+            "\t-n <inode count>, default: %"PRId64"\n"
+            "\t-b <blocks per inode>, default: %d\n"
+            "\t-1: the key is the inode only\n"
+            "\t-C: print the chain length distribution only\n"
+            "\t-t <thread counts> separated by comma such as 1,2,4,8, "
+            "default: %d\n"
+            "\t-N <operations per thread>, default: %"PRId64"\n"
+            "\t-w <insert percent>, the others are finds, default: %d\n"
+            "\t-z <zipfian theta> between 0 and 1 such as 0.99, "
+            "default: uniform\n"
+            "\t-O: use the open addressing hashtable\n"
+            "\t-R: find with the optimistic read\n"
+            "\t-r: resizable buckets\n"
+            "\t-L: use the stripe locks\n"
+            "\t-S: count the lock contention and the lookup steps\n"
+            "\t-H: the old mapping, the sharding by (id1 + id2) %% count "
+            "and the bucket by id1 %% capacity\n",
+            program, config.sharding_count, config.capacity,
+            config.inodes, config.blocks, config.threads[0],
+            config.ops, config.insert_percent);
+}
+
+static int parse_threads(const char *str)
+{
+    char *end;
+    long count;
+
+    config.round_count = 0;
+    while (*str != '\0') {
+        count = strtol(str, &end, 10);
+        if (end == str || count <= 0 || config.round_count ==
+                MAX_THREAD_ROUNDS)
+        {
+            return EINVAL;
+        }
+        config.threads[config.round_count++] = count;
+        str = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return EINVAL;
+        }
+    }
+    return config.round_count > 0 ? 0 : EINVAL;
+}
+
+static int parse_args(int argc, char *argv[])
+{
+    int ch;
+
+    while ((ch=getopt(argc, argv, "s:c:n:b:1Ct:N:w:z:ORrLSHh")) != -1) {
+        switch (ch) {
+            case 's':
+                config.sharding_count = atoi(optarg);
+                break;
+            case 'c':
+                config.capacity = strtoll(optarg, NULL, 10);
+                break;
+            case 'n':
+                config.inodes = strtoll(optarg, NULL, 10);
+                break;
+            case 'b':
+                config.blocks = atoi(optarg);
+                break;
+            case '1':
+                config.one_id = true;
+                break;
+            case 'C':
+                config.chain_test = true;
+                break;
+            case 't':
+                if (parse_threads(optarg) != 0) {
+                    usage(argv[0]);
+                    return EINVAL;
+                }
+                break;
+            case 'N':
+                config.ops = strtoll(optarg, NULL, 10);
+                break;
+            case 'w':
+                config.insert_percent = atoi(optarg);
+                break;
+            case 'z':
+                config.zipf_theta = strtod(optarg, NULL);
+                break;
+            case 'O':
+                config.flags |= SF_SHARDING_HTABLE_FLAGS_OPEN_ADDRESSING;
+                break;
+            case 'R':
+                config.flags |= SF_SHARDING_HTABLE_FLAGS_OPTIMISTIC_READ;
+                break;
+            case 'r':
+                config.flags |= SF_SHARDING_HTABLE_FLAGS_RESIZABLE;
+                break;
+            case 'L':
+                config.flags |= SF_SHARDING_HTABLE_FLAGS_STRIPE_LOCK;
+                break;
+            case 'S':
+                config.flags |= SF_SHARDING_HTABLE_FLAGS_CONTENTION_STATS;
+                break;
+            case 'H':
+                config.flags |= SF_SHARDING_HTABLE_FLAGS_LEGACY_HASH;
+                break;
+            default:
+                usage(argv[0]);
+                return EINVAL;
+        }
+    }
+
+    if (config.sharding_count <= 0 || config.capacity <= 0 ||
+            config.inodes <= 0 || config.blocks <= 0 || config.ops <= 0 ||
+            config.insert_percent < 0 || config.insert_percent > 100 ||
+            config.zipf_theta < 0.00 || config.zipf_theta >= 1.00)
+    {
+        usage(argv[0]);
+        return EINVAL;
+    }
+    if (config.one_id) {
+        config.blocks = 1;
+    }
+    return 0;
+}
+
+static void zipf_init(ZipfGenerator *gen, const int64_t count,
+        const double theta)
+{
+    double zeta2;
+    int64_t i;
+
+    gen->count = count;
+    gen->theta = theta;
+    gen->alpha = 1.00 / (1.00 - theta);
+    gen->zetan = 0.00;
+    for (i=1; i<=count; i++) {
+        gen->zetan += 1.00 / pow((double)i, theta);
+    }
+    zeta2 = 1.00 + 1.00 / pow(2.00, theta);
+    gen->eta = (1.00 - pow(2.00 / count, 1.00 - theta)) /
+        (1.00 - zeta2 / gen->zetan);
+}
+
+static inline int64_t zipf_next(const ZipfGenerator *gen, const double u)
+{
+    double uz;
+    int64_t index;
+
+    uz = u * gen->zetan;
+    if (uz < 1.00) {
+        return 0;
+    }
+    if (uz < 1.00 + pow(0.50, gen->theta)) {
+        return 1;
+    }
+
+    index = (int64_t)(gen->count * pow(gen->eta * u -
+                gen->eta + 1.00, gen->alpha));
+    return index < gen->count ? index : gen->count - 1;
+}
+
+static inline void set_key(SFTwoIdsHashKey *key, const int64_t index)
+{
+    key->oid = index / config.blocks + 1;
+    key->bid = index % config.blocks;
+}
+
+static inline int64_t next_key_index(unsigned int *seed)
+{
+    double u;
+
+    if (config.zipf_theta > 0.00) {
+        u = rand_r(seed) / (RAND_MAX + 1.00);
+        return zipf_next(&zipf, u);
+    } else {
+        return (((int64_t)rand_r(seed) << 31) | rand_r(seed)) % key_count;
+    }
+}
+
+static inline int64_t get_current_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int insert_callback(SFShardingHashEntry *entry,
+        void *arg, const bool new_create)
+{
+    return 0;
+}
+
+static void *bench_thread_func(void *arg)
+{
+    BenchThread *thread;
+    SFTwoIdsHashKey key;
+    unsigned int seed;
+    int64_t start_ns;
+    int64_t i;
+    bool is_insert;
+
+    thread = (BenchThread *)arg;
+    seed = thread->index + 1;
+    for (i=0; i<config.ops; i++) {
+        set_key(&key, next_key_index(&seed));
+        is_insert = rand_r(&seed) % 100 < config.insert_percent;
+        start_ns = get_current_time_ns();
+        if (is_insert) {
+            sf_sharding_htable_insert(&htable_ctx, &key, NULL);
+            sf_binlog_histogram_add(&thread->insert_latency,
+                    get_current_time_ns() - start_ns);
+        } else {
+            if (sf_sharding_htable_find(&htable_ctx, &key, NULL) == NULL) {
+                thread->misses++;
+            }
+            sf_binlog_histogram_add(&thread->find_latency,
+                    get_current_time_ns() - start_ns);
+        }
+    }
+
+    return NULL;
+}
+
+static void histogram_merge(SFBinlogHistogram *dest,
+        const SFBinlogHistogram *src)
+{
+    int i;
+
+    for (i=0; i<SF_BINLOG_HISTOGRAM_BUCKETS; i++) {
+        dest->buckets[i] += src->buckets[i];
+    }
+    dest->count += src->count;
+    dest->total += src->total;
+    if (src->max > dest->max) {
+        dest->max = src->max;
+    }
+}
+
+static void print_histogram(const char *caption,
+        const SFBinlogHistogram *histogram)
+{
+    printf("%-20s count: %"PRId64", avg: %.2f, p50: %"PRId64", "
+            "p99: %"PRId64", p999: %"PRId64", max: %"PRId64"\n",
+            caption, histogram->count, histogram->count > 0 ?
+            (double)histogram->total / histogram->count : 0.00,
+            sf_binlog_histogram_percentile(histogram, 50.00),
+            sf_binlog_histogram_percentile(histogram, 99.00),
+            sf_binlog_histogram_percentile(histogram, 99.90),
+            histogram->max);
+}
+
+static void print_contention_stats()
+{
+    SFShardingHtableContentionStats stats;
+    SFHtableStripeStats *total;
+
+    sf_sharding_htable_get_contention_stats(&htable_ctx, -1, &stats);
+    total = &stats.total;
+    printf("locks: %"PRId64", waits: %"PRId64" (%.2f%%), "
+            "wait time: %.3f ms, avg wait: %.2f us\n",
+            total->lock_count, total->wait_count, total->lock_count > 0 ?
+            100.00 * total->wait_count / total->lock_count : 0.00,
+            total->wait_time_us / 1000.00, total->wait_count > 0 ?
+            (double)total->wait_time_us / total->wait_count : 0.00);
+    printf("lookups: %"PRId64", avg steps: %.2f, "
+            "optimistic fallbacks: %"PRId64"\n", total->lookup_count,
+            total->lookup_count > 0 ? (double)total->lookup_steps /
+            total->lookup_count : 0.00, total->optimistic_fallbacks);
+    printf("hottest sharding: %d, wait time: %.3f ms\n",
+            stats.hottest_sharding, stats.hottest_wait_time_us / 1000.00);
+}
+
+static int run_round(const int thread_count)
+{
+    BenchThread *threads;
+    pthread_t *tids;
+    SFBinlogHistogram find_latency;
+    SFBinlogHistogram insert_latency;
+    int64_t misses;
+    int64_t total_ops;
+    int64_t start_us;
+    int64_t elapsed_us;
+    int result;
+    int i;
+
+    threads = (BenchThread *)fc_malloc(sizeof(BenchThread) * thread_count);
+    if (threads == NULL) {
+        return ENOMEM;
+    }
+    tids = (pthread_t *)fc_malloc(sizeof(pthread_t) * thread_count);
+    if (tids == NULL) {
+        free(threads);
+        return ENOMEM;
+    }
+
+    memset(threads, 0, sizeof(BenchThread) * thread_count);
+    if ((config.flags & SF_SHARDING_HTABLE_FLAGS_CONTENTION_STATS) != 0) {
+        sf_sharding_htable_reset_contention_stats(&htable_ctx);
+    }
+
+    result = 0;
+    start_us = get_current_time_us();
+    for (i=0; i<thread_count; i++) {
+        threads[i].index = i;
+        if ((result=fc_create_thread(tids + i, bench_thread_func,
+                        threads + i, SF_G_THREAD_STACK_SIZE)) != 0)
+        {
+            break;
+        }
+    }
+    while (--i >= 0) {
+        pthread_join(tids[i], NULL);
+    }
+    elapsed_us = get_current_time_us() - start_us;
+    if (result != 0) {
+        free(tids);
+        free(threads);
+        return result;
+    }
+
+    memset(&find_latency, 0, sizeof(find_latency));
+    memset(&insert_latency, 0, sizeof(insert_latency));
+    misses = 0;
+    for (i=0; i<thread_count; i++) {
+        histogram_merge(&find_latency, &threads[i].find_latency);
+        histogram_merge(&insert_latency, &threads[i].insert_latency);
+        misses += threads[i].misses;
+    }
+
+    total_ops = config.ops * thread_count;
+    printf("\nthreads: %d, operations: %"PRId64", time used: %.3f s, "
+            "ops/s: %.0f, find misses: %"PRId64"\n", thread_count,
+            total_ops, elapsed_us / 1000000.00, elapsed_us > 0 ?
+            total_ops * 1000000.00 / elapsed_us : 0.00, misses);
+    print_histogram("find latency(ns)", &find_latency);
+    print_histogram("insert latency(ns)", &insert_latency);
+    if ((config.flags & SF_SHARDING_HTABLE_FLAGS_CONTENTION_STATS) != 0) {
+        print_contention_stats();
+    }
+
+    free(tids);
+    free(threads);
+    return 0;
+}
+
+/* insert all keys before the rounds, so the finds hit */
+static int mix_test()
+{
+    SFTwoIdsHashKey key;
+    int64_t index;
+    int result;
+    int i;
+
+    if (config.zipf_theta > 0.00) {
+        zipf_init(&zipf, key_count, config.zipf_theta);
+    }
+    for (index=0; index<key_count; index++) {
+        set_key(&key, index);
+        if ((result=sf_sharding_htable_insert(&htable_ctx,
+                        &key, NULL)) != 0)
+        {
+            return result;
+        }
+    }
+
+    printf("keys: %"PRId64" (%"PRId64" inodes x %d blocks), "
+            "distribution: ", key_count, config.inodes, config.blocks);
+    if (config.zipf_theta > 0.00) {
+        printf("zipfian %.2f", config.zipf_theta);
+    } else {
+        printf("uniform");
+    }
+    printf(", insert: %d%%, flags: %d\n", config.insert_percent,
+            config.flags);
+
+    for (i=0; i<config.round_count; i++) {
+        if ((result=run_round(config.threads[i])) != 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+static int chain_test()
+{
+    SFTwoIdsHashKey key;
+    SFShardingHtableChainStats stats;
+    int64_t count;
+    int result;
+    int last;
+    int i;
+
+    for (key.oid=1; key.oid<=config.inodes; key.oid++) {
+        for (key.bid=0; key.bid<config.blocks; key.bid++) {
+            if ((result=sf_sharding_htable_insert(&htable_ctx,
+                            &key, NULL)) != 0)
+            {
+                return result;
+            }
+        }
+    }
+
+    sf_sharding_htable_get_chain_stats(&htable_ctx, &stats);
+    printf("keys: %"PRId64" (%"PRId64" inodes x %d blocks), "
+            "backend: %s, hash: %s\n", key_count, config.inodes,
+            config.blocks, (config.flags &
+                SF_SHARDING_HTABLE_FLAGS_OPEN_ADDRESSING) ?
+            "open addressing" : "chained buckets", (config.flags &
+                SF_SHARDING_HTABLE_FLAGS_LEGACY_HASH) ?
+            "legacy modulo" : "mixing");
+    printf("elements: %"PRId64", per sharding min: %"PRId64", "
+            "max: %"PRId64"\n", stats.element_count,
+            stats.min_sharding_elements, stats.max_sharding_elements);
+    printf("buckets: %"PRId64", used: %"PRId64" (%.2f%%), "
+            "max chain length: %d\n", stats.bucket_count,
+            stats.used_buckets, stats.bucket_count > 0 ? 100.00 *
+            stats.used_buckets / stats.bucket_count : 0.00,
+            stats.max_length);
+
+    last = SF_SHARDING_HTABLE_CHAIN_HISTOGRAM_SIZE - 1;
+    printf("chain length distribution:\n");
+    for (i=0; i<SF_SHARDING_HTABLE_CHAIN_HISTOGRAM_SIZE; i++) {
+        if ((count=stats.histogram[i]) == 0) {
+            continue;
+        }
+        printf("%s%2d: %"PRId64"\n", (i == last) ? ">=" : "  ", i, count);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int result;
+
+    if ((result=parse_args(argc, argv)) != 0) {
+        return result;
+    }
+
+    log_init();
+    key_count = config.inodes * config.blocks;
+    if ((result=sf_sharding_htable_init_ex(&htable_ctx, config.one_id ?
+                    sf_sharding_htable_key_ids_one :
+                    sf_sharding_htable_key_ids_two, insert_callback,
+                    NULL, NULL, config.sharding_count, config.capacity,
+                    17, sizeof(SFShardingHashEntry), key_count,
+                    600, 86400, config.flags)) != 0)
+    {
+        return result;
+    }
+
+    return config.chain_test ? chain_test() : mix_test();
+}
@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "fastcommon/logger.h"
+#include "fastcommon/shared_func.h"
+#include "sf_binlog_frame.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define SF_CRC32C_HW_ENABLED  1
+#endif
+
+#define CRC32C_POLYNOMIAL  0x82F63B78  //reversed
+
+static uint32_t crc32c_table[256];
+static bool crc32c_hw_supported = false;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init()
+{
+    uint32_t crc;
+    int i;
+    int k;
+
+    for (i=0; i<256; i++) {
+        crc = i;
+        for (k=0; k<8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+
+#ifdef SF_CRC32C_HW_ENABLED
+    __builtin_cpu_init();
+    crc32c_hw_supported = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, int length)
+{
+    while (length-- > 0) {
+        crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef SF_CRC32C_HW_ENABLED
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, int length)
+{
+    uint64_t crc64;
+
+    while (length > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        length--;
+    }
+
+    crc64 = crc;
+    while (length >= 8) {
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+        p += 8;
+        length -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t sf_crc32c(uint32_t crc, const void *buff, const int length)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+
+    crc = ~crc;
+#ifdef SF_CRC32C_HW_ENABLED
+    if (crc32c_hw_supported) {
+        return ~crc32c_hw(crc, (const unsigned char *)buff, length);
+    }
+#endif
+    return ~crc32c_sw(crc, (const unsigned char *)buff, length);
+}
+
+int sf_binlog_frame_parse(const char *buff, const int length,
+        SFBinlogFrameRecord *record, const bool check_body)
+{
+    const SFBinlogFrameHeader *header;
+    int header_crc_len;
+
+    if (length < SF_BINLOG_FRAME_HEADER_SIZE) {
+        return EAGAIN;
+    }
+
+    header = (const SFBinlogFrameHeader *)buff;
+    if (header->magic[0] != SF_BINLOG_FRAME_MAGIC0 ||
+            header->magic[1] != SF_BINLOG_FRAME_MAGIC1)
+    {
+        return EINVAL;
+    }
+
+    header_crc_len = header->header_crc32 - (const char *)header;
+    if ((uint32_t)buff2int(header->header_crc32) !=
+            sf_crc32c(0, header, header_crc_len))
+    {
+        return EINVAL;
+    }
+    if (header->format_version != SF_BINLOG_FRAME_FORMAT_VERSION) {
+        return EINVAL;
+    }
+
+    record->body.len = buff2int(header->body_length);
+    if (record->body.len < 0) {
+        return EINVAL;
+    }
+    if (length < SF_BINLOG_FRAME_HEADER_SIZE + record->body.len) {
+        return EAGAIN;
+    }
+
+    record->body.str = (char *)buff + SF_BINLOG_FRAME_HEADER_SIZE;
+    if (check_body && (uint32_t)buff2int(header->body_crc32) !=
+            sf_crc32c(0, record->body.str, record->body.len))
+    {
+        return EINVAL;
+    }
+
+    record->data_version = buff2long(header->data_version);
+    record->stream_id = buff2int(header->stream_id);
+    record->flags = header->flags;
+    return 0;
+}
+
+typedef struct frame_tail_window {
+    int fd;
+    int64_t file_size;  //the bytes to check
+    int64_t start;      //the file offset of the buffer
+    char *buff;         //the data from start to file_size
+} FrameTailWindow;
+
+#define FRAME_TAIL_BUFFER_SIZE  (4 * 1024 * 1024)
+
+#define TAIL_WINDOW_FULL(window)  ((window)->start == 0 || \
+        (window)->file_size - (window)->start >= \
+        SF_BINLOG_FRAME_MAX_SCAN_SIZE)
+
+#define TAIL_WINDOW_PTR(window, offset) \
+    ((window)->buff + ((offset) - (window)->start))
+
+/* read more data before the window, the data in the window is kept */
+static int tail_window_load(FrameTailWindow *window,
+        const char *filename, const int64_t size)
+{
+    int result;
+    int bytes;
+    int64_t start;
+    char *buff;
+
+    start = window->file_size - size;
+    if ((buff=(char *)fc_malloc(size)) == NULL) {
+        return ENOMEM;
+    }
+
+    if (window->buff != NULL) {
+        bytes = window->start - start;
+        memcpy(buff + bytes, window->buff, window->file_size -
+                window->start);
+        free(window->buff);
+    } else {
+        bytes = size;
+    }
+    window->buff = buff;
+    window->start = start;
+
+    if (pread(window->fd, buff, bytes, start) != bytes) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "read file \"%s\" fail, offset: %"PRId64", "
+                "errno: %d, error info: %s", __LINE__,
+                filename, start, result, STRERROR(result));
+        return result;
+    }
+
+    return 0;
+}
+
+static inline void tail_window_destroy(FrameTailWindow *window)
+{
+    if (window->buff != NULL) {
+        free(window->buff);
+        window->buff = NULL;
+    }
+    close(window->fd);
+}
+
+static int tail_window_init(FrameTailWindow *window,
+        const char *filename, const int64_t file_size)
+{
+    int result;
+
+    if ((window->fd=open(filename, O_RDONLY)) < 0) {
+        result = errno != 0 ? errno : EACCES;
+        logError("file: "__FILE__", line: %d, "
+                "open file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, filename, result, STRERROR(result));
+        return result;
+    }
+
+    window->file_size = file_size;
+    window->start = file_size;
+    window->buff = NULL;
+    if ((result=tail_window_load(window, filename, FC_MIN(file_size,
+                        FRAME_TAIL_BUFFER_SIZE))) != 0)
+    {
+        tail_window_destroy(window);
+    }
+    return result;
+}
+
+/* double the window, return ENOENT when the window is full */
+static inline int tail_window_extend(FrameTailWindow *window,
+        const char *filename)
+{
+    int64_t size;
+
+    if (TAIL_WINDOW_FULL(window)) {
+        return ENOENT;
+    }
+
+    size = FC_MIN(2 * (window->file_size - window->start),
+            FC_MIN(window->file_size, SF_BINLOG_FRAME_MAX_SCAN_SIZE));
+    return tail_window_load(window, filename, size);
+}
+
+/* search the last valid frame header backward before the end offset,
+ * the body is NOT checked
+ * return 0 for found, EAGAIN for the window should be extended,
+ *        ENOENT for not found
+ */
+static int find_last_header(const FrameTailWindow *window,
+        const int64_t end, int64_t *offset, int *body_len)
+{
+    const char *p;
+    const char *buff_end;
+    SFBinlogFrameRecord record;
+
+    buff_end = window->buff + (window->file_size - window->start);
+    p = TAIL_WINDOW_PTR(window, end);
+    while (p > window->buff) {
+        /* memrchr is vectorized by glibc */
+        if ((p=(const char *)memrchr(window->buff, SF_BINLOG_FRAME_MAGIC0,
+                        p - window->buff)) == NULL)
+        {
+            break;
+        }
+
+        if (buff_end - p >= SF_BINLOG_FRAME_HEADER_SIZE &&
+                (unsigned char)p[1] == SF_BINLOG_FRAME_MAGIC1 &&
+                sf_binlog_frame_parse(p, SF_BINLOG_FRAME_HEADER_SIZE,
+                    &record, false) != EINVAL)
+        {
+            *offset = window->start + (p - window->buff);
+            *body_len = buff2int(((const SFBinlogFrameHeader *)p)->
+                    body_length);
+            return 0;
+        }
+    }
+
+    return TAIL_WINDOW_FULL(window) ? ENOENT : EAGAIN;
+}
+
+/* search the valid frame backward which ends at the end offset exactly
+ * return 0 for found, EAGAIN for the window should be extended,
+ *        ENOENT for not found
+ */
+static int find_frame_ending_at(const FrameTailWindow *window,
+        const int64_t end, int64_t *offset)
+{
+    const char *p;
+    const char *frame_end;
+    SFBinlogFrameRecord record;
+
+    frame_end = TAIL_WINDOW_PTR(window, end);
+    p = frame_end;
+    while (p > window->buff) {
+        if ((p=(const char *)memrchr(window->buff, SF_BINLOG_FRAME_MAGIC0,
+                        p - window->buff)) == NULL)
+        {
+            break;
+        }
+
+        if (frame_end - p >= SF_BINLOG_FRAME_HEADER_SIZE &&
+                (unsigned char)p[1] == SF_BINLOG_FRAME_MAGIC1 &&
+                sf_binlog_frame_parse(p, frame_end - p,
+                    &record, true) == 0 && record.body.str +
+                record.body.len == frame_end)
+        {
+            *offset = window->start + (p - window->buff);
+            return 0;
+        }
+    }
+
+    return TAIL_WINDOW_FULL(window) ? ENOENT : EAGAIN;
+}
+
+/* the remainder is an incomplete frame header or the zero bytes
+   which are not persisted when the file size is extended */
+static bool is_torn_remainder(const FrameTailWindow *window,
+        const int64_t offset)
+{
+    const unsigned char *p;
+    const unsigned char *end;
+
+    p = (const unsigned char *)TAIL_WINDOW_PTR(window, offset);
+    end = (const unsigned char *)window->buff +
+        (window->file_size - window->start);
+    if (end - p < SF_BINLOG_FRAME_HEADER_SIZE &&
+            *p == SF_BINLOG_FRAME_MAGIC0 && (end - p == 1 ||
+                p[1] == SF_BINLOG_FRAME_MAGIC1))
+    {
+        return true;
+    }
+
+    while (p < end && *p == 0) {
+        p++;
+    }
+    return p == end;
+}
+
+/* scan backward from the file end for the last frame which is chained
+ * to the previous frame, so the fake header in the record body is skipped
+ * return 0 for success, EAGAIN for the window should be extended,
+ *        EINVAL for not a framed binlog or corrupted
+ */
+static int locate_valid_end(const FrameTailWindow *window,
+        int64_t *valid_size)
+{
+    int result;
+    int body_len;
+    int64_t end;
+    int64_t offset;
+    int64_t prev;
+    SFBinlogFrameRecord record;
+
+    end = window->file_size;
+    while (1) {
+        if ((result=find_last_header(window, end,
+                        &offset, &body_len)) != 0)
+        {
+            if (result == EAGAIN) {
+                return EAGAIN;
+            }
+            if (window->start == 0 && is_torn_remainder(window, 0)) {
+                *valid_size = 0;
+                return 0;
+            }
+            return EINVAL;
+        }
+
+        if (offset > 0 && (result=find_frame_ending_at(
+                        window, offset, &prev)) != 0)
+        {
+            if (result == EAGAIN) {
+                return EAGAIN;
+            }
+            end = offset;  //not the frame boundary
+            continue;
+        }
+        break;
+    }
+
+    end = offset + SF_BINLOG_FRAME_HEADER_SIZE + body_len;
+    if (end > window->file_size) {  //the incomplete frame
+        *valid_size = offset;
+        return 0;
+    }
+
+    result = sf_binlog_frame_parse(TAIL_WINDOW_PTR(window, offset),
+            end - offset, &record, true);
+    if (end == window->file_size) {
+        /* the body of the last frame is torn when the check fails */
+        *valid_size = (result == 0) ? end : offset;
+        return 0;
+    }
+
+    if (result == 0 && is_torn_remainder(window, end)) {
+        *valid_size = end;
+        return 0;
+    }
+    return EINVAL;
+}
+
+/* the window is extended as need */
+static int tail_window_locate(FrameTailWindow *window,
+        const char *filename, int64_t *valid_size)
+{
+    int result;
+
+    while ((result=locate_valid_end(window, valid_size)) == EAGAIN) {
+        if ((result=tail_window_extend(window, filename)) != 0) {
+            return result == ENOENT ? EINVAL : result;
+        }
+    }
+
+    return result;
+}
+
+int sf_binlog_frame_check_file(const char *filename,
+        const int64_t file_size, int64_t *valid_size)
+{
+    int result;
+    FrameTailWindow window;
+
+    if (file_size == 0) {
+        *valid_size = 0;
+        return 0;
+    }
+
+    if ((result=tail_window_init(&window, filename, file_size)) != 0) {
+        return result;
+    }
+
+    if ((result=tail_window_locate(&window, filename,
+                    valid_size)) == EINVAL)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "binlog file \"%s\", file size: %"PRId64", the tail is "
+                "not an incomplete frame, not a framed binlog or "
+                "corrupted", __LINE__, filename, file_size);
+    }
+
+    tail_window_destroy(&window);
+    return result;
+}
+
+int sf_binlog_frame_get_last_frames(const char *filename, char *buff,
+        const int buff_size, string_t *frames, int *count)
+{
+    int result;
+    int found;
+    int64_t file_size;
+    int64_t valid_size;
+    int64_t start;
+    int64_t offset;
+    FrameTailWindow window;
+
+    frames->str = buff;
+    frames->len = 0;
+    if ((result=getFileSize(filename, &file_size)) != 0) {
+        *count = 0;
+        return result;
+    }
+    if (*count <= 0 || file_size == 0) {
+        *count = 0;
+        return 0;
+    }
+
+    if ((result=tail_window_init(&window, filename, file_size)) != 0) {
+        *count = 0;
+        return result;
+    }
+    if ((result=tail_window_locate(&window, filename,
+                    &valid_size)) != 0)
+    {
+        tail_window_destroy(&window);
+        *count = 0;
+        return result;
+    }
+
+    /* chain the frames backward, the older frames exceed
+       the buffer are dropped */
+    found = 0;
+    start = valid_size;
+    while (found < *count && start > 0) {
+        result = find_frame_ending_at(&window, start, &offset);
+        if (result == EAGAIN && valid_size - window.start < buff_size) {
+            if ((result=tail_window_extend(&window, filename)) != 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (result != 0 || valid_size - offset > buff_size) {
+            result = 0;
+            break;
+        }
+        start = offset;
+        found++;
+    }
+
+    if (result == 0) {
+        frames->len = valid_size - start;
+        memcpy(buff, TAIL_WINDOW_PTR(&window, start), frames->len);
+    }
+
+    tail_window_destroy(&window);
+    *count = (result == 0) ? found : 0;
+    return result;
+}
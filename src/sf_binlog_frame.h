@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//sf_binlog_frame.h
+
+#ifndef _SF_BINLOG_FRAME_H_
+#define _SF_BINLOG_FRAME_H_
+
+#include "fastcommon/common_define.h"
+#include "fastcommon/shared_func.h"
+
+#define SF_BINLOG_FRAME_MAGIC0           0xFB
+#define SF_BINLOG_FRAME_MAGIC1           0x1F
+#define SF_BINLOG_FRAME_FORMAT_VERSION   1
+
+#define SF_BINLOG_FRAME_HEADER_SIZE  ((int)sizeof(SFBinlogFrameHeader))
+
+/* the max tail scanned backward from the file end to locate
+   the last frame boundary when recovering */
+#define SF_BINLOG_FRAME_MAX_SCAN_SIZE  (64 * 1024 * 1024)
+
+typedef struct sf_binlog_frame_header {
+    unsigned char magic[2];
+    unsigned char format_version;
+    unsigned char flags;
+    char body_length[4];
+    char data_version[8];
+    char stream_id[4];     //the logical writer id of the shared binlog
+    char body_crc32[4];
+    char header_crc32[4];  //crc32 of the fields before
+} SFBinlogFrameHeader;
+
+typedef struct sf_binlog_frame_record {
+    int64_t data_version;
+    int stream_id;
+    int flags;
+    string_t body;
+} SFBinlogFrameRecord;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* CRC32C (Castagnoli), use the SSE4.2 instruction when available */
+uint32_t sf_crc32c(uint32_t crc, const void *buff, const int length);
+
+#define sf_binlog_frame_pack_header(buff, data_version, body, body_len) \
+    sf_binlog_frame_pack_header_ex(buff, 0, data_version, body, body_len)
+
+static inline void sf_binlog_frame_pack_header_ex(char *buff,
+        const int stream_id, const int64_t data_version,
+        const char *body, const int body_len)
+{
+    SFBinlogFrameHeader *header;
+
+    header = (SFBinlogFrameHeader *)buff;
+    header->magic[0] = SF_BINLOG_FRAME_MAGIC0;
+    header->magic[1] = SF_BINLOG_FRAME_MAGIC1;
+    header->format_version = SF_BINLOG_FRAME_FORMAT_VERSION;
+    header->flags = 0;
+    int2buff(body_len, header->body_length);
+    long2buff(data_version, header->data_version);
+    int2buff(stream_id, header->stream_id);
+    int2buff(sf_crc32c(0, body, body_len), header->body_crc32);
+    int2buff(sf_crc32c(0, header, (char *)header->header_crc32 -
+                (char *)header), header->header_crc32);
+}
+
+/* parse one frame
+ * return 0 for success, EAGAIN for incomplete frame, EINVAL for bad frame
+ */
+int sf_binlog_frame_parse(const char *buff, const int length,
+        SFBinlogFrameRecord *record, const bool check_body);
+
+/* fetch the next frame from the validated frames and move forward
+ * return 0 for success, ENOENT for no more frame
+ */
+static inline int sf_binlog_frame_next(string_t *frames,
+        SFBinlogFrameRecord *record)
+{
+    int frame_len;
+
+    if (frames->len == 0) {
+        return ENOENT;
+    }
+    if (sf_binlog_frame_parse(frames->str, frames->len,
+                record, false) != 0)
+    {
+        return EINVAL;
+    }
+
+    frame_len = SF_BINLOG_FRAME_HEADER_SIZE + record->body.len;
+    frames->str += frame_len;
+    frames->len -= frame_len;
+    return 0;
+}
+
+/* find the end of the last valid frame by scanning backward from the
+ * file end, only the frame chained to the previous frame is accepted,
+ * the data after it is the torn tail which should be truncated
+ * file_size: the bytes to check
+ * return 0 for success, EINVAL for the data after the last valid frame
+ *        is not an incomplete frame (not a framed binlog or corrupted)
+ */
+int sf_binlog_frame_check_file(const char *filename,
+        const int64_t file_size, int64_t *valid_size);
+
+/* get the last count frames of the binlog file, the frames are chained
+ * backward from the end of the last valid frame, and the older frames
+ * exceed the buffer are dropped
+ */
+int sf_binlog_frame_get_last_frames(const char *filename, char *buff,
+        const int buff_size, string_t *frames, int *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
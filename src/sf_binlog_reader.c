@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fastcommon/logger.h"
+#include "fastcommon/shared_func.h"
+#include "sf_func.h"
+#include "sf_binlog_reader.h"
+
+int sf_binlog_reader_init(SFBinlogReader *reader, const char *subdir_name,
+        SFBinlogWriterInfo *writer, const SFBinlogFilePosition *position,
+        const int buffer_size, const bool framed)
+{
+    snprintf(reader->subdir_name, sizeof(reader->subdir_name),
+            "%s", subdir_name);
+    reader->writer = writer;
+    reader->framed = framed;
+    reader->fd = -1;
+    reader->position = *position;
+    reader->file_offset = position->offset;
+    *reader->filename = '\0';
+    return sf_binlog_buffer_init(&reader->buffer, buffer_size > 0 ?
+            buffer_size : SF_BINLOG_READER_DEFAULT_BUFFER_SIZE);
+}
+
+void sf_binlog_reader_destroy(SFBinlogReader *reader)
+{
+    if (reader->fd >= 0) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+    sf_binlog_buffer_destroy(&reader->buffer);
+}
+
+static int open_readable_binlog(SFBinlogReader *reader)
+{
+    int result;
+
+    sf_binlog_writer_get_filename(reader->subdir_name,
+            reader->position.index, reader->filename,
+            sizeof(reader->filename));
+    if ((reader->fd=open(reader->filename, O_RDONLY)) < 0) {
+        result = errno != 0 ? errno : EACCES;
+        if (result != ENOENT) {
+            logError("file: "__FILE__", line: %d, "
+                    "open binlog file \"%s\" fail, "
+                    "errno: %d, error info: %s",
+                    __LINE__, reader->filename,
+                    result, STRERROR(result));
+        }
+        return result;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    reader->file_offset = reader->position.offset;
+    reader->buffer.current = reader->buffer.end = reader->buffer.buff;
+    return 0;
+}
+
+static int switch_to_next_binlog(SFBinlogReader *reader)
+{
+    if (reader->buffer.end > reader->buffer.current) {
+        logError("file: "__FILE__", line: %d, "
+                "binlog file \"%s\", offset: %"PRId64", the last "
+                "%d bytes is not a complete record", __LINE__,
+                reader->filename, reader->position.offset,
+                (int)(reader->buffer.end - reader->buffer.current));
+        return EINVAL;
+    }
+
+    close(reader->fd);
+    reader->fd = -1;
+    reader->position.index++;
+    reader->position.offset = 0;
+    return 0;
+}
+
+/* return true when the current binlog file will not grow anymore,
+   *limit for the readable file offset, -1 for EOF */
+static bool get_read_limit(SFBinlogReader *reader, int64_t *limit)
+{
+    SFBinlogFilePosition published;
+    char filename[PATH_MAX];
+
+    if (reader->writer != NULL) {
+        sf_binlog_writer_get_published_position(reader->writer, &published);
+        if (published.index == reader->position.index) {
+            *limit = published.offset;
+            return false;
+        } else if (published.index < reader->position.index) {
+            *limit = reader->file_offset;  //before the writer opens it
+            return false;
+        }
+
+        *limit = -1;
+        return true;
+    }
+
+    *limit = -1;
+    sf_binlog_writer_get_filename(reader->subdir_name,
+            reader->position.index + 1, filename, sizeof(filename));
+    return access(filename, F_OK) == 0;
+}
+
+static int fetch_records(SFBinlogReader *reader, string_t *records)
+{
+    const char *p;
+    const char *end;
+    SFBinlogFrameRecord frame;
+    int result;
+
+    if (reader->framed) {
+        p = reader->buffer.current;
+        end = reader->buffer.end;
+        while ((result=sf_binlog_frame_parse(p, end - p,
+                        &frame, true)) == 0)
+        {
+            p += SF_BINLOG_FRAME_HEADER_SIZE + frame.body.len;
+        }
+
+        if (result == EINVAL && p == reader->buffer.current) {
+            logError("file: "__FILE__", line: %d, "
+                    "binlog file \"%s\", offset: %"PRId64", "
+                    "invalid frame", __LINE__, reader->filename,
+                    reader->position.offset);
+            return EINVAL;
+        }
+    } else {
+        if ((p=(const char *)memrchr(reader->buffer.current, '\n',
+                        reader->buffer.end - reader->buffer.current)) == NULL)
+        {
+            return EAGAIN;
+        }
+        p++;
+    }
+
+    if (p == reader->buffer.current) {
+        return EAGAIN;
+    }
+
+    records->str = reader->buffer.current;
+    records->len = p - reader->buffer.current;
+    reader->buffer.current = (char *)p;
+    reader->position.offset += records->len;
+    return 0;
+}
+
+static int prepare_buffer(SFBinlogReader *reader)
+{
+    int length;
+    int alloc_size;
+    char *buff;
+
+    length = reader->buffer.end - reader->buffer.current;
+    if (reader->buffer.current > reader->buffer.buff) {
+        if (length > 0) {
+            memmove(reader->buffer.buff, reader->buffer.current, length);
+        }
+        reader->buffer.current = reader->buffer.buff;
+        reader->buffer.end = reader->buffer.buff + length;
+        return 0;
+    }
+
+    if (length < reader->buffer.size) {
+        return 0;
+    }
+
+    /* the buffer is full of an incomplete record */
+    alloc_size = reader->buffer.size * 2;
+    if ((buff=(char *)fc_malloc(alloc_size)) == NULL) {
+        return ENOMEM;
+    }
+    memcpy(buff, reader->buffer.buff, length);
+    free(reader->buffer.buff);
+    reader->buffer.buff = reader->buffer.current = buff;
+    reader->buffer.end = buff + length;
+    reader->buffer.size = alloc_size;
+    return 0;
+}
+
+int sf_binlog_reader_read(SFBinlogReader *reader, string_t *records)
+{
+    int result;
+    int bytes;
+    int64_t limit;
+    bool completed;
+
+    while (1) {
+        if (reader->fd < 0) {
+            if ((result=open_readable_binlog(reader)) != 0) {
+                if (result == ENOENT && reader->writer != NULL) {
+                    return EAGAIN;
+                }
+                return result;
+            }
+        }
+
+        if ((result=fetch_records(reader, records)) != EAGAIN) {
+            return result;
+        }
+
+        if ((result=prepare_buffer(reader)) != 0) {
+            return result;
+        }
+
+        completed = get_read_limit(reader, &limit);
+        bytes = reader->buffer.size - (reader->buffer.end -
+                reader->buffer.buff);
+        if (limit >= 0 && reader->file_offset + bytes > limit) {
+            bytes = limit - reader->file_offset;
+        }
+
+        if (bytes > 0) {
+            if ((bytes=pread(reader->fd, reader->buffer.end, bytes,
+                            reader->file_offset)) < 0)
+            {
+                result = errno != 0 ? errno : EIO;
+                logError("file: "__FILE__", line: %d, "
+                        "read binlog file \"%s\" fail, offset: %"PRId64", "
+                        "errno: %d, error info: %s", __LINE__,
+                        reader->filename, reader->file_offset,
+                        result, STRERROR(result));
+                return result;
+            }
+
+            if (bytes > 0) {
+                reader->buffer.end += bytes;
+                reader->file_offset += bytes;
+                continue;
+            }
+        }
+
+        if (!completed) {
+            return reader->writer != NULL ? EAGAIN : ENOENT;
+        }
+
+        /* the tail of the completed file */
+        if (!reader->framed && reader->buffer.end > reader->buffer.current) {
+            records->str = reader->buffer.current;
+            records->len = reader->buffer.end - reader->buffer.current;
+            reader->buffer.current = reader->buffer.end;
+            reader->position.offset += records->len;
+            return 0;
+        }
+
+        if ((result=switch_to_next_binlog(reader)) != 0) {
+            return result;
+        }
+    }
+}
+
+int sf_binlog_reader_demux(SFBinlogReader *reader,
+        sf_binlog_reader_demux_callback callback, void *args)
+{
+    int result;
+    string_t frames;
+    SFBinlogFrameRecord record;
+
+    if (!reader->framed) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, the binlog is not framed",
+                __LINE__, reader->subdir_name);
+        return EINVAL;
+    }
+
+    if ((result=sf_binlog_reader_read(reader, &frames)) != 0) {
+        return result;
+    }
+
+    while ((result=sf_binlog_frame_next(&frames, &record)) == 0) {
+        if ((result=callback(args, &record)) != 0) {
+            return result;
+        }
+    }
+
+    return result == ENOENT ? 0 : result;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//sf_binlog_reader.h
+
+#ifndef _SF_BINLOG_READER_H_
+#define _SF_BINLOG_READER_H_
+
+#include <limits.h>
+#include "sf_types.h"
+#include "sf_binlog_frame.h"
+#include "sf_binlog_writer.h"
+
+#define SF_BINLOG_READER_DEFAULT_BUFFER_SIZE  (4 * 1024 * 1024)
+
+/* return 0 for success, != 0 for error which stops the reading */
+typedef int (*sf_binlog_reader_demux_callback)(void *args,
+        const SFBinlogFrameRecord *record);
+
+typedef struct sf_binlog_reader {
+    char subdir_name[SF_BINLOG_SUBDIR_NAME_SIZE];
+    SFBinlogWriterInfo *writer; //for tailing the live binlog, can be NULL
+    bool framed;
+    int fd;
+    SFBinlogFilePosition position;  //the position of the next record
+    int64_t file_offset;            //the read offset of the fd
+    SFBinlogBuffer buffer;          //the data between current and end unread
+    char filename[PATH_MAX];
+} SFBinlogReader;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* init the reader to read from the position
+ * writer: the writer of the binlog, the reader will not read beyond the
+ *         position published by the writer. can be NULL for offline reading
+ * buffer_size: the readahead buffer size, <= 0 for the default
+ * framed: the binlog is written with SF_BINLOG_WRITER_FLAGS_FRAMED
+ */
+int sf_binlog_reader_init(SFBinlogReader *reader, const char *subdir_name,
+        SFBinlogWriterInfo *writer, const SFBinlogFilePosition *position,
+        const int buffer_size, const bool framed);
+
+void sf_binlog_reader_destroy(SFBinlogReader *reader);
+
+/* read the next batch of the whole records, cross the binlog files
+ * records: return the records which point to the internal buffer,
+ *          valid until the next call
+ * return 0 for success,
+ *        EAGAIN for catching up with the writer,
+ *        ENOENT for no more data without writer,
+ *        other errno for error
+ */
+int sf_binlog_reader_read(SFBinlogReader *reader, string_t *records);
+
+/* read the next batch of the framed records of the shared binlog and
+ * dispatch them to the callback by the stream id
+ * return the same as sf_binlog_reader_read or the result of the callback
+ */
+int sf_binlog_reader_demux(SFBinlogReader *reader,
+        sf_binlog_reader_demux_callback callback, void *args);
+
+static inline void sf_binlog_reader_get_position(SFBinlogReader *reader,
+        SFBinlogFilePosition *position)
+{
+    *position = reader->position;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
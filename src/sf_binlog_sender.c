@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fastcommon/logger.h"
+#include "fastcommon/shared_func.h"
+#include "sf_binlog_sender.h"
+
+int sf_binlog_sender_init(SFBinlogSender *sender, const char *subdir_name,
+        SFBinlogWriterInfo *writer, const int max_send_bytes)
+{
+    snprintf(sender->subdir_name, sizeof(sender->subdir_name),
+            "%s", subdir_name);
+    sender->writer = writer;
+    sender->max_send_bytes = max_send_bytes > 0 ? max_send_bytes :
+        SF_BINLOG_SENDER_DEFAULT_MAX_SEND_BYTES;
+    sender->binlog_index = -1;
+    sender->sendfile.fd = -1;
+    sender->sendfile.offset = 0;
+    sender->sendfile.length = 0;
+    return 0;
+}
+
+void sf_binlog_sender_destroy(SFBinlogSender *sender)
+{
+    if (sender->sendfile.fd >= 0) {
+        close(sender->sendfile.fd);
+        sender->sendfile.fd = -1;
+    }
+    sender->binlog_index = -1;
+    sender->sendfile.length = 0;
+}
+
+static int open_binlog(SFBinlogSender *sender, const int binlog_index)
+{
+    int result;
+    char filename[PATH_MAX];
+
+    if (sender->sendfile.fd >= 0) {
+        close(sender->sendfile.fd);
+        sender->binlog_index = -1;
+    }
+
+    sf_binlog_writer_get_filename(sender->subdir_name,
+            binlog_index, filename, sizeof(filename));
+    if ((sender->sendfile.fd=open(filename, O_RDONLY)) < 0) {
+        result = errno != 0 ? errno : EACCES;
+        if (result != ENOENT) {
+            logError("file: "__FILE__", line: %d, "
+                    "open binlog file \"%s\" fail, "
+                    "errno: %d, error info: %s",
+                    __LINE__, filename, result, STRERROR(result));
+        }
+        return result;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(sender->sendfile.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    sender->binlog_index = binlog_index;
+    return 0;
+}
+
+/* completed: the binlog file will not grow anymore */
+static int get_binlog_end(SFBinlogSender *sender,
+        int64_t *end, bool *completed)
+{
+    int result;
+    struct stat stbuf;
+    SFBinlogFilePosition published;
+    char filename[PATH_MAX];
+
+    if (sender->writer != NULL) {
+        sf_binlog_writer_get_published_position(sender->writer, &published);
+        if (published.index == sender->binlog_index) {
+            *end = published.offset;
+            *completed = false;
+            return 0;
+        } else if (published.index < sender->binlog_index) {
+            *end = 0;
+            *completed = false;
+            return 0;
+        }
+        *completed = true;
+    } else {
+        sf_binlog_writer_get_filename(sender->subdir_name,
+                sender->binlog_index + 1, filename, sizeof(filename));
+        *completed = (access(filename, F_OK) == 0);
+    }
+
+    if (fstat(sender->sendfile.fd, &stbuf) != 0) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "stat binlog file of index %d fail, "
+                "errno: %d, error info: %s", __LINE__,
+                sender->binlog_index, result, STRERROR(result));
+        return result;
+    }
+    *end = stbuf.st_size;
+    return 0;
+}
+
+int sf_binlog_sender_prepare(SFBinlogSender *sender,
+        SFBinlogFilePosition *position, const int window)
+{
+    int result;
+    int64_t end;
+    int64_t length;
+    bool completed;
+
+    sender->sendfile.length = 0;
+    while (1) {
+        if (sender->binlog_index != position->index) {
+            if ((result=open_binlog(sender, position->index)) != 0) {
+                if (result == ENOENT && sender->writer != NULL) {
+                    return EAGAIN;
+                }
+                return result;
+            }
+        }
+
+        if ((result=get_binlog_end(sender, &end, &completed)) != 0) {
+            return result;
+        }
+
+        if (position->offset < end) {
+            length = end - position->offset;
+            if (length > sender->max_send_bytes) {
+                length = sender->max_send_bytes;
+            }
+            if (window > 0 && length > window) {
+                length = window;
+            }
+
+            sender->sendfile.offset = position->offset;
+            sender->sendfile.length = length;
+            return 0;
+        }
+
+        if (position->offset > end && (completed || end > 0)) {
+            logError("file: "__FILE__", line: %d, "
+                    "subdir: %s, binlog index: %d, the position offset: "
+                    "%"PRId64" exceeds the file end: %"PRId64, __LINE__,
+                    sender->subdir_name, position->index,
+                    position->offset, end);
+            return EINVAL;
+        }
+
+        if (!completed) {
+            return sender->writer != NULL ? EAGAIN : ENOENT;
+        }
+
+        position->index++;
+        position->offset = 0;
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//sf_binlog_sender.h
+
+#ifndef _SF_BINLOG_SENDER_H_
+#define _SF_BINLOG_SENDER_H_
+
+#include "sf_types.h"
+#include "sf_binlog_writer.h"
+
+#define SF_BINLOG_SENDER_DEFAULT_MAX_SEND_BYTES  (1024 * 1024)
+
+/* ship the binlog to a replica through sf_nio with sendfile, the
+ * get_sendfile_context callback of SFContext should return the sendfile
+ * context of the sender which the task belongs to
+ */
+typedef struct sf_binlog_sender {
+    char subdir_name[SF_BINLOG_SUBDIR_NAME_SIZE];
+    SFBinlogWriterInfo *writer;  //for the published position, can be NULL
+    int max_send_bytes;          //the max bytes of one shipment
+    int binlog_index;            //the index of the opened file
+    SFSendfileContext sendfile;
+} SFBinlogSender;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int sf_binlog_sender_init(SFBinlogSender *sender, const char *subdir_name,
+        SFBinlogWriterInfo *writer, const int max_send_bytes);
+
+void sf_binlog_sender_destroy(SFBinlogSender *sender);
+
+/* prepare the binlog region to ship after the response header
+ * position: the position the replica requests (resume from), it moves to
+ *           the next binlog file when the current one was shipped completely
+ * window: the bytes the replica can receive for flow control,
+ *         the shipment length <= min(window, max_send_bytes)
+ * return 0 for success, EAGAIN for catching up with the writer,
+ *        ENOENT for no more data without writer, other errno for error
+ */
+int sf_binlog_sender_prepare(SFBinlogSender *sender,
+        SFBinlogFilePosition *position, const int window);
+
+static inline SFSendfileContext *sf_binlog_sender_get_sendfile_context(
+        SFBinlogSender *sender)
+{
+    return &sender->sendfile;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include "fastcommon/logger.h"
+#include "fastcommon/shared_func.h"
+#include "sf_binlog_version_index.h"
+
+static int open_index_file(const char *subdir_name, const int flags,
+        char *filename, const int size, int *fd, int64_t *entry_count)
+{
+    int result;
+    int64_t file_size;
+
+    sf_binlog_version_index_get_filename(subdir_name, filename, size);
+    if ((*fd=open(filename, flags)) < 0) {
+        result = errno != 0 ? errno : EACCES;
+        if (result != ENOENT) {
+            logError("file: "__FILE__", line: %d, "
+                    "open file \"%s\" fail, "
+                    "errno: %d, error info: %s",
+                    __LINE__, filename, result, STRERROR(result));
+        }
+        return result;
+    }
+
+    if ((file_size=lseek(*fd, 0, SEEK_END)) < 0) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "lseek file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, filename, result, STRERROR(result));
+        close(*fd);
+        return result;
+    }
+
+    /* ignore the torn entry at the end */
+    *entry_count = file_size / SF_BINLOG_VERSION_INDEX_ENTRY_SIZE;
+    return 0;
+}
+
+static int read_entry(const int fd, const char *filename,
+        const int64_t entry_index, SFBinlogVersionIndexEntry *entry)
+{
+    int result;
+    int64_t offset;
+    char buff[SF_BINLOG_VERSION_INDEX_ENTRY_SIZE];
+
+    offset = entry_index * SF_BINLOG_VERSION_INDEX_ENTRY_SIZE;
+    if (pread(fd, buff, sizeof(buff), offset) != sizeof(buff)) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "read file \"%s\" fail, offset: %"PRId64", "
+                "errno: %d, error info: %s", __LINE__,
+                filename, offset, result, STRERROR(result));
+        return result;
+    }
+
+    if ((result=sf_binlog_version_index_unpack(buff, entry)) != 0) {
+        logWarning("file: "__FILE__", line: %d, "
+                "file \"%s\", invalid entry #%"PRId64", crc32 mismatch",
+                __LINE__, filename, entry_index);
+    }
+    return result;
+}
+
+int sf_binlog_version_index_get_last(const char *subdir_name,
+        SFBinlogVersionIndexEntry *entry, int64_t *entry_count)
+{
+    int result;
+    int fd;
+    char filename[PATH_MAX];
+
+    if ((result=open_index_file(subdir_name, O_RDONLY, filename,
+                    sizeof(filename), &fd, entry_count)) != 0)
+    {
+        *entry_count = 0;
+        return result;
+    }
+
+    result = ENOENT;
+    while (*entry_count > 0) {
+        if ((result=read_entry(fd, filename, *entry_count - 1,
+                        entry)) != EINVAL)
+        {
+            break;
+        }
+        (*entry_count)--;   //skip the torn entry
+        result = ENOENT;
+    }
+
+    close(fd);
+    return result;
+}
+
+int sf_binlog_version_index_lookup(const char *subdir_name,
+        const int64_t version, SFBinlogFilePosition *position)
+{
+    int result;
+    int fd;
+    int64_t entry_count;
+    int64_t low;
+    int64_t high;
+    int64_t mid;
+    bool found;
+    SFBinlogVersionIndexEntry entry;
+    char filename[PATH_MAX];
+
+    if ((result=open_index_file(subdir_name, O_RDONLY, filename,
+                    sizeof(filename), &fd, &entry_count)) != 0)
+    {
+        return result;
+    }
+
+    found = false;
+    low = 0;
+    high = entry_count - 1;
+    while (low <= high) {
+        mid = (low + high) / 2;
+        if ((result=read_entry(fd, filename, mid, &entry)) != 0) {
+            if (result == EINVAL) {  //treat the torn entry as the end
+                high = mid - 1;
+                continue;
+            }
+            break;
+        }
+
+        if (entry.version <= version) {
+            *position = entry.position;
+            found = true;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    close(fd);
+    if (result != 0 && result != EINVAL) {
+        return result;
+    }
+    return found ? 0 : ENOENT;
+}
+
+int sf_binlog_version_index_truncate(const char *subdir_name,
+        const SFBinlogFilePosition *position)
+{
+    int result;
+    int fd;
+    int64_t entry_count;
+    int64_t low;
+    int64_t high;
+    int64_t mid;
+    SFBinlogVersionIndexEntry entry;
+    char filename[PATH_MAX];
+
+    if ((result=open_index_file(subdir_name, O_RDWR, filename,
+                    sizeof(filename), &fd, &entry_count)) != 0)
+    {
+        return result;
+    }
+
+    /* bisect the first entry whose position >= the given position */
+    low = 0;
+    high = entry_count - 1;
+    while (low <= high) {
+        mid = (low + high) / 2;
+        if ((result=read_entry(fd, filename, mid, &entry)) != 0) {
+            if (result == EINVAL) {  //treat the torn entry as the end
+                high = mid - 1;
+                continue;
+            }
+            close(fd);
+            return result;
+        }
+
+        if (entry.position.index < position->index ||
+                (entry.position.index == position->index &&
+                 entry.position.offset < position->offset))
+        {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    result = 0;
+    if (ftruncate(fd, low * SF_BINLOG_VERSION_INDEX_ENTRY_SIZE) != 0 ||
+            fsync(fd) != 0)
+    {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "truncate file \"%s\" to %"PRId64" entries fail, "
+                "errno: %d, error info: %s", __LINE__,
+                filename, low, result, STRERROR(result));
+    }
+
+    close(fd);
+    return result;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2020 YuQing <384681@qq.com>
+ *
+ * This program is free software: you can use, redistribute, and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3
+ * or later ("AGPL"), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//sf_binlog_version_index.h
+
+#ifndef _SF_BINLOG_VERSION_INDEX_H_
+#define _SF_BINLOG_VERSION_INDEX_H_
+
+#include "fastcommon/common_define.h"
+#include "fastcommon/shared_func.h"
+#include "sf_types.h"
+#include "sf_binlog_frame.h"
+
+#define SF_BINLOG_VERSION_INDEX_FILENAME  "binlog_version.idx"
+
+#define SF_BINLOG_VERSION_INDEX_ENTRY_SIZE \
+    ((int)sizeof(SFBinlogVersionIndexRecord))
+
+/* the sparse index entry: the first record whose version >= the
+   entry version starts at the entry position */
+typedef struct sf_binlog_version_index_entry {
+    int64_t version;
+    SFBinlogFilePosition position;
+} SFBinlogVersionIndexEntry;
+
+typedef struct sf_binlog_version_index_record {
+    char version[8];
+    char offset[8];
+    char binlog_index[4];
+    char crc32[4];
+} SFBinlogVersionIndexRecord;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    extern char *g_sf_binlog_data_path;
+
+static inline const char *sf_binlog_version_index_get_filename(
+        const char *subdir_name, char *filename, const int size)
+{
+    snprintf(filename, size, "%s/%s/%s", g_sf_binlog_data_path,
+            subdir_name, SF_BINLOG_VERSION_INDEX_FILENAME);
+    return filename;
+}
+
+static inline void sf_binlog_version_index_pack(
+        const SFBinlogVersionIndexEntry *entry, char *buff)
+{
+    SFBinlogVersionIndexRecord *record;
+
+    record = (SFBinlogVersionIndexRecord *)buff;
+    long2buff(entry->version, record->version);
+    long2buff(entry->position.offset, record->offset);
+    int2buff(entry->position.index, record->binlog_index);
+    int2buff(sf_crc32c(0, record, record->crc32 - (char *)record),
+            record->crc32);
+}
+
+/* return 0 for success, EINVAL for the torn entry */
+static inline int sf_binlog_version_index_unpack(const char *buff,
+        SFBinlogVersionIndexEntry *entry)
+{
+    const SFBinlogVersionIndexRecord *record;
+
+    record = (const SFBinlogVersionIndexRecord *)buff;
+    if ((uint32_t)buff2int(record->crc32) != sf_crc32c(0, record,
+                record->crc32 - (const char *)record))
+    {
+        return EINVAL;
+    }
+
+    entry->version = buff2long(record->version);
+    entry->position.offset = buff2long(record->offset);
+    entry->position.index = buff2int(record->binlog_index);
+    return 0;
+}
+
+/* load the last entry of the index file
+ * return 0 for success, ENOENT for empty index
+ */
+int sf_binlog_version_index_get_last(const char *subdir_name,
+        SFBinlogVersionIndexEntry *entry, int64_t *entry_count);
+
+/* bisect the index to find the last entry whose version <= the given
+ * version, the caller should scan the binlog from the returned position
+ * return 0 for success, ENOENT for not found
+ */
+int sf_binlog_version_index_lookup(const char *subdir_name,
+        const int64_t version, SFBinlogFilePosition *position);
+
+/* remove the entries whose position >= the given position
+ * return 0 for success, ENOENT for no index file
+ */
+int sf_binlog_version_index_truncate(const char *subdir_name,
+        const SFBinlogFilePosition *position);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
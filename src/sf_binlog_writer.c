@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <pthread.h>
 #include "fastcommon/logger.h"
 #include "fastcommon/sockopt.h"
@@ -33,12 +34,106 @@
 #include "sf_global.h"
 #include "sf_func.h"
 #include "sf_binlog_writer.h"
+#include "sf_binlog_version_index.h"
+#include "sf_binlog_reader.h"
 
 #define BINLOG_INDEX_FILENAME  SF_BINLOG_FILE_PREFIX"_index.dat"
 
 #define BINLOG_INDEX_ITEM_CURRENT_WRITE     "current_write"
 #define BINLOG_INDEX_ITEM_CURRENT_COMPRESS  "current_compress"
 
+/* the fixed size index meta file with two slots, the slots are written
+   alternately so the last valid one survives the torn write. the legacy
+   index file is still updated for the old programs and tools, but only
+   at startup and finish, never in the writer thread */
+#define BINLOG_INDEX_META_FILENAME  SF_BINLOG_FILE_PREFIX"_index.meta"
+#define BINLOG_INDEX_META_MAGIC     "SFBI"
+#define BINLOG_INDEX_META_SLOT_SIZE  512
+
+typedef struct {
+    char magic[4];
+    char generation[8];
+    char current_write[4];
+    char current_compress[4];
+    char crc32[4];
+} BinlogIndexMetaSlot;
+
+/* the truncation intent is written before truncating and removed after,
+   so the interrupted truncation is redone when the writer inits */
+#define BINLOG_TRUNCATE_FILENAME  SF_BINLOG_FILE_PREFIX"_truncate.dat"
+#define BINLOG_TRUNCATE_MAGIC     "SFBT"
+
+typedef struct {
+    char magic[4];
+    char binlog_index[4];
+    char last_index[4];  //the write index before truncating
+    char offset[8];
+    char crc32[4];
+} BinlogTruncateIntent;
+
+typedef struct {
+    SFBinlogWriterBuffer notify;  //the control buffer for the writer thread
+    bool by_version;
+    bool done;
+    int result;
+    int64_t version;
+    SFBinlogFilePosition position;
+    pthread_lock_cond_pair_t lcp;
+} BinlogTruncateContext;
+
+/* detach the writer from the pool thread after its records written */
+typedef struct {
+    SFBinlogWriterBuffer notify;  //the control buffer for the writer thread
+    bool done;
+    int result;
+    pthread_lock_cond_pair_t lcp;
+} BinlogDetachContext;
+
+#ifdef O_DIRECT
+#define BINLOG_O_DIRECT  O_DIRECT
+#else
+#define BINLOG_O_DIRECT  0
+#endif
+
+#define DIRECT_IO_ALIGN_SIZE  SF_BINLOG_DIRECT_IO_ALIGN_SIZE
+#define DIRECT_IO_ENABLED(writer) \
+    ((writer->cfg.flags & SF_BINLOG_WRITER_FLAGS_DIRECT_IO) != 0)
+
+#define FRAMED_ENABLED(writer) \
+    ((writer->cfg.flags & SF_BINLOG_WRITER_FLAGS_FRAMED) != 0)
+
+#define VERSION_INDEX_ENABLED(writer) (writer->version_index.fd >= 0)
+
+/* the seqlock of the stats snapshot, the writer thread is the only
+   publisher, and the readers retry when the snapshot is torn */
+#define STATS_PUBLISH(published, current) \
+    do { \
+        __atomic_store_n(&(published)->seq, (published)->seq + 1, \
+                __ATOMIC_RELAXED); \
+        __atomic_thread_fence(__ATOMIC_RELEASE); \
+        (published)->stats = current; \
+        __atomic_store_n(&(published)->seq, (published)->seq + 1, \
+                __ATOMIC_RELEASE); \
+    } while (0)
+
+#define STATS_FETCH(published, dest) \
+    do { \
+        int64_t seq; \
+        do { \
+            while (((seq=__atomic_load_n(&(published)->seq, \
+                                __ATOMIC_ACQUIRE)) & 1) != 0) \
+            { \
+                sched_yield(); \
+            } \
+            dest = (published)->stats; \
+            __atomic_thread_fence(__ATOMIC_ACQUIRE); \
+        } while (__atomic_load_n(&(published)->seq, \
+                    __ATOMIC_RELAXED) != seq); \
+    } while (0)
+
+#define STATS_ENABLED(writer) \
+    ((writer->cfg.flags & SF_BINLOG_WRITER_FLAGS_STATS) != 0)
+
 #define GET_BINLOG_FILENAME(writer) \
     sprintf(writer->file.name, "%s/%s/%s"SF_BINLOG_FILE_EXT_FMT,  \
             g_sf_binlog_data_path, writer->cfg.subdir_name, \
@@ -46,7 +141,14 @@
 
 char *g_sf_binlog_data_path = NULL;
 
-static int write_to_binlog_index_file(SFBinlogWriterInfo *writer)
+static inline void get_binlog_index_meta_filename(
+        SFBinlogWriterInfo *writer, char *filename, const int size)
+{
+    snprintf(filename, size, "%s/%s/%s", g_sf_binlog_data_path,
+            writer->cfg.subdir_name, BINLOG_INDEX_META_FILENAME);
+}
+
+static int write_to_legacy_binlog_index_file(SFBinlogWriterInfo *writer)
 {
     char full_filename[PATH_MAX];
     char buff[256];
@@ -74,22 +176,144 @@ static int write_to_binlog_index_file(SFBinlogWriterInfo *writer)
     return result;
 }
 
-static int get_binlog_index_from_file(SFBinlogWriterInfo *writer)
+static inline void check_write_legacy_binlog_index_file(
+        SFBinlogWriterInfo *writer)
+{
+    if (writer->binlog.legacy_dirty) {
+        /* for the old programs and tools only, so don't retry */
+        writer->binlog.legacy_dirty = false;
+        write_to_legacy_binlog_index_file(writer);
+    }
+}
+
+static int open_binlog_index_meta(SFBinlogWriterInfo *writer,
+        bool *created)
 {
     char full_filename[PATH_MAX];
-    IniContext ini_context;
     int result;
 
-    snprintf(full_filename, sizeof(full_filename), "%s/%s/%s",
-            g_sf_binlog_data_path, writer->cfg.subdir_name,
-            BINLOG_INDEX_FILENAME);
-    if (access(full_filename, F_OK) != 0) {
-        if (errno == ENOENT) {
-            writer->binlog.index = 0;
-            return write_to_binlog_index_file(writer);
+    *created = false;
+    if (writer->binlog.meta_fd >= 0) {
+        return 0;
+    }
+
+    get_binlog_index_meta_filename(writer, full_filename,
+            sizeof(full_filename));
+    if ((writer->binlog.meta_fd=open(full_filename, O_RDWR)) < 0 &&
+            errno == ENOENT)
+    {
+        *created = true;
+        writer->binlog.meta_fd = open(full_filename,
+                O_RDWR | O_CREAT, 0644);
+    }
+    if (writer->binlog.meta_fd < 0) {
+        result = errno != 0 ? errno : EACCES;
+        logError("file: "__FILE__", line: %d, "
+                "open file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, full_filename,
+                result, STRERROR(result));
+        return result;
+    }
+
+    return 0;
+}
+
+/* update one slot in place with pwrite and fdatasync instead of
+   writing the temp file and renaming */
+static int write_to_binlog_index_file(SFBinlogWriterInfo *writer)
+{
+    char full_filename[PATH_MAX];
+    BinlogIndexMetaSlot slot;
+    int64_t offset;
+    int result;
+    int fd;
+
+    fd = writer->binlog.meta_fd;
+    writer->binlog.legacy_dirty = true;
+    writer->binlog.generation++;
+    memcpy(slot.magic, BINLOG_INDEX_META_MAGIC, sizeof(slot.magic));
+    long2buff(writer->binlog.generation, slot.generation);
+    int2buff(writer->binlog.index, slot.current_write);
+    int2buff(writer->binlog.compress_index, slot.current_compress);
+    int2buff(sf_crc32c(0, &slot, slot.crc32 - (char *)&slot), slot.crc32);
+
+    offset = (writer->binlog.generation % 2) * BINLOG_INDEX_META_SLOT_SIZE;
+    if (pwrite(fd, &slot, sizeof(slot), offset) != sizeof(slot)) {
+        result = errno != 0 ? errno : EIO;
+    } else {
+#ifdef OS_LINUX
+        result = fdatasync(fd) == 0 ? 0 : (errno != 0 ? errno : EIO);
+#else
+        result = fsync(fd) == 0 ? 0 : (errno != 0 ? errno : EIO);
+#endif
+    }
+
+    if (result != 0) {
+        get_binlog_index_meta_filename(writer, full_filename,
+                sizeof(full_filename));
+        logError("file: "__FILE__", line: %d, "
+            "write to file \"%s\" fail, "
+            "errno: %d, error info: %s",
+            __LINE__, full_filename,
+            result, STRERROR(result));
+    }
+    return result;
+}
+
+/* return 0 for success, ENOENT for no valid slot */
+static int load_from_binlog_index_meta(SFBinlogWriterInfo *writer)
+{
+    char full_filename[PATH_MAX];
+    BinlogIndexMetaSlot slot;
+    int64_t generation;
+    int result;
+    int fd;
+    int i;
+
+    fd = writer->binlog.meta_fd;
+    result = ENOENT;
+    writer->binlog.generation = 0;
+    for (i=0; i<2; i++) {
+        if (pread(fd, &slot, sizeof(slot), i * BINLOG_INDEX_META_SLOT_SIZE)
+                != sizeof(slot))
+        {
+            continue;
+        }
+        if (memcmp(slot.magic, BINLOG_INDEX_META_MAGIC,
+                    sizeof(slot.magic)) != 0 ||
+                (uint32_t)buff2int(slot.crc32) != sf_crc32c(0,
+                    &slot, slot.crc32 - (char *)&slot))
+        {
+            continue;
+        }
+
+        generation = buff2long(slot.generation);
+        if (generation > writer->binlog.generation) {
+            writer->binlog.generation = generation;
+            writer->binlog.index = buff2int(slot.current_write);
+            writer->binlog.compress_index = buff2int(slot.current_compress);
+            result = 0;
         }
     }
 
+    if (result != 0) {
+        get_binlog_index_meta_filename(writer, full_filename,
+                sizeof(full_filename));
+        logWarning("file: "__FILE__", line: %d, "
+                "file \"%s\" has no valid slot",
+                __LINE__, full_filename);
+    }
+    return result;
+}
+
+/* the legacy index file for upgrading */
+static int load_from_binlog_index_file(SFBinlogWriterInfo *writer,
+        const char *full_filename)
+{
+    IniContext ini_context;
+    int result;
+
     if ((result=iniLoadFromFile(full_filename, &ini_context)) != 0) {
         logError("file: "__FILE__", line: %d, "
                 "load from file \"%s\" fail, error code: %d",
@@ -106,190 +330,898 @@ static int get_binlog_index_from_file(SFBinlogWriterInfo *writer)
     return 0;
 }
 
-static int open_writable_binlog(SFBinlogWriterInfo *writer)
+static int get_binlog_index_from_file(SFBinlogWriterInfo *writer)
 {
-    if (writer->file.fd >= 0) {
-        close(writer->file.fd);
+    char full_filename[PATH_MAX];
+    bool created;
+    int result;
+
+    if ((result=open_binlog_index_meta(writer, &created)) != 0) {
+        return result;
+    }
+    if (!created && load_from_binlog_index_meta(writer) == 0) {
+        /* the legacy maybe stale when the last run crashed */
+        writer->binlog.legacy_dirty = true;
+        return 0;
     }
 
-    GET_BINLOG_FILENAME(writer);
-    writer->file.fd = open(writer->file.name,
-            O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (writer->file.fd < 0) {
+    snprintf(full_filename, sizeof(full_filename), "%s/%s/%s",
+            g_sf_binlog_data_path, writer->cfg.subdir_name,
+            BINLOG_INDEX_FILENAME);
+    if (access(full_filename, F_OK) != 0 && errno == ENOENT) {
+        writer->binlog.index = 0;
+        writer->binlog.compress_index = 0;
+    } else if ((result=load_from_binlog_index_file(writer,
+                    full_filename)) != 0)
+    {
+        return result;
+    }
+
+    writer->binlog.generation = 0;
+    if ((result=write_to_binlog_index_file(writer)) != 0) {
+        return result;
+    }
+    writer->binlog.legacy_dirty = false;  //the same as the legacy
+
+    if (created) {  //persist the directory entry of the new file
+        get_binlog_index_meta_filename(writer, full_filename,
+                sizeof(full_filename));
+        return sf_fsync_parent_dir(full_filename);
+    }
+    return 0;
+}
+
+static inline void get_binlog_truncate_filename(
+        SFBinlogWriterInfo *writer, char *filename, const int size)
+{
+    snprintf(filename, size, "%s/%s/%s", g_sf_binlog_data_path,
+            writer->cfg.subdir_name, BINLOG_TRUNCATE_FILENAME);
+}
+
+static int write_binlog_truncate_intent(SFBinlogWriterInfo *writer,
+        const SFBinlogFilePosition *position, const int last_index)
+{
+    char full_filename[PATH_MAX];
+    BinlogTruncateIntent intent;
+    int result;
+    int fd;
+
+    memcpy(intent.magic, BINLOG_TRUNCATE_MAGIC, sizeof(intent.magic));
+    int2buff(position->index, intent.binlog_index);
+    int2buff(last_index, intent.last_index);
+    long2buff(position->offset, intent.offset);
+    int2buff(sf_crc32c(0, &intent, intent.crc32 - (char *)&intent),
+            intent.crc32);
+
+    get_binlog_truncate_filename(writer, full_filename,
+            sizeof(full_filename));
+    if ((fd=open(full_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        result = errno != 0 ? errno : EACCES;
         logError("file: "__FILE__", line: %d, "
                 "open file \"%s\" fail, "
                 "errno: %d, error info: %s",
-                __LINE__, writer->file.name,
-                errno, STRERROR(errno));
-        return errno != 0 ? errno : EACCES;
+                __LINE__, full_filename,
+                result, STRERROR(result));
+        return result;
     }
 
-    writer->file.size = lseek(writer->file.fd, 0, SEEK_END);
-    if (writer->file.size < 0) {
-        logError("file: "__FILE__", line: %d, "
-                "lseek file \"%s\" fail, "
-                "errno: %d, error info: %s",
-                __LINE__, writer->file.name,
-                errno, STRERROR(errno));
-        return errno != 0 ? errno : EIO;
+    if (fc_safe_write(fd, (char *)&intent, sizeof(intent)) !=
+            sizeof(intent))
+    {
+        result = errno != 0 ? errno : EIO;
+    } else {
+        result = fsync(fd) == 0 ? 0 : (errno != 0 ? errno : EIO);
     }
+    close(fd);
 
-    return 0;
+    if (result != 0) {
+        logError("file: "__FILE__", line: %d, "
+            "write to file \"%s\" fail, "
+            "errno: %d, error info: %s",
+            __LINE__, full_filename,
+            result, STRERROR(result));
+    }
+    return result;
 }
 
-static int open_next_binlog(SFBinlogWriterInfo *writer)
+/* return 0 for success, ENOENT for no intent, EINVAL for the torn intent */
+static int load_binlog_truncate_intent(SFBinlogWriterInfo *writer,
+        SFBinlogFilePosition *position, int *last_index)
 {
-    GET_BINLOG_FILENAME(writer);
-    if (access(writer->file.name, F_OK) == 0) {
-        char bak_filename[PATH_MAX];
-        char date_str[32];
+    char full_filename[PATH_MAX];
+    BinlogTruncateIntent intent;
+    int result;
+    int fd;
 
-        snprintf(bak_filename, sizeof(bak_filename), "%s.%s",
-                writer->file.name, formatDatetime(g_current_time,
-                    "%Y%m%d%H%M%S", date_str, sizeof(date_str)));
-        if (rename(writer->file.name, bak_filename) == 0) {
-            logWarning("file: "__FILE__", line: %d, "
-                    "binlog file %s exist, rename to %s",
-                    __LINE__, writer->file.name, bak_filename);
-        } else {
+    get_binlog_truncate_filename(writer, full_filename,
+            sizeof(full_filename));
+    if ((fd=open(full_filename, O_RDONLY)) < 0) {
+        result = errno != 0 ? errno : EACCES;
+        if (result != ENOENT) {
             logError("file: "__FILE__", line: %d, "
-                    "rename binlog %s to backup %s fail, "
+                    "open file \"%s\" fail, "
                     "errno: %d, error info: %s",
-                    __LINE__, writer->file.name, bak_filename,
-                    errno, STRERROR(errno));
-            return errno != 0 ? errno : EPERM;
+                    __LINE__, full_filename,
+                    result, STRERROR(result));
         }
+        return result;
     }
 
-    return open_writable_binlog(writer);
+    if (fc_safe_read(fd, (char *)&intent, sizeof(intent)) !=
+            sizeof(intent) || memcmp(intent.magic, BINLOG_TRUNCATE_MAGIC,
+                sizeof(intent.magic)) != 0 || (uint32_t)buff2int(
+                intent.crc32) != sf_crc32c(0, &intent,
+                    intent.crc32 - (char *)&intent))
+    {
+        result = EINVAL;
+    } else {
+        position->index = buff2int(intent.binlog_index);
+        position->offset = buff2long(intent.offset);
+        *last_index = buff2int(intent.last_index);
+        result = 0;
+    }
+    close(fd);
+    return result;
 }
 
-static int do_write_to_file(SFBinlogWriterInfo *writer,
-        char *buff, const int len)
+static int remove_binlog_truncate_intent(SFBinlogWriterInfo *writer)
 {
+    char full_filename[PATH_MAX];
     int result;
 
-    if (fc_safe_write(writer->file.fd, buff, len) != len) {
-        result = errno != 0 ? errno : EIO;
+    get_binlog_truncate_filename(writer, full_filename,
+            sizeof(full_filename));
+    if (unlink(full_filename) != 0 && errno != ENOENT) {
+        result = errno != 0 ? errno : EPERM;
         logError("file: "__FILE__", line: %d, "
-                "write to binlog file \"%s\" fail, "
+                "unlink file \"%s\" fail, "
                 "errno: %d, error info: %s",
-                __LINE__, writer->file.name,
+                __LINE__, full_filename,
                 result, STRERROR(result));
         return result;
     }
+    return 0;
+}
 
-    if (fsync(writer->file.fd) != 0) {
-        result = errno != 0 ? errno : EIO;
+static int truncate_binlog_file(const char *filename, const int64_t size)
+{
+    int result;
+    int fd;
+
+    if ((fd=open(filename, O_WRONLY)) < 0) {
+        result = errno != 0 ? errno : EACCES;
         logError("file: "__FILE__", line: %d, "
-                "fsync to binlog file \"%s\" fail, "
+                "open file \"%s\" fail, "
                 "errno: %d, error info: %s",
-                __LINE__, writer->file.name,
-                result, STRERROR(result));
+                __LINE__, filename, result, STRERROR(result));
         return result;
     }
 
-    writer->file.size += len;
-    return 0;
+    if (ftruncate(fd, size) != 0 || fsync(fd) != 0) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "truncate file \"%s\" to %"PRId64" fail, "
+                "errno: %d, error info: %s", __LINE__,
+                filename, size, result, STRERROR(result));
+    } else {
+        result = 0;
+    }
+    close(fd);
+    return result;
 }
 
-static int check_write_to_file(SFBinlogWriterInfo *writer,
-        char *buff, const int len)
+/* the steps are idempotent for redoing: truncate the version index,
+   switch the binlog index, truncate the binlog and remove the later ones */
+static int do_binlog_truncate(SFBinlogWriterInfo *writer,
+        const SFBinlogFilePosition *position, const int last_index)
 {
+    char filename[PATH_MAX];
     int result;
+    int index;
 
-    if (writer->file.size + len <= SF_BINLOG_FILE_MAX_SIZE) {
-        return do_write_to_file(writer, buff, len);
+    if ((result=sf_binlog_version_index_truncate(writer->cfg.subdir_name,
+                    position)) != 0 && result != ENOENT)
+    {
+        return result;
     }
 
-    writer->binlog.index++;  //binlog rotate
-    if ((result=write_to_binlog_index_file(writer)) == 0) {
-        result = open_next_binlog(writer);
+    if (writer->binlog.index != position->index) {
+        writer->binlog.index = position->index;
+        if ((result=write_to_binlog_index_file(writer)) != 0) {
+            return result;
+        }
     }
 
-    if (result != 0) {
-        logError("file: "__FILE__", line: %d, "
-                "open binlog file \"%s\" fail",
-                __LINE__, writer->file.name);
+    sf_binlog_writer_get_filename(writer->cfg.subdir_name,
+            position->index, filename, sizeof(filename));
+    if ((result=truncate_binlog_file(filename, position->offset)) != 0) {
         return result;
     }
 
-    return do_write_to_file(writer, buff, len);
+    for (index=position->index + 1; index<=last_index; index++) {
+        sf_binlog_writer_get_filename(writer->cfg.subdir_name,
+                index, filename, sizeof(filename));
+        if (unlink(filename) != 0 && errno != ENOENT) {
+            result = errno != 0 ? errno : EPERM;
+            logError("file: "__FILE__", line: %d, "
+                    "unlink file \"%s\" fail, "
+                    "errno: %d, error info: %s",
+                    __LINE__, filename, result, STRERROR(result));
+            return result;
+        }
+    }
+
+    return remove_binlog_truncate_intent(writer);
 }
 
-static int binlog_write_to_file(SFBinlogWriterInfo *writer)
+static int redo_binlog_truncate(SFBinlogWriterInfo *writer)
 {
+    SFBinlogFilePosition position;
+    int last_index;
     int result;
-    int len;
 
-    len = SF_BINLOG_BUFFER_LENGTH(writer->binlog_buffer);
-    if (len == 0) {
-        return 0;
+    if ((result=load_binlog_truncate_intent(writer,
+                    &position, &last_index)) != 0)
+    {
+        if (result == ENOENT) {
+            return 0;
+        } else if (result == EINVAL) {  //nothing truncated yet
+            return remove_binlog_truncate_intent(writer);
+        }
+        return result;
     }
 
-    result = check_write_to_file(writer, writer->binlog_buffer.buff, len);
-    writer->binlog_buffer.end = writer->binlog_buffer.buff;
-    return result;
+    logWarning("file: "__FILE__", line: %d, "
+            "subdir_name: %s, redo the interrupted binlog truncation, "
+            "binlog index: %d, offset: %"PRId64", last index: %d",
+            __LINE__, writer->cfg.subdir_name, position.index,
+            position.offset, last_index);
+    return do_binlog_truncate(writer, &position, last_index);
 }
 
-int sf_binlog_get_current_write_index(SFBinlogWriterInfo *writer)
+static int direct_io_load_tail(SFBinlogWriterInfo *writer,
+        const bool strip_padding)
 {
-    if (writer == NULL) {   //for data recovery
+    int fd;
+    int result;
+    int bytes;
+    int64_t block_offset;
+    char *p;
+
+    writer->binlog_buffer.current = writer->binlog_buffer.end =
+        writer->binlog_buffer.buff;
+    if (writer->file.size == 0) {
         return 0;
     }
 
-    if (writer->binlog.index < 0) {
-        get_binlog_index_from_file(writer);
+    if ((fd=open(writer->file.name, O_RDONLY)) < 0) {
+        result = errno != 0 ? errno : EACCES;
+        logError("file: "__FILE__", line: %d, "
+                "open file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, writer->file.name,
+                result, STRERROR(result));
+        return result;
     }
 
-    return writer->binlog.index;
-}
+    block_offset = (writer->file.size - 1) /
+        DIRECT_IO_ALIGN_SIZE * DIRECT_IO_ALIGN_SIZE;
+    bytes = writer->file.size - block_offset;
+    if (pread(fd, writer->binlog_buffer.buff, bytes,
+                block_offset) != bytes)
+    {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "read file \"%s\" fail, offset: %"PRId64", "
+                "errno: %d, error info: %s", __LINE__,
+                writer->file.name, block_offset,
+                result, STRERROR(result));
+        close(fd);
+        return result;
+    }
+    close(fd);
 
-void sf_binlog_get_current_write_position(SFBinlogWriterInfo *writer,
-        SFBinlogFilePosition *position)
-{
-    position->index = writer->binlog.index;
-    position->offset = writer->file.size;
-}
+    /* strip the zero padding of the last block */
+    p = writer->binlog_buffer.buff + bytes;
+    while (strip_padding && p > writer->binlog_buffer.buff &&
+            *(p - 1) == '\0')
+    {
+        --p;
+    }
+    bytes = p - writer->binlog_buffer.buff;
 
-static inline void binlog_writer_set_next_version(SFBinlogWriterInfo *writer,
-        const uint64_t next_version)
-{
-    writer->version_ctx.next = next_version;
+    if (block_offset + bytes < writer->file.size) {
+        writer->file.size = block_offset + bytes;
+        if (ftruncate(writer->file.fd, writer->file.size) != 0) {
+            result = errno != 0 ? errno : EIO;
+            logError("file: "__FILE__", line: %d, "
+                    "truncate file \"%s\" to %"PRId64" fail, "
+                    "errno: %d, error info: %s", __LINE__,
+                    writer->file.name, writer->file.size,
+                    result, STRERROR(result));
+            return result;
+        }
+    }
+
+    writer->binlog_buffer.current = writer->binlog_buffer.end =
+        writer->binlog_buffer.buff + bytes;
+    return 0;
 }
 
-static inline int deal_binlog_one_record(SFBinlogWriterBuffer *wb)
+/* truncate the torn tail after the last valid frame */
+static int framed_binlog_recover(SFBinlogWriterInfo *writer)
 {
     int result;
+    int64_t valid_size;
 
-    if (wb->bf.length >= wb->writer->binlog_buffer.size / 4) {
-        if (SF_BINLOG_BUFFER_LENGTH(wb->writer->binlog_buffer) > 0) {
-            if ((result=binlog_write_to_file(wb->writer)) != 0) {
+    if ((result=sf_binlog_frame_check_file(writer->file.name,
+                    writer->file.size, &valid_size)) != 0)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "check binlog file \"%s\" fail, file size: %"PRId64,
+                __LINE__, writer->file.name, writer->file.size);
+        return result;
+    }
+
+    if (valid_size == writer->file.size) {
+        return 0;
+    }
+
+    logWarning("file: "__FILE__", line: %d, "
+            "binlog file \"%s\", truncate the torn tail, "
+            "file size: %"PRId64", valid size: %"PRId64, __LINE__,
+            writer->file.name, writer->file.size, valid_size);
+    if (ftruncate(writer->file.fd, valid_size) != 0) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "truncate file \"%s\" to %"PRId64" fail, "
+                "errno: %d, error info: %s", __LINE__,
+                writer->file.name, valid_size,
+                result, STRERROR(result));
+        return result;
+    }
+
+    writer->file.size = valid_size;
+    return 0;
+}
+
+/* for the readers which tail the binlog in other threads,
+   the offset MUST be set before the index when rotating */
+static inline void publish_write_position(SFBinlogWriterInfo *writer)
+{
+    writer->published.offset = writer->file.size;
+    __sync_synchronize();
+    writer->published.index = writer->binlog.index;
+}
+
+static void close_writable_binlog(SFBinlogWriterInfo *writer)
+{
+    if (writer->file.fd < 0) {
+        return;
+    }
+
+    /* remove the zero padding of the last block */
+    if (DIRECT_IO_ENABLED(writer) && writer->file.size %
+            DIRECT_IO_ALIGN_SIZE != 0)
+    {
+        if (ftruncate(writer->file.fd, writer->file.size) != 0) {
+            logWarning("file: "__FILE__", line: %d, "
+                    "truncate file \"%s\" to %"PRId64" fail, "
+                    "errno: %d, error info: %s", __LINE__,
+                    writer->file.name, writer->file.size,
+                    errno, STRERROR(errno));
+        }
+    }
+
+    close(writer->file.fd);
+    writer->file.fd = -1;
+}
+
+static int open_writable_binlog(SFBinlogWriterInfo *writer)
+{
+    int result;
+    int flags;
+
+    close_writable_binlog(writer);
+
+    GET_BINLOG_FILENAME(writer);
+    if (DIRECT_IO_ENABLED(writer)) {
+        flags = O_WRONLY | O_CREAT | BINLOG_O_DIRECT;
+    } else {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+    writer->file.fd = open(writer->file.name, flags, 0644);
+    if (writer->file.fd < 0) {
+        logError("file: "__FILE__", line: %d, "
+                "open file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, writer->file.name,
+                errno, STRERROR(errno));
+        return errno != 0 ? errno : EACCES;
+    }
+
+    writer->file.size = lseek(writer->file.fd, 0, SEEK_END);
+    if (writer->file.size < 0) {
+        logError("file: "__FILE__", line: %d, "
+                "lseek file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, writer->file.name,
+                errno, STRERROR(errno));
+        return errno != 0 ? errno : EIO;
+    }
+
+    if (FRAMED_ENABLED(writer) && writer->file.size > 0) {
+        if ((result=framed_binlog_recover(writer)) != 0) {
+            return result;
+        }
+    }
+
+    if (DIRECT_IO_ENABLED(writer)) {
+        if ((result=direct_io_load_tail(writer,
+                        !FRAMED_ENABLED(writer))) != 0)
+        {
+            return result;
+        }
+    }
+
+    publish_write_position(writer);
+    return 0;
+}
+
+static int open_next_binlog(SFBinlogWriterInfo *writer)
+{
+    GET_BINLOG_FILENAME(writer);
+    if (access(writer->file.name, F_OK) == 0) {
+        char bak_filename[PATH_MAX];
+        char date_str[32];
+
+        snprintf(bak_filename, sizeof(bak_filename), "%s.%s",
+                writer->file.name, formatDatetime(g_current_time,
+                    "%Y%m%d%H%M%S", date_str, sizeof(date_str)));
+        if (rename(writer->file.name, bak_filename) == 0) {
+            logWarning("file: "__FILE__", line: %d, "
+                    "binlog file %s exist, rename to %s",
+                    __LINE__, writer->file.name, bak_filename);
+        } else {
+            logError("file: "__FILE__", line: %d, "
+                    "rename binlog %s to backup %s fail, "
+                    "errno: %d, error info: %s",
+                    __LINE__, writer->file.name, bak_filename,
+                    errno, STRERROR(errno));
+            return errno != 0 ? errno : EPERM;
+        }
+    }
+
+    return open_writable_binlog(writer);
+}
+
+static inline int binlog_fsync(SFBinlogWriterInfo *writer)
+{
+    int result;
+    int64_t start_us;
+
+    if (!STATS_ENABLED(writer)) {
+        return fsync(writer->file.fd);
+    }
+
+    start_us = get_current_time_us();
+    result = fsync(writer->file.fd);
+    sf_binlog_histogram_add(&writer->stats.fsync_time,
+            get_current_time_us() - start_us);
+    return result;
+}
+
+static int do_write_to_file(SFBinlogWriterInfo *writer,
+        char *buff, const int len)
+{
+    int result;
+
+    if (fc_safe_write(writer->file.fd, buff, len) != len) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "write to binlog file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, writer->file.name,
+                result, STRERROR(result));
+        return result;
+    }
+
+    if (binlog_fsync(writer) != 0) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "fsync to binlog file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, writer->file.name,
+                result, STRERROR(result));
+        return result;
+    }
+
+    writer->file.size += len;
+    publish_write_position(writer);
+    return 0;
+}
+
+static int rotate_binlog_file(SFBinlogWriterInfo *writer)
+{
+    int result;
+    int64_t start_us;
+
+    start_us = STATS_ENABLED(writer) ? get_current_time_us() : 0;
+    writer->binlog.index++;  //binlog rotate
+    if ((result=write_to_binlog_index_file(writer)) == 0) {
+        result = open_next_binlog(writer);
+    }
+
+    writer->stats.rotate_count++;
+    if (start_us > 0) {
+        sf_binlog_histogram_add(&writer->stats.rotate_time,
+                get_current_time_us() - start_us);
+    }
+
+    if (result != 0) {
+        logError("file: "__FILE__", line: %d, "
+                "open binlog file \"%s\" fail",
+                __LINE__, writer->file.name);
+    }
+    return result;
+}
+
+static int check_write_to_file(SFBinlogWriterInfo *writer,
+        char *buff, const int len)
+{
+    int result;
+
+    if (writer->file.size + len <= SF_BINLOG_FILE_MAX_SIZE) {
+        return do_write_to_file(writer, buff, len);
+    }
+
+    if ((result=rotate_binlog_file(writer)) != 0) {
+        return result;
+    }
+
+    return do_write_to_file(writer, buff, len);
+}
+
+/* write the whole buffer including the tail of the last block
+   which already written, keep the new tail in the buffer */
+static int direct_io_write_to_file(SFBinlogWriterInfo *writer)
+{
+    int result;
+    int data_len;
+    int write_len;
+    int tail_len;
+    int64_t offset;
+
+    if (SF_BINLOG_BUFFER_REMAIN(writer->binlog_buffer) == 0) {
+        return 0;
+    }
+
+    data_len = SF_BINLOG_BUFFER_LENGTH(writer->binlog_buffer);
+    write_len = (data_len + DIRECT_IO_ALIGN_SIZE - 1) /
+        DIRECT_IO_ALIGN_SIZE * DIRECT_IO_ALIGN_SIZE;
+    offset = writer->file.size - (writer->binlog_buffer.current -
+            writer->binlog_buffer.buff);
+    memset(writer->binlog_buffer.end, 0, write_len - data_len);
+    if (pwrite(writer->file.fd, writer->binlog_buffer.buff,
+                write_len, offset) != write_len)
+    {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "write to binlog file \"%s\" fail, offset: %"PRId64", "
+                "errno: %d, error info: %s", __LINE__, writer->file.name,
+                offset, result, STRERROR(result));
+        return result;
+    }
+
+    if (binlog_fsync(writer) != 0) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "fsync to binlog file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, writer->file.name,
+                result, STRERROR(result));
+        return result;
+    }
+
+    writer->file.size = offset + data_len;
+    publish_write_position(writer);
+    tail_len = data_len % DIRECT_IO_ALIGN_SIZE;
+    if (tail_len > 0) {
+        memmove(writer->binlog_buffer.buff, writer->binlog_buffer.buff +
+                (data_len - tail_len), tail_len);
+    }
+    writer->binlog_buffer.current = writer->binlog_buffer.end =
+        writer->binlog_buffer.buff + tail_len;
+    return 0;
+}
+
+static int binlog_write_to_file(SFBinlogWriterInfo *writer)
+{
+    int result;
+    int len;
+
+    if (DIRECT_IO_ENABLED(writer)) {
+        return direct_io_write_to_file(writer);
+    }
+
+    len = SF_BINLOG_BUFFER_LENGTH(writer->binlog_buffer);
+    if (len == 0) {
+        return 0;
+    }
+
+    result = check_write_to_file(writer, writer->binlog_buffer.buff, len);
+    writer->binlog_buffer.end = writer->binlog_buffer.buff;
+    return result;
+}
+
+int sf_binlog_get_current_write_index(SFBinlogWriterInfo *writer)
+{
+    if (writer == NULL) {   //for data recovery
+        return 0;
+    }
+
+    if (writer->binlog.index < 0) {
+        get_binlog_index_from_file(writer);
+    }
+
+    return writer->binlog.index;
+}
+
+void sf_binlog_get_current_write_position(SFBinlogWriterInfo *writer,
+        SFBinlogFilePosition *position)
+{
+    position->index = writer->binlog.index;
+    position->offset = writer->file.size;
+}
+
+static inline void binlog_writer_set_next_version(SFBinlogWriterInfo *writer,
+        const uint64_t next_version)
+{
+    writer->version_ctx.next = next_version;
+}
+
+/* the start position of the record which will be appended to
+   the binlog buffer, MUST be called after the pre-flush */
+static inline void get_record_position(SFBinlogWriterInfo *writer,
+        const int length, SFBinlogFilePosition *position)
+{
+    int pending;
+
+    pending = SF_BINLOG_BUFFER_REMAIN(writer->binlog_buffer);
+    if (pending == 0 && !DIRECT_IO_ENABLED(writer) && writer->
+            file.size + length > SF_BINLOG_FILE_MAX_SIZE)
+    {
+        position->index = writer->binlog.index + 1;  //will rotate
+        position->offset = 0;
+    } else {
+        position->index = writer->binlog.index;
+        position->offset = writer->file.size + pending;
+    }
+}
+
+static int direct_io_deal_one_buffer(SFBinlogWriterInfo *writer,
+        char *buff, const int length, SFBinlogFilePosition *position)
+{
+    int result;
+    int remain;
+    int bytes;
+    char *p;
+
+    /* rotate before the record, a record never crosses binlog files */
+    if (writer->file.size + SF_BINLOG_BUFFER_REMAIN(writer->
+                binlog_buffer) + length > SF_BINLOG_FILE_MAX_SIZE)
+    {
+        if ((result=direct_io_write_to_file(writer)) != 0) {
+            return result;
+        }
+
+        if (writer->file.size > 0) {
+            if ((result=rotate_binlog_file(writer)) != 0) {
+                return result;
+            }
+        }
+    }
+
+    if (position != NULL) {
+        get_record_position(writer, length, position);
+    }
+
+    p = buff;
+    remain = length;
+    while (remain > 0) {
+        if (SF_BINLOG_BUFFER_LENGTH(writer->binlog_buffer) ==
+                writer->binlog_buffer.size)
+        {
+            if ((result=direct_io_write_to_file(writer)) != 0) {
+                return result;
+            }
+        }
+
+        bytes = FC_MIN(remain, writer->binlog_buffer.size -
+                SF_BINLOG_BUFFER_LENGTH(writer->binlog_buffer));
+        memcpy(writer->binlog_buffer.end, p, bytes);
+        writer->binlog_buffer.end += bytes;
+        p += bytes;
+        remain -= bytes;
+    }
+
+    return 0;
+}
+
+static int deal_binlog_one_buffer(SFBinlogWriterInfo *writer,
+        char *buff, const int length, SFBinlogFilePosition *position)
+{
+    int result;
+
+    if (DIRECT_IO_ENABLED(writer)) {
+        return direct_io_deal_one_buffer(writer, buff, length, position);
+    }
+
+    if (length >= writer->binlog_buffer.size / 4) {
+        if (SF_BINLOG_BUFFER_LENGTH(writer->binlog_buffer) > 0) {
+            if ((result=binlog_write_to_file(writer)) != 0) {
                 return result;
             }
         }
 
-        return check_write_to_file(wb->writer, wb->bf.buff, wb->bf.length);
+        if (position != NULL) {
+            get_record_position(writer, length, position);
+        }
+        return check_write_to_file(writer, buff, length);
+    }
+
+    if (writer->file.size + SF_BINLOG_BUFFER_LENGTH(writer->
+                binlog_buffer) + length > SF_BINLOG_FILE_MAX_SIZE)
+    {
+        if ((result=binlog_write_to_file(writer)) != 0) {
+            return result;
+        }
+    } else if (writer->binlog_buffer.size - SF_BINLOG_BUFFER_LENGTH(
+                writer->binlog_buffer) < length)
+    {
+        if ((result=binlog_write_to_file(writer)) != 0) {
+            return result;
+        }
+    }
+
+    if (position != NULL) {
+        get_record_position(writer, length, position);
+    }
+    memcpy(writer->binlog_buffer.end, buff, length);
+    writer->binlog_buffer.end += length;
+    return 0;
+}
+
+static int version_index_flush(SFBinlogWriterInfo *writer)
+{
+    int result;
+    int len;
+
+    len = SF_BINLOG_BUFFER_LENGTH(writer->version_index.buffer);
+    if (len == 0) {
+        return 0;
+    }
+
+    if (fc_safe_write(writer->version_index.fd, writer->
+                version_index.buffer.buff, len) != len)
+    {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, write to version index file fail, "
+                "errno: %d, error info: %s", __LINE__,
+                writer->cfg.subdir_name, result, STRERROR(result));
+        return result;
+    }
+
+    writer->version_index.buffer.end = writer->version_index.buffer.buff;
+    return 0;
+}
+
+static int version_index_add(SFBinlogWriterInfo *writer,
+        const int64_t version, const int length,
+        const SFBinlogFilePosition *position)
+{
+    int result;
+    SFBinlogVersionIndexEntry entry;
+
+    writer->version_index.record_count++;
+    writer->version_index.bytes += length;
+    if (version < writer->version_index.last_version) {
+        logWarning("file: "__FILE__", line: %d, "
+                "subdir_name: %s, version rollback from %"PRId64" to "
+                "%"PRId64", reset the version index", __LINE__,
+                writer->cfg.subdir_name, writer->version_index.
+                last_version, version);
+        writer->version_index.buffer.end = writer->version_index.buffer.buff;
+        if (ftruncate(writer->version_index.fd, 0) != 0) {
+            result = errno != 0 ? errno : EIO;
+            logError("file: "__FILE__", line: %d, "
+                    "subdir_name: %s, truncate version index file fail, "
+                    "errno: %d, error info: %s", __LINE__,
+                    writer->cfg.subdir_name, result, STRERROR(result));
+            return result;
+        }
+        writer->version_index.last_binlog_index = -1;
+    }
+
+    if (!(position->index != writer->version_index.last_binlog_index ||
+                (writer->version_index.interval_records > 0 &&
+                 writer->version_index.record_count >=
+                 writer->version_index.interval_records) ||
+                (writer->version_index.interval_bytes > 0 &&
+                 writer->version_index.bytes >=
+                 writer->version_index.interval_bytes)))
+    {
+        return 0;
+    }
+
+    /* the entry is written after the binlog data */
+    if (SF_BINLOG_BUFFER_LENGTH(writer->version_index.buffer) +
+            SF_BINLOG_VERSION_INDEX_ENTRY_SIZE >
+            writer->version_index.buffer.size)
+    {
+        if ((result=binlog_write_to_file(writer)) != 0) {
+            return result;
+        }
+        if ((result=version_index_flush(writer)) != 0) {
+            return result;
+        }
+    }
+
+    entry.version = version;
+    entry.position = *position;
+    sf_binlog_version_index_pack(&entry, writer->version_index.buffer.end);
+    writer->version_index.buffer.end += SF_BINLOG_VERSION_INDEX_ENTRY_SIZE;
+
+    writer->version_index.record_count = 0;
+    writer->version_index.bytes = 0;
+    writer->version_index.last_version = version;
+    writer->version_index.last_binlog_index = position->index;
+    return 0;
+}
+
+static inline int deal_binlog_one_record(SFBinlogWriterBuffer *wb)
+{
+    int result;
+    int length;
+    char *buff;
+    bool by_version;
+    SFBinlogFilePosition position;
+
+    by_version = (wb->writer->thread->order_by ==
+            SF_BINLOG_THREAD_TYPE_ORDER_BY_VERSION);
+    if (FRAMED_ENABLED(wb->writer)) {
+        /* the header space is reserved before the record buffer */
+        buff = wb->bf.buff - SF_BINLOG_FRAME_HEADER_SIZE;
+        length = SF_BINLOG_FRAME_HEADER_SIZE + wb->bf.length;
+        sf_binlog_frame_pack_header_ex(buff, wb->stream_id,
+                (by_version || wb->stream_id != 0) ? wb->version.first :
+                0, wb->bf.buff, wb->bf.length);
+    } else {
+        buff = wb->bf.buff;
+        length = wb->bf.length;
+    }
+
+    wb->writer->stats.pending.records++;
+    wb->writer->stats.pending.bytes += length;
+    if (wb->push_time_us > 0) {  //the queue delay is added when popped
+        if (wb->writer->stats.pending.first_push_time_us == 0) {
+            wb->writer->stats.pending.first_push_time_us = wb->push_time_us;
+        }
+        wb->push_time_us = 0;
+    }
+
+    if (!(by_version && VERSION_INDEX_ENABLED(wb->writer))) {
+        return deal_binlog_one_buffer(wb->writer, buff, length, NULL);
     }
 
-    if (wb->writer->file.size + SF_BINLOG_BUFFER_LENGTH(wb->writer->
-                binlog_buffer) + wb->bf.length > SF_BINLOG_FILE_MAX_SIZE)
+    if ((result=deal_binlog_one_buffer(wb->writer, buff,
+                    length, &position)) != 0)
     {
-        if ((result=binlog_write_to_file(wb->writer)) != 0) {
-            return result;
-        }
-    } else if (wb->writer->binlog_buffer.size - SF_BINLOG_BUFFER_LENGTH(
-                wb->writer->binlog_buffer) < wb->bf.length)
-    {
-        if ((result=binlog_write_to_file(wb->writer)) != 0) {
-            return result;
-        }
+        return result;
     }
-
-    memcpy(wb->writer->binlog_buffer.end,
-            wb->bf.buff, wb->bf.length);
-    wb->writer->binlog_buffer.end += wb->bf.length;
-    return 0;
+    return version_index_add(wb->writer, wb->version.first,
+            length, &position);
 }
 
 #define GET_WBUFFER_VERSION_COUNT(wb)  \
@@ -301,15 +1233,163 @@ static inline int deal_binlog_one_record(SFBinlogWriterBuffer *wb)
             return result;  \
         } \
         writer->version_ctx.next += GET_WBUFFER_VERSION_COUNT(wb); \
-        fast_mblock_free_object(&writer->thread->mblock, wb);   \
+        sf_binlog_writer_free_buffer(writer->thread, wb);   \
     } while (0)
 
+static int overflow_heap_push(SFBinlogWriterBufferRing *ring,
+        SFBinlogWriterBuffer *wb)
+{
+    SFBinlogWriterBuffer **entries;
+    int alloc;
+    int child;
+    int parent;
+
+    if (ring->overflow.count == ring->overflow.alloc) {
+        alloc = ring->overflow.alloc > 0 ? 2 * ring->overflow.alloc : 256;
+        entries = (SFBinlogWriterBuffer **)fc_realloc(ring->overflow.entries,
+                sizeof(SFBinlogWriterBuffer *) * alloc);
+        if (entries == NULL) {
+            return ENOMEM;
+        }
+        ring->overflow.entries = entries;
+        ring->overflow.alloc = alloc;
+    }
+
+    child = ring->overflow.count++;
+    while (child > 0) {
+        parent = (child - 1) / 2;
+        if (ring->overflow.entries[parent]->version.first <=
+                wb->version.first)
+        {
+            break;
+        }
+        ring->overflow.entries[child] = ring->overflow.entries[parent];
+        child = parent;
+    }
+    ring->overflow.entries[child] = wb;
+    return 0;
+}
+
+static SFBinlogWriterBuffer *overflow_heap_pop(SFBinlogWriterBufferRing *ring)
+{
+    SFBinlogWriterBuffer *top;
+    SFBinlogWriterBuffer *last;
+    int parent;
+    int child;
+
+    top = ring->overflow.entries[0];
+    last = ring->overflow.entries[--ring->overflow.count];
+    parent = 0;
+    while ((child=2 * parent + 1) < ring->overflow.count) {
+        if (child + 1 < ring->overflow.count && ring->overflow.entries[
+                child + 1]->version.first < ring->overflow.
+            entries[child]->version.first)
+        {
+            child++;
+        }
+        if (last->version.first <= ring->overflow.entries[
+                child]->version.first)
+        {
+            break;
+        }
+        ring->overflow.entries[parent] = ring->overflow.entries[child];
+        parent = child;
+    }
+    ring->overflow.entries[parent] = last;
+    return top;
+}
+
+static void discard_version_wbuffer(SFBinlogWriterInfo *writer,
+        SFBinlogWriterBuffer *wb, const char *caption)
+{
+    logError("file: "__FILE__", line: %d, subdir_name: %s, "
+            "%s version: %"PRId64", next: %"PRId64", tag: %"PRId64", "
+            "buffer(%d): %.*s", __LINE__, writer->cfg.subdir_name,
+            caption, wb->version.first, writer->version_ctx.next,
+            wb->tag, wb->bf.length, wb->bf.length, wb->bf.buff);
+    sf_binlog_writer_free_buffer(writer->thread, wb);
+    writer->version_ctx.ring.waiting_count--;
+}
+
+/* put the buffer into the slot, the version MUST in the window */
+static inline void reorder_ring_set_slot(SFBinlogWriterInfo *writer,
+        SFBinlogWriterBuffer *wb)
+{
+    SFBinlogWriterBuffer **slot;
+
+    slot = writer->version_ctx.ring.slots + wb->version.first %
+        writer->version_ctx.ring.size;
+    if (*slot != NULL) {
+        if ((*slot)->version.first >= writer->version_ctx.next) {
+            discard_version_wbuffer(writer, wb, "duplicate");
+            return;
+        }
+
+        /* the version is covered by a version range buffer */
+        discard_version_wbuffer(writer, *slot, "stale");
+    }
+    *slot = wb;
+}
+
+/* move the overflow buffers into the window */
+static inline void reorder_ring_refill(SFBinlogWriterInfo *writer)
+{
+    SFBinlogWriterBufferRing *ring;
+    SFBinlogWriterBuffer *wb;
+
+    ring = &writer->version_ctx.ring;
+    while (ring->overflow.count > 0 && ring->overflow.entries[0]->
+            version.first < writer->version_ctx.next + ring->size)
+    {
+        wb = overflow_heap_pop(ring);
+        if (wb->version.first < writer->version_ctx.next) {
+            discard_version_wbuffer(writer, wb, "stale");
+        } else {
+            reorder_ring_set_slot(writer, wb);
+        }
+    }
+}
+
+/* rebuild the window after the next version changed */
+static int reorder_ring_rebuild(SFBinlogWriterInfo *writer)
+{
+    SFBinlogWriterBufferRing *ring;
+    SFBinlogWriterBuffer **slot;
+    SFBinlogWriterBuffer **end;
+    int result;
+
+    ring = &writer->version_ctx.ring;
+    end = ring->slots + ring->size;
+    for (slot=ring->slots; slot<end; slot++) {
+        if (*slot != NULL) {
+            if ((result=overflow_heap_push(ring, *slot)) != 0) {
+                return result;
+            }
+            *slot = NULL;
+        }
+    }
+
+    reorder_ring_refill(writer);
+    return 0;
+}
+
+static inline void notify_version_waiters(SFBinlogWriterInfo *writer)
+{
+    if (__sync_add_and_fetch(&writer->version_ctx.
+                backpressure.waitings, 0) > 0)
+    {
+        PTHREAD_MUTEX_LOCK(&writer->version_ctx.backpressure.lcp.lock);
+        pthread_cond_broadcast(&writer->version_ctx.backpressure.lcp.cond);
+        PTHREAD_MUTEX_UNLOCK(&writer->version_ctx.backpressure.lcp.lock);
+    }
+}
+
 static int deal_record_by_version(SFBinlogWriterBuffer *wb)
 {
     SFBinlogWriterInfo *writer;
+    SFBinlogWriterBufferRing *ring;
+    SFBinlogWriterBuffer **slot;
     SFBinlogWriterBuffer *current;
-    SFBinlogWriterBuffer *previous;
-    SFBinlogWriterSlot *slot;
     int result;
 
     writer = wb->writer;
@@ -320,7 +1400,7 @@ static int deal_record_by_version(SFBinlogWriterBuffer *wb)
                 __LINE__, writer->cfg.subdir_name, wb->version.first,
                 writer->version_ctx.next, wb->tag, wb->bf.length,
                 wb->bf.length, wb->bf.buff);
-        fast_mblock_free_object(&writer->thread->mblock, wb);
+        sf_binlog_writer_free_buffer(writer->thread, wb);
         return 0;
     }
 
@@ -330,56 +1410,72 @@ static int deal_record_by_version(SFBinlogWriterBuffer *wb)
             writer->version_ctx.next, writer);
             */
 
-
+    ring = &writer->version_ctx.ring;
     if (wb->version.first == writer->version_ctx.next) {
         DEAL_CURRENT_VERSION_WBUFFER(writer, wb);
 
-        slot = writer->version_ctx.ring.slots +
-            writer->version_ctx.next % writer->version_ctx.ring.size;
-        while (slot->head.next != NULL && slot->head.next->
-                version.first == writer->version_ctx.next)
-        {
-            current = slot->head.next;
-            slot->head.next = current->next;
+        while (1) {
+            reorder_ring_refill(writer);
+            slot = ring->slots + writer->version_ctx.next % ring->size;
+            if ((current=*slot) == NULL) {
+                break;
+            }
 
-            DEAL_CURRENT_VERSION_WBUFFER(writer, current);
-            writer->version_ctx.ring.waiting_count--;
+            *slot = NULL;
+            if (current->version.first != writer->version_ctx.next) {
+                discard_version_wbuffer(writer, current, "stale");
+                continue;
+            }
 
-            slot = writer->version_ctx.ring.slots + writer->
-                version_ctx.next % writer->version_ctx.ring.size;
+            ring->waiting_count--;
+            DEAL_CURRENT_VERSION_WBUFFER(writer, current);
         }
 
+        notify_version_waiters(writer);
         return 0;
     }
 
-    slot = writer->version_ctx.ring.slots + wb->version.first %
-        writer->version_ctx.ring.size;
-    if (slot->head.next == NULL) {
-        wb->next = NULL;
-        slot->head.next = wb;
-    } else if (wb->version.first < slot->head.next->version.first) {
-        wb->next = slot->head.next;
-        slot->head.next = wb;
-    } else {
-        previous = slot->head.next;
-        while (previous->next != NULL && wb->version.first >
-                previous->next->version.first)
-        {
-            previous = previous->next;
+    if (wb->version.first - writer->version_ctx.next >
+            writer->version_ctx.backpressure.stats.max_gap)
+    {
+        writer->version_ctx.backpressure.stats.max_gap =
+            wb->version.first - writer->version_ctx.next;
+    }
+
+    ring->waiting_count++;
+    if (wb->version.first >= writer->version_ctx.next + ring->size) {
+        if ((result=overflow_heap_push(ring, wb)) != 0) {
+            ring->waiting_count--;
+            return result;
         }
+    } else {
+        reorder_ring_set_slot(writer, wb);
+    }
 
-        wb->next = previous->next;
-        previous->next = wb;
+    if (ring->waiting_count > ring->max_waitings) {
+        ring->max_waitings = ring->waiting_count;
     }
 
-    writer->version_ctx.ring.waiting_count++;
-    if (writer->version_ctx.ring.waiting_count >
-            writer->version_ctx.ring.max_waitings)
-    {
-        writer->version_ctx.ring.max_waitings =
-            writer->version_ctx.ring.waiting_count;
+    return 0;
+}
+
+static int set_writer_next_version(SFBinlogWriterInfo *writer,
+        const int64_t next_version)
+{
+    int result;
+
+    if (writer->version_ctx.next == next_version) {
+        return 0;
     }
 
+    binlog_writer_set_next_version(writer, next_version);
+    writer->version_ctx.change_count++;
+    if (writer->version_ctx.ring.waiting_count != 0 &&
+            (result=reorder_ring_rebuild(writer)) != 0)
+    {
+        return result;
+    }
+    notify_version_waiters(writer);
     return 0;
 }
 
@@ -410,6 +1506,32 @@ static inline int flush_writer_files(SFBinlogWriterThread *thread)
         if ((result=binlog_write_to_file(writer)) != 0) {
             return result;
         }
+        if (VERSION_INDEX_ENABLED(writer)) {
+            if ((result=version_index_flush(writer)) != 0) {
+                return result;
+            }
+        }
+
+        writer->stats.flush_count++;
+        if (STATS_ENABLED(writer)) {
+            if (writer->stats.pending.first_push_time_us > 0) {
+                sf_binlog_histogram_add(&writer->stats.write_delay,
+                        get_current_time_us() - writer->
+                        stats.pending.first_push_time_us);
+            }
+            sf_binlog_histogram_add(&writer->stats.flush_records,
+                    writer->stats.pending.records);
+            sf_binlog_histogram_add(&writer->stats.flush_bytes,
+                    writer->stats.pending.bytes);
+            if (thread->order_by == SF_BINLOG_THREAD_TYPE_ORDER_BY_VERSION) {
+                sf_binlog_histogram_add(&writer->stats.ring_waitings,
+                        writer->version_ctx.ring.waiting_count);
+            }
+        }
+        writer->stats.pending.records = 0;
+        writer->stats.pending.bytes = 0;
+        writer->stats.pending.first_push_time_us = 0;
+        STATS_PUBLISH(&writer->published_stats, writer->stats);
 
         writer->flush.in_queue = false;
         writer = writer->flush.next;
@@ -419,23 +1541,410 @@ static inline int flush_writer_files(SFBinlogWriterThread *thread)
     return 0;
 }
 
+static int deal_producer_ring(SFBinlogWriterThread *thread,
+        SFBinlogProducerRing *ring)
+{
+    SFBinlogWriterInfo *writer;
+    int result;
+    int64_t head;
+    int64_t tail;
+    int64_t end;
+    int64_t next;
+    int64_t lap_end;
+    int64_t wrap_pos;
+    int64_t record_count;
+
+    /* clear the flag before draining, the records committed after
+       this point will trigger another notify */
+    __sync_bool_compare_and_swap(&ring->notified, 1, 0);
+    record_count = __sync_add_and_fetch(&ring->record_count, 0);
+    head = __sync_add_and_fetch(&ring->head, 0);
+    writer = ring->writer;
+
+    tail = ring->tail;
+    while (tail < head) {
+        lap_end = (tail | ring->mask) + 1;
+        end = FC_MIN(head, lap_end);
+        wrap_pos = ring->wrap_pos;
+        if (wrap_pos >= tail && wrap_pos < end) {
+            end = wrap_pos;
+            next = lap_end;   //skip the padding
+        } else {
+            next = end;
+        }
+
+        if (end > tail) {
+            if ((result=deal_binlog_one_buffer(writer, ring->buff +
+                            (tail & ring->mask), end - tail, NULL)) != 0)
+            {
+                return result;
+            }
+            writer->stats.pending.bytes += end - tail;
+        }
+
+        tail = next;
+        __sync_lock_test_and_set(&ring->tail, tail);
+    }
+
+    writer->stats.pending.records += record_count - ring->drained_count;
+    writer->total_count += record_count - ring->drained_count;
+
+    /* the ring maybe freed by the destroyer after drained_count set,
+       so it is the last access to the ring */
+    if (__sync_add_and_fetch(&ring->waitings, 0) > 0) {
+        PTHREAD_MUTEX_LOCK(&ring->lcp.lock);
+        ring->drained_count = record_count;
+        pthread_cond_broadcast(&ring->lcp.cond);
+        PTHREAD_MUTEX_UNLOCK(&ring->lcp.lock);
+    } else {
+        __sync_lock_test_and_set(&ring->drained_count, record_count);
+    }
+
+    add_to_flush_writer_queue(thread, writer);
+    return 0;
+}
+
+/* return 0 for success, EINVAL for not the record boundary */
+static int check_truncate_position(SFBinlogWriterInfo *writer,
+        const SFBinlogFilePosition *position)
+{
+    char filename[PATH_MAX];
+    struct stat stbuf;
+    int64_t valid_size;
+    char ch;
+    int result;
+    int fd;
+
+    if (position->index < 0 || position->index > writer->binlog.index ||
+            position->offset < 0)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, invalid truncate position, binlog "
+                "index: %d, offset: %"PRId64", current write index: %d",
+                __LINE__, writer->cfg.subdir_name, position->index,
+                position->offset, writer->binlog.index);
+        return EINVAL;
+    }
+
+    sf_binlog_writer_get_filename(writer->cfg.subdir_name,
+            position->index, filename, sizeof(filename));
+    if (stat(filename, &stbuf) != 0) {
+        result = errno != 0 ? errno : ENOENT;
+        logError("file: "__FILE__", line: %d, "
+                "stat file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, filename, result, STRERROR(result));
+        return result;
+    }
+
+    if (position->offset > stbuf.st_size) {
+        logError("file: "__FILE__", line: %d, "
+                "binlog file \"%s\", truncate offset: %"PRId64" > "
+                "file size: %"PRId64, __LINE__, filename,
+                position->offset, (int64_t)stbuf.st_size);
+        return EINVAL;
+    }
+    if (position->offset == 0) {
+        return 0;
+    }
+
+    if (FRAMED_ENABLED(writer)) {
+        if ((result=sf_binlog_frame_check_file(filename,
+                        position->offset, &valid_size)) != 0)
+        {
+            return result;
+        }
+        ch = (valid_size == position->offset) ? '\n' : '\0';
+    } else {
+        if ((fd=open(filename, O_RDONLY)) < 0) {
+            result = errno != 0 ? errno : EACCES;
+            logError("file: "__FILE__", line: %d, "
+                    "open file \"%s\" fail, "
+                    "errno: %d, error info: %s",
+                    __LINE__, filename, result, STRERROR(result));
+            return result;
+        }
+        if (pread(fd, &ch, 1, position->offset - 1) != 1) {
+            ch = '\0';
+        }
+        close(fd);
+    }
+
+    if (ch != '\n') {
+        logError("file: "__FILE__", line: %d, "
+                "binlog file \"%s\", truncate offset: %"PRId64" is "
+                "not the record boundary", __LINE__, filename,
+                position->offset);
+        return EINVAL;
+    }
+    return 0;
+}
+
+/* find the first record whose version > the given version */
+static int find_truncate_position_by_version(SFBinlogWriterInfo *writer,
+        const int64_t version, SFBinlogFilePosition *position)
+{
+    SFBinlogReader reader;
+    SFBinlogFilePosition start;
+    SFBinlogFrameRecord record;
+    string_t frames;
+    int result;
+
+    if (!FRAMED_ENABLED(writer)) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, the binlog is not framed, "
+                "can't truncate by version", __LINE__,
+                writer->cfg.subdir_name);
+        return EOPNOTSUPP;
+    }
+
+    result = sf_binlog_version_index_lookup(writer->
+            cfg.subdir_name, version, &start);
+    if (result == ENOENT) {  //scan from the first binlog
+        start.index = 0;
+        start.offset = 0;
+    } else if (result != 0) {
+        return result;
+    }
+
+    if ((result=sf_binlog_reader_init(&reader, writer->cfg.subdir_name,
+                    NULL, &start, 0, true)) != 0)
+    {
+        return result;
+    }
+
+    while ((result=sf_binlog_reader_read(&reader, &frames)) == 0) {
+        position->index = reader.position.index;
+        position->offset = reader.position.offset - frames.len;
+        while ((result=sf_binlog_frame_next(&frames, &record)) == 0) {
+            if (record.data_version > version) {
+                break;
+            }
+            position->offset += SF_BINLOG_FRAME_HEADER_SIZE +
+                record.body.len;
+        }
+
+        if (result != ENOENT) {  //found or error
+            break;
+        }
+    }
+
+    if (result == ENOENT) {
+        if (reader.fd < 0) {
+            logError("file: "__FILE__", line: %d, "
+                    "subdir_name: %s, binlog file #%d not exist, "
+                    "can't scan the version: %"PRId64, __LINE__,
+                    writer->cfg.subdir_name, reader.position.index,
+                    version);
+        } else {  //all records are kept
+            *position = reader.position;
+            result = 0;
+        }
+    }
+
+    sf_binlog_reader_destroy(&reader);
+    return result;
+}
+
+/* set ctx->result for the caller,
+   return != 0 when the writer can't continue */
+static int execute_binlog_truncate(SFBinlogWriterInfo *writer,
+        BinlogTruncateContext *ctx)
+{
+    SFBinlogVersionIndexEntry last;
+    int64_t entry_count;
+    int last_index;
+    int result;
+
+    if ((result=binlog_write_to_file(writer)) == 0 &&
+            VERSION_INDEX_ENABLED(writer))
+    {
+        result = version_index_flush(writer);
+    }
+    if (result != 0) {
+        ctx->result = result;
+        return result;
+    }
+
+    /* close to remove the zero padding of direct IO */
+    close_writable_binlog(writer);
+    if (ctx->by_version) {
+        ctx->result = find_truncate_position_by_version(writer,
+                ctx->version, &ctx->position);
+    } else {
+        ctx->result = 0;
+    }
+    if (ctx->result == 0) {
+        ctx->result = check_truncate_position(writer, &ctx->position);
+    }
+
+    if (ctx->result == 0 && !(ctx->position.index == writer->binlog.index
+                && ctx->position.offset == writer->file.size))
+    {
+        logInfo("file: "__FILE__", line: %d, "
+                "subdir_name: %s, truncate binlog from index: %d, "
+                "offset: %"PRId64" to index: %d, offset: %"PRId64,
+                __LINE__, writer->cfg.subdir_name, writer->binlog.index,
+                writer->file.size, ctx->position.index,
+                ctx->position.offset);
+
+        last_index = writer->binlog.index;
+        if ((ctx->result=write_binlog_truncate_intent(writer,
+                        &ctx->position, last_index)) == 0)
+        {
+            /* the half done truncation will be redone when restart */
+            if ((result=do_binlog_truncate(writer, &ctx->position,
+                            last_index)) != 0)
+            {
+                ctx->result = result;
+                return result;
+            }
+        }
+    }
+
+    if ((result=open_writable_binlog(writer)) != 0) {
+        ctx->result = result;
+        return result;
+    }
+    if (ctx->result != 0) {
+        return 0;
+    }
+
+    if (VERSION_INDEX_ENABLED(writer)) {
+        result = sf_binlog_version_index_get_last(writer->
+                cfg.subdir_name, &last, &entry_count);
+        writer->version_index.last_version = (result == 0) ?
+            last.version : 0;
+        writer->version_index.last_binlog_index = -1;
+        writer->version_index.record_count = 0;
+        writer->version_index.bytes = 0;
+    }
+
+    if (ctx->by_version && writer->thread != NULL && writer->thread->
+            order_by == SF_BINLOG_THREAD_TYPE_ORDER_BY_VERSION)
+    {
+        if ((result=set_writer_next_version(writer,
+                        ctx->version + 1)) != 0)
+        {
+            ctx->result = result;
+            return result;
+        }
+    }
+    return 0;
+}
+
+/* the request context is released by the caller after done */
+static inline void notify_request_done(pthread_lock_cond_pair_t *lcp,
+        bool *done)
+{
+    PTHREAD_MUTEX_LOCK(&lcp->lock);
+    *done = true;
+    pthread_cond_signal(&lcp->cond);
+    PTHREAD_MUTEX_UNLOCK(&lcp->lock);
+}
+
+/* wait the request pushed to the writer thread
+   timeout_ms: wait until the writer thread exited when <= 0
+   return true when the request is done */
+static bool wait_request_done(SFBinlogWriterThread *thread,
+        pthread_lock_cond_pair_t *lcp, bool *done, const int timeout_ms)
+{
+    const int wait_ms = 100;  //check the thread running periodically
+    int count;
+    struct timespec ts;
+
+    count = 0;
+    PTHREAD_MUTEX_LOCK(&lcp->lock);
+    while (!*done) {
+        if (timeout_ms > 0) {
+            if (++count > timeout_ms / wait_ms) {
+                break;
+            }
+        } else if (!thread->running) {
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += wait_ms * 1000 * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&lcp->cond, &lcp->lock, &ts);
+    }
+    PTHREAD_MUTEX_UNLOCK(&lcp->lock);
+    return *done;
+}
+
+/* the truncate error is returned to the caller by ctx->result,
+   the writer thread keeps running */
+static int deal_truncate_request(SFBinlogWriterInfo *writer,
+        BinlogTruncateContext *ctx)
+{
+    int result;
+
+    if ((result=execute_binlog_truncate(writer, ctx)) != 0) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, truncate binlog fail, "
+                "errno: %d, error info: %s", __LINE__,
+                writer->cfg.subdir_name, result, STRERROR(result));
+    }
+
+    notify_request_done(&ctx->lcp, &ctx->done);
+    return 0;
+}
+
 static int deal_binlog_records(SFBinlogWriterThread *thread,
         SFBinlogWriterBuffer *wb_head)
 {
+    BinlogDetachContext *detach_ctx;
     int result;
+    int count;
+    int64_t pop_time_us;
     SFBinlogWriterBuffer *wbuffer;
     SFBinlogWriterBuffer *current;
 
+    /* the writers of the pool thread maybe mixed, so the stats are
+       gated by each buffer whose push time is set by the stats writer */
+    thread->stats.pop_count++;
+    count = 0;
+    pop_time_us = 0;
+    wbuffer = wb_head;
+    do {
+        count++;
+        if (wbuffer->push_time_us > 0) {
+            if (pop_time_us == 0) {
+                pop_time_us = get_current_time_us();
+            }
+            sf_binlog_histogram_add(&wbuffer->writer->stats.queue_delay,
+                    pop_time_us - wbuffer->push_time_us);
+        }
+        wbuffer = wbuffer->next;
+    } while (wbuffer != NULL);
+
+    if (pop_time_us > 0) {
+        thread->stats.last_pop_time_us = pop_time_us;
+        sf_binlog_histogram_add(&thread->stats.queue_depth, count);
+    }
+
     wbuffer = wb_head;
     do {
         current = wbuffer;
         wbuffer = wbuffer->next;
 
         switch (current->type) {
+            case SF_BINLOG_BUFFER_TYPE_DRAIN_PRODUCER_RING:
+                if ((result=deal_producer_ring(thread, (SFBinlogProducerRing *)
+                                current->bf.buff)) != 0)
+                {
+                    return result;
+                }
+                break;
+
             case SF_BINLOG_BUFFER_TYPE_CHANGE_ORDER_TYPE:
                 thread->order_by = current->version.first;
-                fast_mblock_free_object(&current->writer->
-                        thread->mblock, current);
+                sf_binlog_writer_free_buffer(current->
+                        writer->thread, current);
                 break;
 
             case SF_BINLOG_BUFFER_TYPE_SET_NEXT_VERSION:
@@ -459,15 +1968,33 @@ static int deal_binlog_records(SFBinlogWriterThread *thread,
                         __LINE__, current->writer->cfg.subdir_name,
                         current->version.first);
 
-                if (current->writer->version_ctx.next !=
-                        current->version.first)
+                if ((result=set_writer_next_version(current->writer,
+                                current->version.first)) != 0)
+                {
+                    return result;
+                }
+                sf_binlog_writer_free_buffer(current->
+                        writer->thread, current);
+                break;
+
+            case SF_BINLOG_BUFFER_TYPE_TRUNCATE_BINLOG:
+                if ((result=deal_truncate_request(current->writer,
+                                (BinlogTruncateContext *)
+                                current->bf.buff)) != 0)
                 {
-                    binlog_writer_set_next_version(current->writer,
-                            current->version.first);
-                    current->writer->version_ctx.change_count++;
+                    return result;
+                }
+                break;
+
+            case SF_BINLOG_BUFFER_TYPE_DETACH_WRITER:
+                /* write the records popped before the detaching */
+                detach_ctx = (BinlogDetachContext *)current->bf.buff;
+                detach_ctx->result = flush_writer_files(thread);
+                result = detach_ctx->result;
+                notify_request_done(&detach_ctx->lcp, &detach_ctx->done);
+                if (result != 0) {
+                    return result;
                 }
-                fast_mblock_free_object(&current->writer->
-                        thread->mblock, current);
                 break;
 
             default:
@@ -484,48 +2011,132 @@ static int deal_binlog_records(SFBinlogWriterThread *thread,
                         return result;
                     }
 
-                    fast_mblock_free_object(&current->writer->
-                            thread->mblock, current);
+                    sf_binlog_writer_free_buffer(current->
+                        writer->thread, current);
                 }
                 break;
         }
     } while (wbuffer != NULL);
 
-    return flush_writer_files(thread);
+    result = flush_writer_files(thread);
+    STATS_PUBLISH(&thread->published_stats, thread->stats);
+    return result;
 }
 
-void sf_binlog_writer_finish(SFBinlogWriterInfo *writer)
+/* the thread exits after the current records */
+static void binlog_writer_stop_thread(SFBinlogWriterThread *thread)
 {
-    SFBinlogWriterBuffer *wb_head;
     int count;
 
-    if (writer->file.name != NULL) {
-        fc_queue_terminate(&writer->thread->queue);
-
-        count = 0;
-        while (writer->thread->running && ++count < 300) {
-            fc_sleep_ms(10);
-        }
-        
-        if (writer->thread->running) {
+    thread->continue_flag = false;
+    count = 0;
+    while (thread->running) {
+        fc_queue_terminate(&thread->queue);  //wake up the thread
+        fc_sleep_ms(10);
+        if (++count == 300) {
             logWarning("file: "__FILE__", line: %d, "
-                    "%s binlog write thread still running, "
-                    "exit anyway!", __LINE__, writer->cfg.subdir_name);
+                    "binlog write thread still running, "
+                    "waiting ...", __LINE__);
+        }
+    }
+}
+
+/* deal the queued records after the thread exited */
+static void binlog_writer_drain_queue(SFBinlogWriterThread *thread)
+{
+    SFBinlogWriterBuffer *wb_head;
+
+    PTHREAD_MUTEX_LOCK(&thread->lock);
+    wb_head = (SFBinlogWriterBuffer *)fc_queue_try_pop_all(&thread->queue);
+    if (wb_head != NULL) {
+        deal_binlog_records(thread, wb_head);
+    }
+    PTHREAD_MUTEX_UNLOCK(&thread->lock);
+}
+
+static void unbind_writer(SFBinlogWriterThread *thread,
+        SFBinlogWriterInfo *writer)
+{
+    SFBinlogWriterInfo **pp;
+
+    PTHREAD_MUTEX_LOCK(&thread->lock);
+    pp = &thread->bound_writers;
+    while (*pp != NULL) {
+        if (*pp == writer) {
+            *pp = writer->next_bound;
+            break;
         }
+        pp = &(*pp)->next_bound;
+    }
+    PTHREAD_MUTEX_UNLOCK(&thread->lock);
+}
+
+/* the pool thread is shared by the other writers, so the detach request
+   is queued after the records of the writer and acknowledged by the
+   thread after they are written */
+static void detach_writer_from_pool(SFBinlogWriterInfo *writer)
+{
+    SFBinlogWriterThread *thread;
+    BinlogDetachContext ctx;
+
+    thread = writer->thread;
+    if (init_pthread_lock_cond_pair(&ctx.lcp) != 0) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, init lock fail, the queued records "
+                "maybe lost", __LINE__, writer->cfg.subdir_name);
+        unbind_writer(thread, writer);
+        return;
+    }
 
-        wb_head = (SFBinlogWriterBuffer *)fc_queue_try_pop_all(
-                &writer->thread->queue);
-        if (wb_head != NULL) {
-            deal_binlog_records(writer->thread, wb_head);
+    ctx.done = false;
+    ctx.result = 0;
+    memset(&ctx.notify, 0, sizeof(ctx.notify));
+    ctx.notify.type = SF_BINLOG_BUFFER_TYPE_DETACH_WRITER;
+    ctx.notify.writer = writer;
+    ctx.notify.bf.buff = (char *)&ctx;
+    fc_queue_push(&thread->queue, &ctx.notify);
+
+    if (!wait_request_done(thread, &ctx.lcp, &ctx.done, 0)) {
+        /* the thread exited before popping the request, the request
+           is dealt by the draining of this thread or the pool finish */
+        binlog_writer_drain_queue(thread);
+    }
+    if (ctx.result != 0) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, write the queued records fail, "
+                "errno: %d, error info: %s", __LINE__,
+                writer->cfg.subdir_name, ctx.result, STRERROR(ctx.result));
+    }
+
+    destroy_pthread_lock_cond_pair(&ctx.lcp);
+    unbind_writer(thread, writer);
+}
+
+void sf_binlog_writer_finish(SFBinlogWriterInfo *writer)
+{
+    if (writer->file.name != NULL) {
+        if (writer->thread == NULL) {
+            /* detached by the pool finish */
+        } else if (writer->thread->writer == writer) {
+            binlog_writer_stop_thread(writer->thread);
+            binlog_writer_drain_queue(writer->thread);
+        } else {
+            detach_writer_from_pool(writer);
         }
 
         free(writer->file.name);
         writer->file.name = NULL;
     }
 
-    if (writer->file.fd >= 0) {
-        close(writer->file.fd);
-        writer->file.fd = -1;
+    close_writable_binlog(writer);
+    if (writer->version_index.fd >= 0) {
+        close(writer->version_index.fd);
+        writer->version_index.fd = -1;
+    }
+    if (writer->binlog.meta_fd >= 0) {
+        check_write_legacy_binlog_index_file(writer);
+        close(writer->binlog.meta_fd);
+        writer->binlog.meta_fd = -1;
     }
 }
 
@@ -536,7 +2147,7 @@ static void *binlog_writer_func(void *arg)
 
     thread = (SFBinlogWriterThread *)arg;
     thread->running = true;
-    while (SF_G_CONTINUE_FLAG) {
+    while (SF_G_CONTINUE_FLAG && thread->continue_flag) {
         wb_head = (SFBinlogWriterBuffer *)fc_queue_pop_all(&thread->queue);
         if (wb_head == NULL) {
             continue;
@@ -550,132 +2161,614 @@ static void *binlog_writer_func(void *arg)
         }
     }
 
-    thread->running = false;
-    return NULL;
+    thread->running = false;
+    return NULL;
+}
+
+static int binlog_wbuffer_alloc_init(void *element, void *args)
+{
+    SFBinlogWriterBuffer *wbuffer;
+    SFBinlogWriterThread *thread;
+
+    wbuffer = (SFBinlogWriterBuffer *)element;
+    thread = (SFBinlogWriterThread *)args;
+    wbuffer->writer = thread->writer;
+    wbuffer->size_class = SF_BINLOG_BUFFER_ALLOC_BY_MBLOCK;
+    wbuffer->push_time_us = 0;
+    wbuffer->bf.alloc_size = thread->max_record_size;
+    if (thread->use_fixed_buffer_size) {
+        wbuffer->bf.buff = (char *)(wbuffer + 1);
+    } else {
+        wbuffer->bf.buff = (char *)fc_malloc(thread->frame_header_size +
+                thread->max_record_size);
+        if (wbuffer->bf.buff == NULL) {
+            return ENOMEM;
+        }
+    }
+
+    /* reserve the space for the frame header */
+    wbuffer->bf.buff += thread->frame_header_size;
+    return 0;
+}
+
+static int init_size_classes(SFBinlogWriterThread *thread)
+{
+    int result;
+    int i;
+    int element_size;
+    int alloc_elements_once;
+    char name[64];
+
+    for (i=0; i<SF_BINLOG_BUFFER_SIZE_CLASS_COUNT; i++) {
+        element_size = sizeof(SFBinlogWriterBuffer) +
+            thread->frame_header_size +
+            (SF_BINLOG_BUFFER_MIN_SIZE_CLASS << i);
+        alloc_elements_once = (256 * 1024) / element_size;
+        sprintf(name, "binlog_wbuffer_%d",
+                SF_BINLOG_BUFFER_MIN_SIZE_CLASS << i);
+        if ((result=fast_mblock_init_ex1(thread->size_classes + i, name,
+                        element_size, alloc_elements_once, 0,
+                        NULL, NULL, true)) != 0)
+        {
+            while (--i >= 0) {
+                fast_mblock_destroy(thread->size_classes + i);
+            }
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+static void destroy_size_classes(SFBinlogWriterThread *thread)
+{
+    int i;
+
+    for (i=0; i<SF_BINLOG_BUFFER_SIZE_CLASS_COUNT; i++) {
+        fast_mblock_destroy(thread->size_classes + i);
+    }
+}
+
+SFBinlogWriterBuffer *sf_binlog_writer_alloc_sized_buffer(
+        SFBinlogWriterThread *thread, const int record_size)
+{
+    SFBinlogWriterBuffer *wbuffer;
+    int size_class;
+    int capacity;
+
+    size_class = 0;
+    capacity = SF_BINLOG_BUFFER_MIN_SIZE_CLASS;
+    while (capacity < record_size) {
+        capacity *= 2;
+        size_class++;
+    }
+
+    if (size_class < SF_BINLOG_BUFFER_SIZE_CLASS_COUNT) {
+        wbuffer = (SFBinlogWriterBuffer *)fast_mblock_alloc_object(
+                thread->size_classes + size_class);
+    } else {
+        capacity = record_size;
+        size_class = SF_BINLOG_BUFFER_ALLOC_BY_MALLOC;
+        wbuffer = (SFBinlogWriterBuffer *)fc_malloc(
+                sizeof(SFBinlogWriterBuffer) +
+                thread->frame_header_size + capacity);
+    }
+    if (wbuffer == NULL) {
+        return NULL;
+    }
+
+    wbuffer->size_class = size_class;
+    wbuffer->stream_id = 0;
+    wbuffer->push_time_us = 0;
+    wbuffer->writer = thread->writer;
+    wbuffer->bf.alloc_size = capacity;
+    wbuffer->bf.length = 0;
+    /* reserve the space for the frame header */
+    wbuffer->bf.buff = (char *)(wbuffer + 1) + thread->frame_header_size;
+    return wbuffer;
+}
+
+void sf_binlog_writer_free_buffer(SFBinlogWriterThread *thread,
+        SFBinlogWriterBuffer *buffer)
+{
+    if (buffer->size_class >= 0) {
+        fast_mblock_free_object(thread->size_classes +
+                buffer->size_class, buffer);
+    } else if (buffer->size_class == SF_BINLOG_BUFFER_ALLOC_BY_MALLOC) {
+        free(buffer);
+    } else {
+        fast_mblock_free_object(&thread->mblock, buffer);
+    }
+}
+
+int64_t sf_binlog_histogram_percentile(const SFBinlogHistogram *histogram,
+        const double percent)
+{
+    int64_t target;
+    int64_t count;
+    int i;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    target = (int64_t)(histogram->count * percent / 100.00);
+    count = 0;
+    for (i=0; i<SF_BINLOG_HISTOGRAM_BUCKETS - 1; i++) {
+        count += histogram->buckets[i];
+        if (count > target) {
+            return i > 0 ? FC_MIN((1LL << i) - 1, histogram->max) : 0;
+        }
+    }
+    return histogram->max;
+}
+
+void sf_binlog_writer_get_stats(SFBinlogWriterInfo *writer,
+        SFBinlogWriterStats *stats)
+{
+    STATS_FETCH(&writer->published_stats, *stats);
+}
+
+void sf_binlog_writer_thread_get_stats(SFBinlogWriterThread *thread,
+        SFBinlogWriterThreadStats *stats)
+{
+    STATS_FETCH(&thread->published_stats, *stats);
+}
+
+int sf_binlog_stream_writer_init(SFBinlogStreamWriter *stream,
+        SFBinlogWriterInfo *shared, const int stream_id)
+{
+    if (!FRAMED_ENABLED(shared)) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, the shared binlog MUST be framed",
+                __LINE__, shared->cfg.subdir_name);
+        return EINVAL;
+    }
+
+    if (stream_id <= 0) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, invalid stream id: %d",
+                __LINE__, shared->cfg.subdir_name, stream_id);
+        return EINVAL;
+    }
+
+    shared->stream_shared = true;
+    stream->shared = shared;
+    stream->stream_id = stream_id;
+    return 0;
+}
+
+int sf_binlog_writer_init_normal_ex(SFBinlogWriterInfo *writer,
+        const char *subdir_name, const int buffer_size, const int flags)
+{
+    int result;
+    int path_len;
+    bool create;
+    char filepath[PATH_MAX];
+
+    writer->total_count = 0;
+    writer->flush.in_queue = false;
+    writer->version_index.fd = -1;
+    writer->cfg.flags = flags;
+    if (BINLOG_O_DIRECT == 0 && DIRECT_IO_ENABLED(writer)) {
+        logWarning("file: "__FILE__", line: %d, "
+                "subdir_name: %s, O_DIRECT not supported, disable it",
+                __LINE__, subdir_name);
+        writer->cfg.flags &= ~SF_BINLOG_WRITER_FLAGS_DIRECT_IO;
+    }
+
+    if (DIRECT_IO_ENABLED(writer)) {
+        result = sf_binlog_buffer_init_aligned(&writer->binlog_buffer,
+                FC_MAX(buffer_size, 2 * DIRECT_IO_ALIGN_SIZE),
+                DIRECT_IO_ALIGN_SIZE);
+    } else {
+        result = sf_binlog_buffer_init(&writer->binlog_buffer, buffer_size);
+    }
+    if (result != 0) {
+        return result;
+    }
+
+    path_len = snprintf(filepath, sizeof(filepath), "%s/%s",
+            g_sf_binlog_data_path, subdir_name);
+    if ((result=fc_check_mkdir_ex(filepath, 0775, &create)) != 0) {
+        return result;
+    }
+    if (create) {
+        SF_CHOWN_RETURN_ON_ERROR(filepath, geteuid(), getegid());
+    }
+
+    writer->file.fd = -1;
+    writer->binlog.meta_fd = -1;
+    writer->binlog.legacy_dirty = false;
+    memset(&writer->stats, 0, sizeof(writer->stats));
+    memset(&writer->published_stats, 0, sizeof(writer->published_stats));
+    writer->stream_shared = false;
+    snprintf(writer->cfg.subdir_name,
+            sizeof(writer->cfg.subdir_name),
+            "%s", subdir_name);
+    writer->file.name = (char *)fc_malloc(path_len + 32);
+    if (writer->file.name == NULL) {
+        return ENOMEM;
+    }
+
+    if ((result=get_binlog_index_from_file(writer)) != 0) {
+        return result;
+    }
+
+    if ((result=redo_binlog_truncate(writer)) != 0) {
+        return result;
+    }
+    check_write_legacy_binlog_index_file(writer);
+
+    if ((result=open_writable_binlog(writer)) != 0) {
+        return result;
+    }
+
+    return 0;
+}
+
+int sf_binlog_writer_init_by_version_ex(SFBinlogWriterInfo *writer,
+        const char *subdir_name, const uint64_t next_version,
+        const int buffer_size, const int ring_size, const int flags)
+{
+    int result;
+    int bytes;
+
+    bytes = sizeof(SFBinlogWriterBuffer *) * ring_size;
+    writer->version_ctx.ring.slots = (SFBinlogWriterBuffer **)
+        fc_malloc(bytes);
+    if (writer->version_ctx.ring.slots == NULL) {
+        return ENOMEM;
+    }
+    memset(writer->version_ctx.ring.slots, 0, bytes);
+    writer->version_ctx.ring.overflow.entries = NULL;
+    writer->version_ctx.ring.overflow.count = 0;
+    writer->version_ctx.ring.overflow.alloc = 0;
+    writer->version_ctx.ring.size = ring_size;
+    writer->version_ctx.ring.waiting_count = 0;
+    writer->version_ctx.ring.max_waitings = 0;
+    writer->version_ctx.change_count = 0;
+
+    memset(&writer->version_ctx.backpressure, 0,
+            sizeof(writer->version_ctx.backpressure));
+    if ((result=init_pthread_lock_cond_pair(&writer->
+                    version_ctx.backpressure.lcp)) != 0)
+    {
+        return result;
+    }
+
+    binlog_writer_set_next_version(writer, next_version);
+    return sf_binlog_writer_init_normal_ex(writer,
+            subdir_name, buffer_size, flags);
+}
+
+int sf_binlog_writer_wait_version_gap(SFBinlogWriterInfo *writer,
+        const int64_t version, const int timeout_ms)
+{
+    int result;
+    int64_t start_us;
+    int64_t now_us;
+    int64_t expire_us;
+    int64_t wait_us;
+    struct timespec ts;
+
+    if (timeout_ms == 0) {
+        __sync_add_and_fetch(&writer->version_ctx.
+                backpressure.stats.again_count, 1);
+        return EAGAIN;
+    }
+
+    start_us = get_current_time_us();
+    expire_us = (timeout_ms > 0) ? start_us + timeout_ms * 1000LL : -1;
+    result = 0;
+
+    PTHREAD_MUTEX_LOCK(&writer->version_ctx.backpressure.lcp.lock);
+    __sync_add_and_fetch(&writer->version_ctx.backpressure.waitings, 1);
+    while (SF_BINLOG_WRITER_VERSION_GAP_EXCEEDED(writer, version)) {
+        if (!SF_G_CONTINUE_FLAG) {
+            result = EINTR;
+            break;
+        }
+
+        now_us = get_current_time_us();
+        wait_us = 100 * 1000;  //check the continue flag periodically
+        if (expire_us > 0) {
+            if (now_us >= expire_us) {
+                result = ETIMEDOUT;
+                break;
+            }
+            if (expire_us - now_us < wait_us) {
+                wait_us = expire_us - now_us;
+            }
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wait_us / 1000000;
+        ts.tv_nsec += (wait_us % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&writer->version_ctx.backpressure.lcp.cond,
+                &writer->version_ctx.backpressure.lcp.lock, &ts);
+    }
+    __sync_sub_and_fetch(&writer->version_ctx.backpressure.waitings, 1);
+    PTHREAD_MUTEX_UNLOCK(&writer->version_ctx.backpressure.lcp.lock);
+
+    __sync_add_and_fetch(&writer->version_ctx.backpressure.
+            stats.block_count, 1);
+    __sync_add_and_fetch(&writer->version_ctx.backpressure.
+            stats.block_time_us, get_current_time_us() - start_us);
+    if (result == ETIMEDOUT) {
+        __sync_add_and_fetch(&writer->version_ctx.backpressure.
+                stats.timeout_count, 1);
+    }
+    return result;
+}
+
+/* the buffers allocated without the fixed size are not freed */
+static void binlog_writer_destroy_thread(SFBinlogWriterThread *thread)
+{
+    pthread_mutex_destroy(&thread->lock);
+    fc_queue_destroy(&thread->queue);
+    destroy_size_classes(thread);
+    fast_mblock_destroy(&thread->mblock);
+}
+
+static int binlog_writer_init_thread(SFBinlogWriterThread *thread,
+        SFBinlogWriterInfo *writer, const short order_mode,
+        const short order_by, const int max_record_size,
+        const bool use_fixed_buffer_size, const bool framed)
+{
+    const int alloc_elements_once = 1024;
+    int element_size;
+    pthread_t tid;
+    int result;
+
+    thread->order_mode = order_mode;
+    thread->order_by = order_by;
+    thread->use_fixed_buffer_size = use_fixed_buffer_size;
+    thread->max_record_size = max_record_size;
+    thread->frame_header_size = framed ? SF_BINLOG_FRAME_HEADER_SIZE : 0;
+    thread->writer = writer;
+    if (writer != NULL) {
+        writer->cfg.max_record_size = max_record_size;
+        writer->thread = thread;
+    }
+
+    element_size = sizeof(SFBinlogWriterBuffer);
+    if (use_fixed_buffer_size) {
+        element_size += thread->frame_header_size + max_record_size;
+    }
+    if ((result=fast_mblock_init_ex1(&thread->mblock, "binlog_wbuffer",
+                     element_size, alloc_elements_once, 0,
+                     binlog_wbuffer_alloc_init, thread, true)) != 0)
+    {
+        return result;
+    }
+    if ((result=init_size_classes(thread)) != 0) {
+        fast_mblock_destroy(&thread->mblock);
+        return result;
+    }
+
+    if ((result=fc_queue_init(&thread->queue, (unsigned long)
+                    (&((SFBinlogWriterBuffer *)NULL)->next))) != 0)
+    {
+        destroy_size_classes(thread);
+        fast_mblock_destroy(&thread->mblock);
+        return result;
+    }
+    if ((result=init_pthread_lock(&thread->lock)) != 0) {
+        fc_queue_destroy(&thread->queue);
+        destroy_size_classes(thread);
+        fast_mblock_destroy(&thread->mblock);
+        return result;
+    }
+
+    memset(&thread->stats, 0, sizeof(thread->stats));
+    memset(&thread->published_stats, 0, sizeof(thread->published_stats));
+    thread->flush_writers.head = thread->flush_writers.tail = NULL;
+    thread->bound_writers = NULL;
+
+    /* set before creating for the stopping to wait */
+    thread->continue_flag = true;
+    thread->running = true;
+    if ((result=fc_create_thread(&tid, binlog_writer_func, thread,
+                    SF_G_THREAD_STACK_SIZE)) != 0)
+    {
+        thread->running = false;
+        binlog_writer_destroy_thread(thread);
+    }
+    return result;
 }
 
-static int binlog_wbuffer_alloc_init(void *element, void *args)
+int sf_binlog_writer_init_thread_ex(SFBinlogWriterThread *thread,
+        SFBinlogWriterInfo *writer, const short order_mode,
+        const short order_by, const int max_record_size,
+        const int writer_count, const bool use_fixed_buffer_size)
 {
-    SFBinlogWriterBuffer *wbuffer;
-    SFBinlogWriterInfo *writer;
-
-    wbuffer = (SFBinlogWriterBuffer *)element;
-    writer = (SFBinlogWriterInfo *)args;
-    wbuffer->writer = writer;
-    wbuffer->bf.alloc_size = writer->cfg.max_record_size;
-    if (writer->thread->use_fixed_buffer_size) {
-        wbuffer->bf.buff = (char *)(wbuffer + 1);
-    } else {
-        wbuffer->bf.buff = (char *)fc_malloc(writer->cfg.max_record_size);
-        if (wbuffer->bf.buff == NULL) {
-            return ENOMEM;
-        }
-    }
-    return 0;
+    return binlog_writer_init_thread(thread, writer, order_mode,
+            order_by, max_record_size, use_fixed_buffer_size,
+            writer != NULL && FRAMED_ENABLED(writer));
 }
 
-int sf_binlog_writer_init_normal(SFBinlogWriterInfo *writer,
-        const char *subdir_name, const int buffer_size)
+int sf_binlog_writer_init_thread_pool(SFBinlogWriterThreadPool *pool,
+        const int thread_count, const short order_mode,
+        const short order_by, const int max_record_size,
+        const bool use_fixed_buffer_size, const bool framed)
 {
     int result;
-    int path_len;
-    bool create;
-    char filepath[PATH_MAX];
+    int bytes;
+    SFBinlogWriterThread *thread;
+    SFBinlogWriterThread *end;
 
-    writer->total_count = 0;
-    writer->flush.in_queue = false;
-    if ((result=sf_binlog_buffer_init(&writer->binlog_buffer,
-                    buffer_size)) != 0)
-    {
-        return result;
+    if (thread_count <= 0) {
+        logError("file: "__FILE__", line: %d, "
+                "invalid thread count: %d!", __LINE__, thread_count);
+        return EINVAL;
     }
 
-    path_len = snprintf(filepath, sizeof(filepath), "%s/%s",
-            g_sf_binlog_data_path, subdir_name);
-    if ((result=fc_check_mkdir_ex(filepath, 0775, &create)) != 0) {
-        return result;
+    bytes = sizeof(SFBinlogWriterThread) * thread_count;
+    pool->threads = (SFBinlogWriterThread *)fc_malloc(bytes);
+    if (pool->threads == NULL) {
+        return ENOMEM;
     }
-    if (create) {
-        SF_CHOWN_RETURN_ON_ERROR(filepath, geteuid(), getegid());
+    memset(pool->threads, 0, bytes);
+
+    pool->count = 0;
+    end = pool->threads + thread_count;
+    for (thread=pool->threads; thread<end; thread++) {
+        if ((result=binlog_writer_init_thread(thread, NULL, order_mode,
+                        order_by, max_record_size,
+                        use_fixed_buffer_size, framed)) != 0)
+        {
+            sf_binlog_writer_thread_pool_finish(pool);
+            return result;
+        }
+        pool->count++;
     }
 
-    writer->file.fd = -1;
-    snprintf(writer->cfg.subdir_name,
-            sizeof(writer->cfg.subdir_name),
-            "%s", subdir_name);
-    writer->file.name = (char *)fc_malloc(path_len + 32);
-    if (writer->file.name == NULL) {
-        return ENOMEM;
-    }
+    return 0;
+}
 
-    if ((result=get_binlog_index_from_file(writer)) != 0) {
-        return result;
+int sf_binlog_writer_bind_thread_ex(SFBinlogWriterThreadPool *pool,
+        SFBinlogWriterInfo *writer, const unsigned int hash_code)
+{
+    if (pool->count <= 0) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, the thread pool not inited!",
+                __LINE__, writer->cfg.subdir_name);
+        return EINVAL;
     }
 
-    if ((result=open_writable_binlog(writer)) != 0) {
-        return result;
+    if (FRAMED_ENABLED(writer) && pool->threads[0].frame_header_size == 0) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, the framed writer can't be bound to "
+                "the thread pool which is not inited as framed!",
+                __LINE__, writer->cfg.subdir_name);
+        return EINVAL;
     }
 
+    writer->thread = pool->threads + hash_code % pool->count;
+    writer->cfg.max_record_size = writer->thread->max_record_size;
+
+    PTHREAD_MUTEX_LOCK(&writer->thread->lock);
+    writer->next_bound = writer->thread->bound_writers;
+    writer->thread->bound_writers = writer;
+    PTHREAD_MUTEX_UNLOCK(&writer->thread->lock);
     return 0;
 }
 
-int sf_binlog_writer_init_by_version(SFBinlogWriterInfo *writer,
-        const char *subdir_name, const uint64_t next_version,
-        const int buffer_size, const int ring_size)
+void sf_binlog_writer_thread_pool_finish(SFBinlogWriterThreadPool *pool)
 {
-    int bytes;
+    SFBinlogWriterThread *thread;
+    SFBinlogWriterThread *end;
+    SFBinlogWriterInfo *writer;
 
-    bytes = sizeof(SFBinlogWriterSlot) * ring_size;
-    writer->version_ctx.ring.slots = (SFBinlogWriterSlot *)fc_malloc(bytes);
-    if (writer->version_ctx.ring.slots == NULL) {
-        return ENOMEM;
+    if (pool->threads == NULL) {
+        return;
     }
-    memset(writer->version_ctx.ring.slots, 0, bytes);
-    writer->version_ctx.ring.size = ring_size;
-    writer->version_ctx.ring.waiting_count = 0;
-    writer->version_ctx.ring.max_waitings = 0;
-    writer->version_ctx.change_count = 0;
 
-    binlog_writer_set_next_version(writer, next_version);
-    return sf_binlog_writer_init_normal(writer, subdir_name, buffer_size);
+    end = pool->threads + pool->count;
+    for (thread=pool->threads; thread<end; thread++) {
+        thread->continue_flag = false;
+        fc_queue_terminate(&thread->queue);
+    }
+
+    for (thread=pool->threads; thread<end; thread++) {
+        binlog_writer_stop_thread(thread);
+        binlog_writer_drain_queue(thread);
+
+        /* the writers not finished are detached */
+        for (writer=thread->bound_writers; writer!=NULL;
+                writer=writer->next_bound)
+        {
+            writer->thread = NULL;
+        }
+        thread->bound_writers = NULL;
+        binlog_writer_destroy_thread(thread);
+    }
+
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->count = 0;
 }
 
-int sf_binlog_writer_init_thread_ex(SFBinlogWriterThread *thread,
-        SFBinlogWriterInfo *writer, const short order_mode,
-        const short order_by, const int max_record_size,
-        const int writer_count, const bool use_fixed_buffer_size)
+int sf_binlog_writer_enable_version_index(SFBinlogWriterInfo *writer,
+        const int interval_records, const int interval_bytes)
 {
-    const int alloc_elements_once = 1024;
-    int element_size;
-    pthread_t tid;
+    const int max_pending_entries = 64;
     int result;
+    int64_t entry_count;
+    SFBinlogFilePosition position;
+    SFBinlogVersionIndexEntry last;
+    char filename[PATH_MAX];
 
-    thread->order_mode = order_mode;
-    thread->order_by = order_by;
-    thread->use_fixed_buffer_size = use_fixed_buffer_size;
-    writer->cfg.max_record_size = max_record_size;
-    writer->thread = thread;
+    if (interval_records <= 0 && interval_bytes <= 0) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, invalid interval records: %d "
+                "and interval bytes: %d", __LINE__, writer->
+                cfg.subdir_name, interval_records, interval_bytes);
+        return EINVAL;
+    }
 
-    element_size = sizeof(SFBinlogWriterBuffer);
-    if (use_fixed_buffer_size) {
-        element_size += max_record_size;
+    /* remove the entries beyond the recovered binlog end, such as
+       the torn tail truncated or the binlog files lost by the crash */
+    sf_binlog_get_current_write_position(writer, &position);
+    if ((result=sf_binlog_version_index_truncate(writer->cfg.subdir_name,
+                    &position)) != 0 && result != ENOENT)
+    {
+        return result;
     }
-    if ((result=fast_mblock_init_ex1(&thread->mblock, "binlog_wbuffer",
-                     element_size, alloc_elements_once, 0,
-                     binlog_wbuffer_alloc_init, writer, true)) != 0)
+
+    result = sf_binlog_version_index_get_last(
+            writer->cfg.subdir_name, &last, &entry_count);
+    if (result == 0) {
+        writer->version_index.last_version = last.version;
+    } else if (result == ENOENT) {
+        writer->version_index.last_version = 0;
+    } else {
+        return result;
+    }
+
+    sf_binlog_version_index_get_filename(writer->cfg.subdir_name,
+            filename, sizeof(filename));
+    writer->version_index.fd = open(filename,
+            O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (writer->version_index.fd < 0) {
+        result = errno != 0 ? errno : EACCES;
+        logError("file: "__FILE__", line: %d, "
+                "open file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, filename, result, STRERROR(result));
+        return result;
+    }
+
+    /* remove the torn entries */
+    if (ftruncate(writer->version_index.fd, entry_count *
+                SF_BINLOG_VERSION_INDEX_ENTRY_SIZE) != 0)
     {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "truncate file \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, filename, result, STRERROR(result));
         return result;
     }
 
-    if ((result=fc_queue_init(&thread->queue, (unsigned long)
-                    (&((SFBinlogWriterBuffer *)NULL)->next))) != 0)
+    if ((result=sf_binlog_buffer_init(&writer->version_index.buffer,
+                    SF_BINLOG_VERSION_INDEX_ENTRY_SIZE *
+                    max_pending_entries)) != 0)
     {
         return result;
     }
 
-    thread->flush_writers.head = thread->flush_writers.tail = NULL;
-    return fc_create_thread(&tid, binlog_writer_func, thread,
-            SF_G_THREAD_STACK_SIZE);
+    writer->version_index.interval_records = interval_records;
+    writer->version_index.interval_bytes = interval_bytes;
+    writer->version_index.record_count = 0;
+    writer->version_index.bytes = 0;
+    writer->version_index.last_binlog_index = -1;
+    return 0;
 }
 
 int sf_binlog_writer_change_order_by(SFBinlogWriterInfo *writer,
@@ -751,6 +2844,266 @@ int sf_binlog_writer_set_binlog_index(SFBinlogWriterInfo *writer,
     return open_writable_binlog(writer);
 }
 
+static int truncate_binlog(SFBinlogWriterInfo *writer,
+        BinlogTruncateContext *ctx)
+{
+    int result;
+
+    if (writer->thread == NULL || !writer->thread->running) {
+        if ((result=execute_binlog_truncate(writer, ctx)) != 0) {
+            return result;
+        }
+        return ctx->result;
+    }
+
+    if ((result=init_pthread_lock_cond_pair(&ctx->lcp)) != 0) {
+        return result;
+    }
+
+    ctx->done = false;
+    ctx->result = 0;
+    memset(&ctx->notify, 0, sizeof(ctx->notify));
+    ctx->notify.type = SF_BINLOG_BUFFER_TYPE_TRUNCATE_BINLOG;
+    ctx->notify.writer = writer;
+    ctx->notify.bf.buff = (char *)ctx;
+    fc_queue_push(&writer->thread->queue, &ctx->notify);
+
+    if (!wait_request_done(writer->thread, &ctx->lcp, &ctx->done, 0)) {
+        /* the writer thread exited before popping the request,
+           deal the pending records and the request inline */
+        binlog_writer_drain_queue(writer->thread);
+
+        /* the request maybe popped by sf_binlog_writer_finish */
+        if (!wait_request_done(writer->thread, &ctx->lcp,
+                    &ctx->done, 3000))
+        {
+            logError("file: "__FILE__", line: %d, "
+                    "subdir_name: %s, the binlog writer thread exited, "
+                    "the truncate request is dropped", __LINE__,
+                    writer->cfg.subdir_name);
+            ctx->result = EINTR;
+        }
+    }
+
+    destroy_pthread_lock_cond_pair(&ctx->lcp);
+    return ctx->result;
+}
+
+int sf_binlog_writer_truncate(SFBinlogWriterInfo *writer,
+        const SFBinlogFilePosition *position)
+{
+    BinlogTruncateContext ctx;
+
+    ctx.by_version = false;
+    ctx.version = 0;
+    ctx.position = *position;
+    return truncate_binlog(writer, &ctx);
+}
+
+int sf_binlog_writer_truncate_to_version(SFBinlogWriterInfo *writer,
+        const int64_t version)
+{
+    BinlogTruncateContext ctx;
+
+    if (!((writer->thread != NULL && writer->thread->order_by ==
+                    SF_BINLOG_THREAD_TYPE_ORDER_BY_VERSION) ||
+                writer->stream_shared))
+    {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, truncate to version only support "
+                "the writer order by version or shared by the streams",
+                __LINE__, writer->cfg.subdir_name);
+        return EOPNOTSUPP;
+    }
+
+    ctx.by_version = true;
+    ctx.version = version;
+    ctx.position.index = 0;
+    ctx.position.offset = 0;
+    return truncate_binlog(writer, &ctx);
+}
+
+int sf_binlog_producer_ring_init(SFBinlogProducerRing *ring,
+        SFBinlogWriterInfo *writer, const int size)
+{
+    int alloc_size;
+    int result;
+
+    if (writer->thread->order_mode != SF_BINLOG_THREAD_ORDER_MODE_FIXED ||
+            writer->thread->order_by != SF_BINLOG_THREAD_TYPE_ORDER_BY_NONE)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, producer ring only support fixed "
+                "order mode and order by none!", __LINE__,
+                writer->cfg.subdir_name);
+        return EINVAL;
+    }
+
+    alloc_size = 4 * 1024;
+    while (alloc_size < size) {
+        alloc_size *= 2;
+    }
+    if ((result=init_pthread_lock_cond_pair(&ring->lcp)) != 0) {
+        return result;
+    }
+    ring->buff = (char *)fc_malloc(alloc_size);
+    if (ring->buff == NULL) {
+        destroy_pthread_lock_cond_pair(&ring->lcp);
+        return ENOMEM;
+    }
+
+    ring->size = alloc_size;
+    ring->mask = alloc_size - 1;
+    ring->head = ring->tail = 0;
+    ring->wrap_pos = -1;
+    ring->record_count = 0;
+    ring->drained_count = 0;
+    ring->notified = 0;
+    ring->waitings = 0;
+    ring->reserved.pad = ring->reserved.length = 0;
+    ring->reserved.record = NULL;
+
+    memset(&ring->notify, 0, sizeof(ring->notify));
+    ring->notify.type = SF_BINLOG_BUFFER_TYPE_DRAIN_PRODUCER_RING;
+    ring->notify.bf.buff = (char *)ring;
+    ring->notify.writer = writer;
+    ring->writer = writer;
+    return 0;
+}
+
+/* wait for the writer thread draining the ring while the condition
+   is true, the timed wait checks the program terminating */
+static void producer_ring_wait(SFBinlogProducerRing *ring,
+        bool (*check_func)(SFBinlogProducerRing *ring, const int need),
+        const int need)
+{
+    struct timespec ts;
+
+    PTHREAD_MUTEX_LOCK(&ring->lcp.lock);
+    __sync_add_and_fetch(&ring->waitings, 1);
+    while (check_func(ring, need) && SF_G_CONTINUE_FLAG &&
+            ring->writer->thread->running)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100 * 1000 * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&ring->lcp.cond, &ring->lcp.lock, &ts);
+    }
+    __sync_sub_and_fetch(&ring->waitings, 1);
+    PTHREAD_MUTEX_UNLOCK(&ring->lcp.lock);
+}
+
+static bool producer_ring_is_full(SFBinlogProducerRing *ring,
+        const int need)
+{
+    return ring->head + need - __sync_add_and_fetch(
+            &ring->tail, 0) > ring->size;
+}
+
+/* the notify buffer is in the queue or the records not drained */
+static bool producer_ring_is_draining(SFBinlogProducerRing *ring,
+        const int need)
+{
+    return __sync_add_and_fetch(&ring->notified, 0) != 0 ||
+        __sync_add_and_fetch(&ring->drained_count, 0) !=
+        __sync_add_and_fetch(&ring->record_count, 0);
+}
+
+void sf_binlog_producer_ring_destroy(SFBinlogProducerRing *ring)
+{
+    if (ring->buff == NULL) {
+        return;
+    }
+
+    producer_ring_wait(ring, producer_ring_is_draining, 0);
+    if (producer_ring_is_draining(ring, 0)) {
+        /* the writer thread exited, drain the ring inline */
+        binlog_writer_drain_queue(ring->writer->thread);
+        if (producer_ring_is_draining(ring, 0)) {
+            logWarning("file: "__FILE__", line: %d, "
+                    "subdir_name: %s, %"PRId64" records of the producer "
+                    "ring are not written", __LINE__,
+                    ring->writer->cfg.subdir_name, ring->record_count -
+                    ring->drained_count);
+        }
+    }
+
+    destroy_pthread_lock_cond_pair(&ring->lcp);
+    free(ring->buff);
+    ring->buff = NULL;
+}
+
+char *sf_binlog_producer_ring_reserve(SFBinlogProducerRing *ring,
+        const int record_length)
+{
+    int length;
+    int offset;
+    int pad;
+
+    if (FRAMED_ENABLED(ring->writer)) {
+        length = SF_BINLOG_FRAME_HEADER_SIZE + record_length;
+    } else {
+        length = record_length;
+    }
+    if (record_length <= 0 || length > ring->size / 2) {
+        logError("file: "__FILE__", line: %d, "
+                "subdir_name: %s, invalid record length: %d, "
+                "ring size: %d", __LINE__, ring->writer->
+                cfg.subdir_name, length, ring->size);
+        return NULL;
+    }
+
+    offset = ring->head & ring->mask;
+    pad = (offset + length > ring->size) ? ring->size - offset : 0;
+    if (producer_ring_is_full(ring, pad + length)) {
+        producer_ring_wait(ring, producer_ring_is_full, pad + length);
+        if (producer_ring_is_full(ring, pad + length)) {
+            return NULL;  //the program or the writer thread terminated
+        }
+    }
+
+    ring->reserved.pad = pad;
+    ring->reserved.length = length;
+    ring->reserved.record = ring->buff + (pad > 0 ? 0 : offset);
+    if (FRAMED_ENABLED(ring->writer)) {
+        return ring->reserved.record + SF_BINLOG_FRAME_HEADER_SIZE;
+    } else {
+        return ring->reserved.record;
+    }
+}
+
+void sf_binlog_producer_ring_commit(SFBinlogProducerRing *ring,
+        const int record_length)
+{
+    int length;
+
+    if (FRAMED_ENABLED(ring->writer)) {
+        sf_binlog_frame_pack_header(ring->reserved.record, 0,
+                ring->reserved.record + SF_BINLOG_FRAME_HEADER_SIZE,
+                record_length);
+        length = SF_BINLOG_FRAME_HEADER_SIZE + record_length;
+    } else {
+        length = record_length;
+    }
+
+    if (ring->reserved.pad > 0) {
+        ring->wrap_pos = ring->head;
+    }
+
+    /* the atomic op is a full barrier, publish the record data
+       and the wrap position before the head */
+    __sync_add_and_fetch(&ring->record_count, 1);
+    __sync_add_and_fetch(&ring->head, ring->reserved.pad + length);
+    ring->reserved.pad = ring->reserved.length = 0;
+
+    if (__sync_bool_compare_and_swap(&ring->notified, 0, 1)) {
+        fc_queue_push(&ring->writer->thread->queue, &ring->notify);
+    }
+}
+
 int sf_binlog_writer_get_last_lines(const char *subdir_name,
         const int current_write_index, char *buff,
         const int buff_size, int *count, int *length)
@@ -793,3 +3146,46 @@ int sf_binlog_writer_get_last_lines(const char *subdir_name,
     *count -= remain_count;
     return 0;
 }
+
+int sf_binlog_writer_get_last_frames(const char *subdir_name,
+        const int current_write_index, char *buff,
+        const int buff_size, int *count, int *length)
+{
+    int result;
+    int remain_count;
+    int current_count;
+    int current_index;
+    int i;
+    char filename[PATH_MAX];
+    string_t frames;
+
+    current_index = current_write_index;
+    *length = 0;
+    remain_count = *count;
+    for (i=0; i<2; i++) {
+        current_count = remain_count;
+        sf_binlog_writer_get_filename(subdir_name,
+                current_index, filename, sizeof(filename));
+        result = sf_binlog_frame_get_last_frames(filename, buff + *length,
+                buff_size - *length, &frames, &current_count);
+        if (result == 0) {
+            memmove(buff + *length, frames.str, frames.len);
+            *length += frames.len;
+            remain_count -= current_count;
+            if (remain_count == 0) {
+                break;
+            }
+        } else if (result != ENOENT) {
+            *count = 0;
+            return result;
+        }
+        if (current_index == 0) {
+            break;
+        }
+
+        --current_index;  //try previous binlog file
+    }
+
+    *count -= remain_count;
+    return 0;
+}
@@ -19,7 +19,9 @@
 #define _SF_BINLOG_WRITER_H_
 
 #include "fastcommon/fc_queue.h"
+#include "fastcommon/hash.h"
 #include "sf_types.h"
+#include "sf_binlog_frame.h"
 
 #define SF_BINLOG_THREAD_ORDER_MODE_FIXED       0
 #define SF_BINLOG_THREAD_ORDER_MODE_VARY        1
@@ -30,6 +32,17 @@
 #define SF_BINLOG_BUFFER_TYPE_WRITE_TO_FILE     0  //default type, must be 0
 #define SF_BINLOG_BUFFER_TYPE_SET_NEXT_VERSION  1
 #define SF_BINLOG_BUFFER_TYPE_CHANGE_ORDER_TYPE 2
+#define SF_BINLOG_BUFFER_TYPE_DRAIN_PRODUCER_RING 3
+#define SF_BINLOG_BUFFER_TYPE_TRUNCATE_BINLOG   4
+#define SF_BINLOG_BUFFER_TYPE_DETACH_WRITER     5
+
+#define SF_BINLOG_WRITER_FLAGS_DIRECT_IO   1  //write with O_DIRECT
+#define SF_BINLOG_WRITER_FLAGS_FRAMED      2  //length + CRC32C framed records
+#define SF_BINLOG_WRITER_FLAGS_STATS       4  //collect the latency stats
+
+/* in direct IO mode, the tail block is padded with zero bytes and
+   rewritten by the next write, so a record MUST NOT end with '\0' */
+#define SF_BINLOG_DIRECT_IO_ALIGN_SIZE  4096
 
 #define SF_BINLOG_SUBDIR_NAME_SIZE 128
 #define SF_BINLOG_FILE_MAX_SIZE   (1024 * 1024 * 1024)  //for binlog rotating by size
@@ -39,9 +52,52 @@
 #define SF_BINLOG_BUFFER_LENGTH(buffer) ((buffer).end - (buffer).buff)
 #define SF_BINLOG_BUFFER_REMAIN(buffer) ((buffer).end - (buffer).current)
 
+/* the size classes of the record buffers: 64, 128, ..., 8KB,
+   the larger records are allocated by malloc */
+#define SF_BINLOG_BUFFER_MIN_SIZE_CLASS     64
+#define SF_BINLOG_BUFFER_SIZE_CLASS_COUNT    8
+
+#define SF_BINLOG_BUFFER_ALLOC_BY_MBLOCK    -1  //max_record_size buffer
+#define SF_BINLOG_BUFFER_ALLOC_BY_MALLOC    -2
+
 #define SF_BINLOG_BUFFER_SET_VERSION(buffer, ver)  \
     (buffer)->version.first = (buffer)->version.last = ver
 
+#define SF_BINLOG_HISTOGRAM_BUCKETS  32
+
+/* bucket 0 for value 0, bucket i for [2^(i-1), 2^i) */
+typedef struct sf_binlog_histogram {
+    int64_t count;
+    int64_t total;
+    int64_t max;
+    int64_t buckets[SF_BINLOG_HISTOGRAM_BUCKETS];
+} SFBinlogHistogram;
+
+/* updated by the writer thread and published at flush,
+   the time unit is microsecond */
+typedef struct sf_binlog_writer_stats {
+    int64_t flush_count;
+    int64_t rotate_count;
+    SFBinlogHistogram flush_records;   //records per flush
+    SFBinlogHistogram flush_bytes;     //bytes per flush
+    SFBinlogHistogram queue_delay;     //from push to pop
+    SFBinlogHistogram write_delay;     //from push to flushed, the oldest
+    SFBinlogHistogram fsync_time;
+    SFBinlogHistogram rotate_time;
+    SFBinlogHistogram ring_waitings;   //reorder ring occupancy per flush
+    struct {
+        int records;
+        int64_t bytes;
+        int64_t first_push_time_us;
+    } pending;  //since the last flush
+} SFBinlogWriterStats;
+
+typedef struct sf_binlog_writer_thread_stats {
+    int64_t pop_count;
+    int64_t last_pop_time_us;
+    SFBinlogHistogram queue_depth;     //buffers per pop
+} SFBinlogWriterThreadStats;
+
 struct sf_binlog_writer_info;
 
 typedef struct sf_binlog_writer_buffer {
@@ -49,16 +105,23 @@ typedef struct sf_binlog_writer_buffer {
     BufferInfo bf;
     int64_t tag;
     int type;    //for versioned writer
+    short size_class;  //the size class index or SF_BINLOG_BUFFER_ALLOC_BY_xxx
+    int stream_id;     //the logical writer id for the shared binlog
+    int64_t push_time_us;  //for SF_BINLOG_WRITER_FLAGS_STATS
     struct sf_binlog_writer_info *writer;
     struct sf_binlog_writer_buffer *next;
 } SFBinlogWriterBuffer;
 
-typedef struct sf_binlog_writer_slot {
-    SFBinlogWriterBuffer head;
-} SFBinlogWriterSlot;
-
+/* the reorder buffer for the versioned writer: the buffers whose version
+   in [next, next + size) are indexed by version % size directly and the
+   further ones are kept in the overflow min heap */
 typedef struct sf_binlog_writer_buffer_ring {
-    SFBinlogWriterSlot *slots;
+    SFBinlogWriterBuffer **slots;
+    struct {
+        SFBinlogWriterBuffer **entries;  //min heap order by version.first
+        int count;
+        int alloc;
+    } overflow;
     int waiting_count;
     int max_waitings;
     int size;
@@ -66,26 +129,49 @@ typedef struct sf_binlog_writer_buffer_ring {
 
 typedef struct binlog_writer_thread {
     struct fast_mblock_man mblock;
+    struct fast_mblock_man size_classes[SF_BINLOG_BUFFER_SIZE_CLASS_COUNT];
     struct fc_queue queue;
-    bool running;
+    volatile bool running;
+    volatile bool continue_flag;  //false to stop this thread only
     bool use_fixed_buffer_size;
     short order_mode;
     short order_by;
+    short frame_header_size;  //the reserved space before the record
+    int max_record_size;
+    struct sf_binlog_writer_info *writer;  //the default writer, can be NULL
+    SFBinlogWriterThreadStats stats;
+    struct {
+        volatile int64_t seq;  //the seqlock, odd during the publishing
+        SFBinlogWriterThreadStats stats;
+    } published_stats;  //the snapshot for the other threads
     struct {
         struct sf_binlog_writer_info *head;
         struct sf_binlog_writer_info *tail;
     } flush_writers;
+    pthread_mutex_t lock;  //for the bound writers and the inline draining
+    struct sf_binlog_writer_info *bound_writers;  //bound to the pool thread
 } SFBinlogWriterThread;
 
+/* writers are bound to one thread of the pool, so the records of
+   the same writer are still written in order */
+typedef struct sf_binlog_writer_thread_pool {
+    SFBinlogWriterThread *threads;
+    int count;
+} SFBinlogWriterThreadPool;
+
 typedef struct sf_binlog_writer_info {
     struct {
         char subdir_name[SF_BINLOG_SUBDIR_NAME_SIZE];
         int max_record_size;
+        int flags;
     } cfg;
 
     struct {
         int index;
         int compress_index;
+        int64_t generation;  //the generation of the index meta file
+        int meta_fd;         //the index meta file is kept open
+        bool legacy_dirty;   //the legacy index file should be updated
     } binlog;
 
     struct {
@@ -94,20 +180,88 @@ typedef struct sf_binlog_writer_info {
         char *name;
     } file;
 
+    struct {
+        volatile int index;
+        volatile int64_t offset;
+    } published;  //the written position for the readers
+
     int64_t total_count;
+    bool stream_shared;  //shared by the stream writers
+    struct {
+        int interval_records;  //emit an entry every interval records
+        int interval_bytes;    //or every interval bytes
+        int record_count;      //records since the last entry
+        int64_t bytes;         //bytes since the last entry
+        int64_t last_version;
+        int last_binlog_index;
+        int fd;                //-1 for disabled
+        SFBinlogBuffer buffer; //the pending entries
+    } version_index;   //the sparse version index for ORDER_BY_VERSION
+
     struct {
         SFBinlogWriterBufferRing ring;
-        int64_t next;
+        volatile int64_t next;
         int64_t change_count;  //version change count
+
+        struct {
+            int64_t max_gap;  //the max gap from next version, 0 for unlimited
+            volatile int waitings;  //the count of the blocked producers
+            pthread_lock_cond_pair_t lcp;
+            struct {
+                int64_t max_gap;  //the max gap seen by the writer thread
+                volatile int64_t block_count;
+                volatile int64_t block_time_us;
+                volatile int64_t again_count;
+                volatile int64_t timeout_count;
+            } stats;
+        } backpressure;
     } version_ctx;
     SFBinlogBuffer binlog_buffer;
+    SFBinlogWriterStats stats;
+    struct {
+        volatile int64_t seq;  //the seqlock, odd during the publishing
+        SFBinlogWriterStats stats;
+    } published_stats;  //the snapshot for the other threads
     SFBinlogWriterThread *thread;
     struct {
         bool in_queue;
         struct sf_binlog_writer_info *next;
     } flush;
+    struct sf_binlog_writer_info *next_bound;  //for the pool thread
 } SFBinlogWriterInfo;
 
+/* single producer single consumer ring, the producer serializes the records
+   into the ring directly and the writer thread drains the ring segments */
+typedef struct sf_binlog_producer_ring {
+    char *buff;
+    int size;   //must be power of 2
+    int mask;
+    volatile int64_t head;      //modified by the producer only
+    volatile int64_t tail;      //modified by the writer thread only
+    volatile int64_t wrap_pos;  //the padding start position when wrapped
+    volatile int64_t record_count;
+    volatile int notified;
+
+    struct {
+        int pad;
+        int length;
+        char *record;
+    } reserved;   //for the producer
+
+    volatile int64_t drained_count;  //modified by the writer thread only
+    volatile int waitings;  //the producer waiting for the space or draining
+    pthread_lock_cond_pair_t lcp;  //signaled by the writer after draining
+    SFBinlogWriterBuffer notify;
+    struct sf_binlog_writer_info *writer;
+} SFBinlogProducerRing;
+
+/* many logical writers append to one shared framed binlog, the records
+   are tagged by the stream id and synced by the shared writer together */
+typedef struct sf_binlog_stream_writer {
+    SFBinlogWriterInfo *shared;
+    int stream_id;
+} SFBinlogStreamWriter;
+
 typedef struct sf_binlog_writer_context {
     SFBinlogWriterInfo writer;
     SFBinlogWriterThread thread;
@@ -119,12 +273,20 @@ extern "C" {
 
     extern char *g_sf_binlog_data_path;
 
-int sf_binlog_writer_init_normal(SFBinlogWriterInfo *writer,
-        const char *subdir_name, const int buffer_size);
+int sf_binlog_writer_init_normal_ex(SFBinlogWriterInfo *writer,
+        const char *subdir_name, const int buffer_size, const int flags);
 
-int sf_binlog_writer_init_by_version(SFBinlogWriterInfo *writer,
+int sf_binlog_writer_init_by_version_ex(SFBinlogWriterInfo *writer,
         const char *subdir_name, const uint64_t next_version,
-        const int buffer_size, const int ring_size);
+        const int buffer_size, const int ring_size, const int flags);
+
+#define sf_binlog_writer_init_normal(writer, subdir_name, buffer_size) \
+    sf_binlog_writer_init_normal_ex(writer, subdir_name, buffer_size, 0)
+
+#define sf_binlog_writer_init_by_version(writer, subdir_name, \
+        next_version, buffer_size, ring_size) \
+    sf_binlog_writer_init_by_version_ex(writer, subdir_name, \
+            next_version, buffer_size, ring_size, 0)
 
 int sf_binlog_writer_init_thread_ex(SFBinlogWriterThread *thread,
         SFBinlogWriterInfo *writer, const short order_mode,
@@ -152,12 +314,41 @@ static inline int sf_binlog_writer_init(SFBinlogWriterContext *context,
             SF_BINLOG_THREAD_TYPE_ORDER_BY_NONE, max_record_size);
 }
 
+/* framed: reserve the frame header space in the record buffers,
+   MUST be true when the framed writers are bound to the pool */
+int sf_binlog_writer_init_thread_pool(SFBinlogWriterThreadPool *pool,
+        const int thread_count, const short order_mode,
+        const short order_by, const int max_record_size,
+        const bool use_fixed_buffer_size, const bool framed);
+
+int sf_binlog_writer_bind_thread_ex(SFBinlogWriterThreadPool *pool,
+        SFBinlogWriterInfo *writer, const unsigned int hash_code);
+
+#define sf_binlog_writer_bind_thread(pool, writer) \
+    sf_binlog_writer_bind_thread_ex(pool, writer, simple_hash( \
+                (writer)->cfg.subdir_name, strlen((writer)->cfg.subdir_name)))
+
+/* stop the threads, deal the queued records and free the resources.
+   the writers bound to the pool should be finished before, the writers
+   still bound are detached and only their files are closed by
+   sf_binlog_writer_finish after. MUST NOT run with sf_binlog_writer_finish
+   of the bound writers concurrently */
+void sf_binlog_writer_thread_pool_finish(SFBinlogWriterThreadPool *pool);
+
+/* emit the sparse version index (version -> binlog position),
+   should be called after the writer inited and before writing */
+int sf_binlog_writer_enable_version_index(SFBinlogWriterInfo *writer,
+        const int interval_records, const int interval_bytes);
+
 int sf_binlog_writer_change_order_by(SFBinlogWriterInfo *writer,
         const short order_by);
 
 int sf_binlog_writer_change_next_version(SFBinlogWriterInfo *writer,
         const int64_t next_version);
 
+/* the writer bound to the pool thread is detached after its queued
+   records written, the thread of its own is stopped. the producers of
+   the writer MUST be stopped before */
 void sf_binlog_writer_finish(SFBinlogWriterInfo *writer);
 
 int sf_binlog_get_current_write_index(SFBinlogWriterInfo *writer);
@@ -165,10 +356,80 @@ int sf_binlog_get_current_write_index(SFBinlogWriterInfo *writer);
 void sf_binlog_get_current_write_position(SFBinlogWriterInfo *writer,
         SFBinlogFilePosition *position);
 
+/* get the written position, can be called by any thread */
+static inline void sf_binlog_writer_get_published_position(
+        SFBinlogWriterInfo *writer, SFBinlogFilePosition *position)
+{
+    position->index = writer->published.index;
+    __sync_synchronize();
+    position->offset = writer->published.offset;
+}
+
+/* limit the gap between the version of the producers and the next
+   version to write, for the writer inited by version only */
+static inline void sf_binlog_writer_set_max_version_gap(
+        SFBinlogWriterInfo *writer, const int64_t max_gap)
+{
+    writer->version_ctx.backpressure.max_gap = max_gap;
+}
+
+#define SF_BINLOG_WRITER_VERSION_GAP_EXCEEDED(writer, version) \
+    ((writer)->version_ctx.backpressure.max_gap > 0 && (version) - \
+     __sync_add_and_fetch(&(writer)->version_ctx.next, 0) > \
+     (writer)->version_ctx.backpressure.max_gap)
+
+int sf_binlog_writer_wait_version_gap(SFBinlogWriterInfo *writer,
+        const int64_t version, const int timeout_ms);
+
+/* the producer should call it before pushing the buffer of the version
+ * timeout_ms: 0 for no wait, < 0 for wait until the gap is small enough
+ * return 0 for success, EAGAIN for no wait, ETIMEDOUT for timeout,
+ *        EINTR for the program terminating
+ */
+static inline int sf_binlog_writer_check_version_gap(
+        SFBinlogWriterInfo *writer, const int64_t version,
+        const int timeout_ms)
+{
+    if (!SF_BINLOG_WRITER_VERSION_GAP_EXCEEDED(writer, version)) {
+        return 0;
+    }
+    return sf_binlog_writer_wait_version_gap(writer, version, timeout_ms);
+}
+
 static inline SFBinlogWriterBuffer *sf_binlog_writer_alloc_buffer(
         SFBinlogWriterThread *thread)
 {
-    return (SFBinlogWriterBuffer *)fast_mblock_alloc_object(&thread->mblock);
+    SFBinlogWriterBuffer *buffer;
+    buffer = (SFBinlogWriterBuffer *)fast_mblock_alloc_object(&thread->mblock);
+    if (buffer != NULL) {
+        buffer->stream_id = 0;
+    }
+    return buffer;
+}
+
+/* alloc the buffer which can hold the record of the size, the record
+   larger than max_record_size is allowed */
+SFBinlogWriterBuffer *sf_binlog_writer_alloc_sized_buffer(
+        SFBinlogWriterThread *thread, const int record_size);
+
+/* free the buffer which is not pushed to the writer thread */
+void sf_binlog_writer_free_buffer(SFBinlogWriterThread *thread,
+        SFBinlogWriterBuffer *buffer);
+
+static inline SFBinlogWriterBuffer *
+    sf_binlog_writer_alloc_versioned_sized_buffer(
+        SFBinlogWriterInfo *writer, const int64_t first_version,
+        const int64_t last_version, const int record_size)
+{
+    SFBinlogWriterBuffer *buffer;
+    buffer = sf_binlog_writer_alloc_sized_buffer(writer->thread, record_size);
+    if (buffer != NULL) {
+        buffer->type = SF_BINLOG_BUFFER_TYPE_WRITE_TO_FILE;
+        buffer->writer = writer;
+        buffer->version.first = first_version;
+        buffer->version.last = last_version;
+    }
+    return buffer;
 }
 
 #define sf_binlog_writer_alloc_one_version_buffer(writer, version) \
@@ -189,6 +450,7 @@ static inline SFBinlogWriterBuffer *sf_binlog_writer_alloc_versioned_buffer_ex(
             &writer->thread->mblock);
     if (buffer != NULL) {
         buffer->type = type;
+        buffer->stream_id = 0;
         buffer->writer = writer;
         buffer->version.first = first_version;
         buffer->version.last = last_version;
@@ -196,6 +458,58 @@ static inline SFBinlogWriterBuffer *sf_binlog_writer_alloc_versioned_buffer_ex(
     return buffer;
 }
 
+/* the shared writer MUST be inited with SF_BINLOG_WRITER_FLAGS_FRAMED
+   and its thread MUST be ORDER_BY_NONE,
+   stream_id: the logical writer id, MUST > 0 */
+int sf_binlog_stream_writer_init(SFBinlogStreamWriter *stream,
+        SFBinlogWriterInfo *shared, const int stream_id);
+
+/* the record version is stored as the data version of the frame */
+static inline SFBinlogWriterBuffer *sf_binlog_stream_writer_alloc_buffer(
+        SFBinlogStreamWriter *stream, const int64_t version,
+        const int record_size)
+{
+    SFBinlogWriterBuffer *buffer;
+    buffer = sf_binlog_writer_alloc_versioned_sized_buffer(
+            stream->shared, version, version, record_size);
+    if (buffer != NULL) {
+        buffer->stream_id = stream->stream_id;
+    }
+    return buffer;
+}
+
+#define sf_binlog_stream_writer_push(stream, buffer) \
+    sf_push_to_binlog_write_queue((stream)->shared, buffer)
+
+static inline void sf_binlog_histogram_add(SFBinlogHistogram *histogram,
+        const int64_t value)
+{
+    int index;
+
+    index = (value > 0) ? 64 - __builtin_clzll(value) : 0;
+    if (index >= SF_BINLOG_HISTOGRAM_BUCKETS) {
+        index = SF_BINLOG_HISTOGRAM_BUCKETS - 1;
+    }
+    histogram->buckets[index]++;
+    histogram->count++;
+    histogram->total += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/* return the upper bound of the bucket which the percentile falls in */
+int64_t sf_binlog_histogram_percentile(const SFBinlogHistogram *histogram,
+        const double percent);
+
+/* get the snapshot of the stats published at the last flush, the writer
+   MUST be inited with SF_BINLOG_WRITER_FLAGS_STATS for the latency stats */
+void sf_binlog_writer_get_stats(SFBinlogWriterInfo *writer,
+        SFBinlogWriterStats *stats);
+
+void sf_binlog_writer_thread_get_stats(SFBinlogWriterThread *thread,
+        SFBinlogWriterThreadStats *stats);
+
 static inline const char *sf_binlog_writer_get_filepath(const char *subdir_name,
         char *filename, const int size)
 {
@@ -215,6 +529,26 @@ static inline const char *sf_binlog_writer_get_filename(const char *subdir_name,
 int sf_binlog_writer_set_binlog_index(SFBinlogWriterInfo *writer,
         const int binlog_index);
 
+/* truncate the binlog to the position which MUST be the record boundary,
+ * the data from the position and the later binlog files are removed.
+ * it is done by the writer thread between the writes and the interrupted
+ * truncation is redone when the writer inits, for the follower which
+ * diverges from the master (SF_CLUSTER_ERROR_BINLOG_INCONSISTENT).
+ * the caller should stop the producers and reopen the readers after it
+ */
+int sf_binlog_writer_truncate(SFBinlogWriterInfo *writer,
+        const SFBinlogFilePosition *position);
+
+/* remove the records whose version > the given version, the binlog MUST
+ * be framed and the versions MUST be ascending. the version index is used
+ * to locate the scan start when enabled, and the next version of the
+ * ORDER_BY_VERSION writer is set to version + 1
+ * return EOPNOTSUPP when the writer is neither ORDER_BY_VERSION nor
+ *        shared by the stream writers, whose frames store version 0
+ */
+int sf_binlog_writer_truncate_to_version(SFBinlogWriterInfo *writer,
+        const int64_t version);
+
 #define sf_push_to_binlog_thread_queue(thread, buffer) \
     fc_queue_push(&(thread)->queue, buffer)
 
@@ -222,13 +556,42 @@ static inline void sf_push_to_binlog_write_queue(SFBinlogWriterInfo *writer,
         SFBinlogWriterBuffer *buffer)
 {
     buffer->type = SF_BINLOG_BUFFER_TYPE_WRITE_TO_FILE;
+    buffer->writer = writer;
+    if ((writer->cfg.flags & SF_BINLOG_WRITER_FLAGS_STATS) != 0) {
+        buffer->push_time_us = get_current_time_us();
+    }
     fc_queue_push(&writer->thread->queue, buffer);
 }
 
+int sf_binlog_producer_ring_init(SFBinlogProducerRing *ring,
+        SFBinlogWriterInfo *writer, const int size);
+
+/* wait for the writer thread draining the committed records then free
+ * the ring. the shutdown order: stop the producer, destroy the ring,
+ * then finish the writer. the records are drained by the caller when
+ * the writer thread already exited
+ */
+void sf_binlog_producer_ring_destroy(SFBinlogProducerRing *ring);
+
+/* reserve contiguous space for one record, wait for the writer thread
+   draining when the ring is full. return NULL when length is too large,
+   the program is terminating or the writer thread exited */
+char *sf_binlog_producer_ring_reserve(SFBinlogProducerRing *ring,
+        const int record_length);
+
+/* commit the reserved record, length <= the reserved length */
+void sf_binlog_producer_ring_commit(SFBinlogProducerRing *ring,
+        const int record_length);
+
 int sf_binlog_writer_get_last_lines(const char *subdir_name,
         const int current_write_index, char *buff,
         const int buff_size, int *count, int *length);
 
+/* for the framed binlog */
+int sf_binlog_writer_get_last_frames(const char *subdir_name,
+        const int current_write_index, char *buff,
+        const int buff_size, int *count, int *length);
+
 #ifdef __cplusplus
 }
 #endif
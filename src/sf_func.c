@@ -19,6 +19,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
@@ -69,3 +71,45 @@ void sf_enable_exit_on_oom()
 {
     g_oom_notify = sf_memory_oom_notify_callback;
 }
+
+int sf_fsync_parent_dir(const char *filename)
+{
+    char path[PATH_MAX];
+    const char *last;
+    int len;
+    int fd;
+    int result;
+
+    if ((last=strrchr(filename, '/')) == NULL) {
+        strcpy(path, ".");
+    } else {
+        len = (last == filename) ? 1 : last - filename;
+        if (len >= sizeof(path)) {
+            return ENAMETOOLONG;
+        }
+        memcpy(path, filename, len);
+        *(path + len) = '\0';
+    }
+
+    if ((fd=open(path, O_RDONLY)) < 0) {
+        result = errno != 0 ? errno : EACCES;
+        logError("file: "__FILE__", line: %d, "
+                "open path \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, path, result, STRERROR(result));
+        return result;
+    }
+
+    if (fsync(fd) != 0) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "fsync path \"%s\" fail, "
+                "errno: %d, error info: %s",
+                __LINE__, path, result, STRERROR(result));
+    } else {
+        result = 0;
+    }
+
+    close(fd);
+    return result;
+}
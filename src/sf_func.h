@@ -60,6 +60,28 @@ static inline int sf_binlog_buffer_init(SFBinlogBuffer *buffer, const int size)
     return 0;
 }
 
+static inline int sf_binlog_buffer_init_aligned(SFBinlogBuffer *buffer,
+        const int size, const int align_size)
+{
+    int result;
+    int alloc_size;
+
+    alloc_size = (size + align_size - 1) / align_size * align_size;
+    if ((result=posix_memalign((void **)&buffer->buff,
+                    align_size, alloc_size)) != 0)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "posix_memalign %d bytes fail, "
+                "errno: %d, error info: %s", __LINE__,
+                alloc_size, result, STRERROR(result));
+        return result;
+    }
+
+    buffer->current = buffer->end = buffer->buff;
+    buffer->size = alloc_size;
+    return 0;
+}
+
 static inline void sf_binlog_buffer_destroy(SFBinlogBuffer *buffer)
 {
     if (buffer->buff != NULL) {
@@ -69,6 +91,9 @@ static inline void sf_binlog_buffer_destroy(SFBinlogBuffer *buffer)
     }
 }
 
+/* fsync the directory of the file to persist its creation or renaming */
+int sf_fsync_parent_dir(const char *filename);
+
 #ifdef __cplusplus
 }
 #endif
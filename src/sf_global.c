@@ -43,7 +43,7 @@ SFGlobalVariables g_sf_global_vars = {
 SFContext g_sf_context = {
     NULL, 0, -1, -1, 0, 0, 1, DEFAULT_WORK_THREADS, 
     {'\0'}, {'\0'}, 0, true, true, NULL, NULL, NULL,
-    sf_task_finish_clean_up, NULL
+    sf_task_finish_clean_up, NULL, NULL
 };
 
 static inline void set_config_str_value(const char *value,
@@ -23,12 +23,16 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <limits.h>
 //#include <assert.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#ifdef OS_LINUX
+#include <sys/sendfile.h>
+#endif
 #include "fastcommon/shared_func.h"
 #include "fastcommon/sched_thread.h"
 #include "fastcommon/pthread_func.h"
@@ -627,12 +631,90 @@ int sf_client_sock_read(int sock, short event, void *arg)
     return total_read;
 }
 
+static inline ssize_t send_file_data(struct fast_task_info *task,
+        SFSendfileContext *ctx)
+{
+#ifdef OS_LINUX
+    return sendfile(task->event.fd, ctx->fd, (off_t *)&ctx->offset,
+            ctx->length < SSIZE_MAX ? ctx->length : SSIZE_MAX);
+#else
+    int bytes;
+    int sent;
+
+    /* the task buffer was sent, reuse it */
+    bytes = ctx->length < task->size ? ctx->length : task->size;
+    if ((bytes=pread(ctx->fd, task->data, bytes, ctx->offset)) <= 0) {
+        if (bytes == 0) {
+            errno = ENODATA;
+        }
+        return -1;
+    }
+    if ((sent=write(task->event.fd, task->data, bytes)) > 0) {
+        ctx->offset += sent;
+    }
+    return sent;
+#endif
+}
+
+/* send the file region after the task buffer without copying to user space
+ * return bytes sent for done, 0 for waiting for the write event,
+ *        -1 for error
+ */
+static int64_t sf_client_sock_sendfile(struct fast_task_info *task,
+        SFSendfileContext *ctx)
+{
+    ssize_t bytes;
+    int64_t total_write;
+
+    total_write = 0;
+    while (ctx->length > 0) {
+        fast_timer_modify(&task->thread_data->timer,
+            &task->event.timer, g_current_time +
+            task->network_timeout);
+
+        if ((bytes=send_file_data(task, ctx)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (set_write_event(task) != 0) {
+                    return -1;
+                }
+                return 0;
+            } else if (errno == EINTR) {  //should retry
+                continue;
+            } else {
+                logWarning("file: "__FILE__", line: %d, "
+                    "client ip: %s, sendfile fail, file offset: "
+                    "%"PRId64", remain: %"PRId64", errno: %d, "
+                    "error info: %s", __LINE__, task->client_ip,
+                    ctx->offset, ctx->length, errno, strerror(errno));
+
+                ioevent_add_to_deleted_list(task);
+                return -1;
+            }
+        } else if (bytes == 0) {
+            logWarning("file: "__FILE__", line: %d, "
+                "client ip: %s, sendfile fail, file offset: %"PRId64", "
+                "remain: %"PRId64", unexpected end of file", __LINE__,
+                task->client_ip, ctx->offset, ctx->length);
+
+            ioevent_add_to_deleted_list(task);
+            return -1;
+        }
+
+        total_write += bytes;
+        ctx->length -= bytes;
+    }
+
+    return total_write;
+}
+
 int sf_client_sock_write(int sock, short event, void *arg)
 {
     int result;
     int bytes;
     int total_write;
+    int64_t sent;
     struct fast_task_info *task;
+    SFSendfileContext *sendfile_ctx;
 
     task = (struct fast_task_info *)arg;
     if ((result=check_task(task, event, SF_NIO_STAGE_SEND)) != 0) {
@@ -650,7 +732,7 @@ int sf_client_sock_write(int sock, short event, void *arg)
     }
 
     total_write = 0;
-    while (1) {
+    while (task->offset < task->length) {
         fast_timer_modify(&task->thread_data->timer,
             &task->event.timer, g_current_time +
             task->network_timeout);
@@ -663,7 +745,7 @@ int sf_client_sock_write(int sock, short event, void *arg)
                 if (set_write_event(task) != 0) {
                     return -1;
                 }
-                break;
+                return total_write;
             } else if (errno == EINTR) {  //should retry
                 logDebug("file: "__FILE__", line: %d, "
                     "client ip: %s, ignore interupt signal",
@@ -691,15 +773,23 @@ int sf_client_sock_write(int sock, short event, void *arg)
 
         total_write += bytes;
         task->offset += bytes;
-        if (task->offset >= task->length) {
-            task->offset = 0;
-            task->length = 0;
-            if (sf_set_read_event(task) != 0) {
-                return -1;
-            }
-            break;
+    }
+
+    if (SF_CTX->get_sendfile_context != NULL && (sendfile_ctx=
+                SF_CTX->get_sendfile_context(task)) != NULL &&
+            sendfile_ctx->length > 0)
+    {
+        if ((sent=sf_client_sock_sendfile(task, sendfile_ctx)) <= 0) {
+            return sent == 0 ? total_write : -1;
         }
+        /* the file region maybe larger than 2GB */
+        total_write = FC_MIN(total_write + sent, INT_MAX);
     }
 
+    task->offset = 0;
+    task->length = 0;
+    if (sf_set_read_event(task) != 0) {
+        return -1;
+    }
     return total_write;
 }
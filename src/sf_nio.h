@@ -58,6 +58,16 @@ static inline void sf_set_remove_from_ready_list_ex(SFContext *sf_context,
 #define sf_set_remove_from_ready_list(enabled) \
     sf_set_remove_from_ready_list_ex(&g_sf_context, enabled);
 
+/* zero-copy send the file region after the task buffer */
+static inline void sf_set_sendfile_context_callback_ex(SFContext *sf_context,
+        sf_get_sendfile_context_callback get_sendfile_context)
+{
+    sf_context->get_sendfile_context = get_sendfile_context;
+}
+
+#define sf_set_sendfile_context_callback(get_sendfile_context) \
+    sf_set_sendfile_context_callback_ex(&g_sf_context, get_sendfile_context)
+
 static inline TaskCleanUpCallback sf_get_task_cleanup_func_ex(
         SFContext *sf_context)
 {
@@ -14,9 +14,681 @@
  */
 
 #include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "fastcommon/shared_func.h"
+#include "fastcommon/logger.h"
+#include "fastcommon/fast_mblock.h"
+#include "sf_global.h"
+#include "sf_func.h"
+#include "sf_binlog_frame.h"
 #include "sf_sharding_htable.h"
 
+#define OPEN_ADDRESSING_ENABLED(sharding_ctx) \
+    ((sharding_ctx->flags & SF_SHARDING_HTABLE_FLAGS_OPEN_ADDRESSING) != 0)
+
+#define OPTIMISTIC_READ_ENABLED(sharding_ctx) \
+    ((sharding_ctx->flags & SF_SHARDING_HTABLE_FLAGS_OPTIMISTIC_READ) != 0)
+
+#define DLINK_RESIZE_ENABLED(sharding_ctx) \
+    ((sharding_ctx->flags & (SF_SHARDING_HTABLE_FLAGS_RESIZABLE | \
+        SF_SHARDING_HTABLE_FLAGS_OPEN_ADDRESSING | \
+        SF_SHARDING_HTABLE_FLAGS_STRIPE_LOCK)) == \
+        SF_SHARDING_HTABLE_FLAGS_RESIZABLE)
+
+#define STRIPE_LOCK_ENABLED(sharding_ctx) \
+    ((sharding_ctx->flags & SF_SHARDING_HTABLE_FLAGS_STRIPE_LOCK) != 0)
+
+#define CONTENTION_STATS_ENABLED(sharding_ctx) \
+    ((sharding_ctx->flags & SF_SHARDING_HTABLE_FLAGS_CONTENTION_STATS) != 0)
+
+#define LEGACY_HASH_ENABLED(sharding_ctx) \
+    ((sharding_ctx->flags & SF_SHARDING_HTABLE_FLAGS_LEGACY_HASH) != 0)
+
+#define DLINK_HTABLE_MIN_CAPACITY  64
+
+/* the counters of the sharding are shared by the stripes */
+#define SHARDING_COUNTER_ADD(sharding, counter, delta) \
+    do { \
+        if (STRIPE_LOCK_ENABLED((sharding)->ctx)) { \
+            __sync_add_and_fetch(&(sharding)->counter, delta); \
+        } else { \
+            (sharding)->counter += delta; \
+        } \
+    } while (0)
+
+#define SHARDING_MEMORY_EXCEEDED(sharding) \
+    ((sharding)->memory.limit > 0 && \
+     (sharding)->memory.used > (sharding)->memory.limit)
+
+/* reclaim to the low water of the memory budget */
+#define SHARDING_MEMORY_OVER_LOW_WATER(sharding) \
+    ((sharding)->memory.limit > 0 && (sharding)->memory.used > \
+     (sharding)->memory.limit - (sharding)->memory.limit / 10)
+
+/* the table arrays replaced by the rehash, freed when the optimistic
+   readers entered before the replacement are gone */
+typedef struct sf_htable_retired_arrays {
+    void *array1;
+    void *array2;
+    int64_t epoch;  //the reader epoch after the replacement
+    struct sf_htable_retired_arrays *next;
+} SFHtableRetiredArrays;
+
+/* wait for the readers instead of keeping more retired arrays */
+#define SHARDING_MAX_RETIRED_COUNT  16
+
+/* the epoch based reclamation: the optimistic reader publishes the global
+   epoch in the slot of its thread while reading, and the arrays retired
+   at epoch E are freed when no slot holds an epoch less than E. the reader
+   writes its own cache line only, the global epoch is written when
+   retiring the arrays */
+#define READER_SLOT_COUNT  1024
+
+typedef struct {
+    volatile int64_t epoch;  //0 for quiescent
+    volatile int used;
+    int depth;  //for the nested finds of the same thread
+    char padding[64 - sizeof(int64_t) - 2 * sizeof(int)];
+} SFHtableReaderSlot;
+
+static SFHtableReaderSlot reader_slots[READER_SLOT_COUNT]
+    __attribute__((aligned(64)));
+static volatile int reader_slot_count = 0;  //the high water of the slots
+static volatile int64_t reader_epoch = 1;
+static pthread_key_t reader_slot_key;
+static pthread_once_t reader_slot_once = PTHREAD_ONCE_INIT;
+static int reader_slot_key_result = EINVAL;
+
+/* the control byte: >= 0 for the 7 bits hash of the full slot */
+#define OPEN_HTABLE_CTRL_EMPTY    ((signed char)-128)
+#define OPEN_HTABLE_CTRL_DELETED  ((signed char)-2)
+
+#define OPEN_HTABLE_GROUP_WIDTH   SF_OPEN_HTABLE_GROUP_WIDTH
+#define OPEN_HTABLE_MIN_CAPACITY  (2 * OPEN_HTABLE_GROUP_WIDTH)
+
+#define OPEN_HTABLE_H1(hash)  (BUCKET_HASH_INDEX(hash) >> 7)
+#define OPEN_HTABLE_H2(hash)  ((signed char)((hash) & 0x7F))
+
+/* the max load factor is 7/8 */
+#define OPEN_HTABLE_MAX_GROWTH(capacity)  ((capacity) - (capacity) / 8)
+
+static inline int compare_key(SFHtableShardingContext *sharding_ctx,
+        const SFTwoIdsHashKey *key1, const SFTwoIdsHashKey *key2)
+{
+    int sub;
+
+    if (sharding_ctx->key_type == sf_sharding_htable_key_ids_one) {
+        return fc_compare_int64(key1->id1, key2->id1);
+    } else {
+        if ((sub=fc_compare_int64(key1->id1, key2->id1)) != 0) {
+            return sub;
+        }
+
+        return fc_compare_int64(key1->id2, key2->id2);
+    }
+}
+
+/* the hash code is computed once, the high 32 bits for the sharding and
+   the low 32 bits for the bucket, so both the ids affect the bucket.
+   the legacy hash keeps the ids as is, the same as the old modulo while
+   the ids less than 2^32 */
+static inline uint64_t sharding_htable_hash(SFHtableShardingContext
+        *sharding_ctx, const SFTwoIdsHashKey *key)
+{
+    uint64_t h;
+
+    if (LEGACY_HASH_ENABLED(sharding_ctx)) {
+        h = key->id1;
+        if (sharding_ctx->key_type == sf_sharding_htable_key_ids_two) {
+            h += key->id2;
+        }
+        return (h << 32) | (key->id1 & 0xFFFFFFFFULL);
+    }
+
+    h = key->id1;
+    if (sharding_ctx->key_type == sf_sharding_htable_key_ids_two) {
+        h ^= key->id2 * 0x9E3779B97F4A7C15ULL;
+    }
+
+    /* the finalizer of MurmurHash3 */
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#define SHARDING_HASH_INDEX(hash)  ((hash) >> 32)
+#define BUCKET_HASH_INDEX(hash)    ((hash) & 0xFFFFFFFFULL)
+
+/* return the bit mask of the control bytes which equal to the ctrl */
+static inline uint32_t open_htable_group_match(
+        const signed char *group, const signed char ctrl)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(ctrl),
+                _mm_loadu_si128((const __m128i *)group)));
+#else
+    uint32_t mask;
+    int i;
+
+    mask = 0;
+    for (i=0; i<OPEN_HTABLE_GROUP_WIDTH; i++) {
+        if (group[i] == ctrl) {
+            mask |= (1U << i);
+        }
+    }
+    return mask;
+#endif
+}
+
+/* return the bit mask of the empty or deleted slots */
+static inline uint32_t open_htable_group_match_free(const signed char *group)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1),
+                _mm_loadu_si128((const __m128i *)group)));
+#else
+    uint32_t mask;
+    int i;
+
+    mask = 0;
+    for (i=0; i<OPEN_HTABLE_GROUP_WIDTH; i++) {
+        if (group[i] < -1) {
+            mask |= (1U << i);
+        }
+    }
+    return mask;
+#endif
+}
+
+/* the sequence lock: the writer makes the sequence odd during the change
+   and the reader retries when the sequence is odd or changed */
+static inline void stripe_write_begin(SFHtableShardingContext
+        *sharding_ctx, SFHtableStripe *stripe)
+{
+    if (OPTIMISTIC_READ_ENABLED(sharding_ctx)) {
+        __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+static inline void stripe_write_end(SFHtableShardingContext
+        *sharding_ctx, SFHtableStripe *stripe)
+{
+    if (OPTIMISTIC_READ_ENABLED(sharding_ctx)) {
+        __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static inline int64_t stripe_read_begin(SFHtableStripe *stripe)
+{
+    return __atomic_load_n(&stripe->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline bool stripe_read_retry(SFHtableStripe *stripe,
+        const int64_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) != 0 || __atomic_load_n(&stripe->seq,
+            __ATOMIC_RELAXED) != seq;
+}
+
+static inline void stripe_lock(SFHtableShardingContext *sharding_ctx,
+        SFHtableStripe *stripe)
+{
+    int64_t start_us;
+
+    if (!CONTENTION_STATS_ENABLED(sharding_ctx)) {
+        PTHREAD_MUTEX_LOCK(&stripe->lock);
+        return;
+    }
+
+    if (pthread_mutex_trylock(&stripe->lock) == 0) {
+        stripe->stats.lock_count++;
+        return;
+    }
+
+    start_us = get_current_time_us();
+    PTHREAD_MUTEX_LOCK(&stripe->lock);
+    stripe->stats.lock_count++;
+    stripe->stats.wait_count++;
+    stripe->stats.wait_time_us += get_current_time_us() - start_us;
+}
+
+static inline int64_t open_htable_round_capacity(const int64_t count)
+{
+    int64_t capacity;
+
+    capacity = OPEN_HTABLE_MIN_CAPACITY;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static int open_htable_init(SFOpenHashtable *table, const int64_t capacity)
+{
+    table->ctrls = (signed char *)fc_malloc(capacity +
+            OPEN_HTABLE_GROUP_WIDTH);
+    if (table->ctrls == NULL) {
+        return ENOMEM;
+    }
+    table->slots = (SFShardingHashEntry **)fc_malloc(
+            sizeof(SFShardingHashEntry *) * capacity);
+    if (table->slots == NULL) {
+        free(table->ctrls);
+        table->ctrls = NULL;
+        return ENOMEM;
+    }
+
+    memset(table->ctrls, OPEN_HTABLE_CTRL_EMPTY,
+            capacity + OPEN_HTABLE_GROUP_WIDTH);
+    /* the optimistic reader maybe see the slot before the control byte */
+    memset(table->slots, 0, sizeof(SFShardingHashEntry *) * capacity);
+    table->capacity = capacity;
+    table->size = 0;
+    table->growth_left = OPEN_HTABLE_MAX_GROWTH(capacity);
+    return 0;
+}
+
+static inline void open_htable_set_ctrl(SFOpenHashtable *table,
+        const int64_t index, const signed char ctrl)
+{
+    table->ctrls[index] = ctrl;
+    /* the mirror for the group reading across the end */
+    table->ctrls[((index - OPEN_HTABLE_GROUP_WIDTH) & (table->capacity - 1))
+        + OPEN_HTABLE_GROUP_WIDTH] = ctrl;
+}
+
+/* the triangular probing visits all groups of the power of 2 capacity */
+#define OPEN_HTABLE_PROBE_NEXT(table, pos, step) \
+    do { \
+        step += OPEN_HTABLE_GROUP_WIDTH;  \
+        pos = (pos + step) & (table->capacity - 1); \
+    } while (0)
+
+static inline SFShardingHashEntry *open_htable_find(
+        SFHtableShardingContext *sharding_ctx, SFOpenHashtable *table,
+        const SFTwoIdsHashKey *key, const uint64_t hash, int *steps)
+{
+    const signed char *group;
+    SFShardingHashEntry *entry;
+    uint32_t bits;
+    int64_t pos;
+    int64_t step;
+
+    pos = OPEN_HTABLE_H1(hash) & (table->capacity - 1);
+    step = 0;
+    while (1) {
+        ++(*steps);
+        group = table->ctrls + pos;
+        bits = open_htable_group_match(group, OPEN_HTABLE_H2(hash));
+        while (bits != 0) {
+            entry = table->slots[(pos + __builtin_ctz(bits)) &
+                (table->capacity - 1)];
+            if (compare_key(sharding_ctx, key, &entry->key) == 0) {
+                return entry;
+            }
+            bits &= bits - 1;
+        }
+
+        if (open_htable_group_match(group, OPEN_HTABLE_CTRL_EMPTY) != 0) {
+            return NULL;
+        }
+        OPEN_HTABLE_PROBE_NEXT(table, pos, step);
+    }
+}
+
+/* for the optimistic read on the table snapshot, the probing is bounded
+   and *torn is set when the table is changed during the probing */
+static inline SFShardingHashEntry *open_htable_find_optimistic(
+        SFHtableShardingContext *sharding_ctx, const SFOpenHashtable *table,
+        const SFTwoIdsHashKey *key, const uint64_t hash, bool *torn)
+{
+    const signed char *group;
+    SFShardingHashEntry *entry;
+    uint32_t bits;
+    int64_t pos;
+    int64_t step;
+
+    pos = OPEN_HTABLE_H1(hash) & (table->capacity - 1);
+    step = 0;
+    while (step < table->capacity) {
+        group = table->ctrls + pos;
+        bits = open_htable_group_match(group, OPEN_HTABLE_H2(hash));
+        while (bits != 0) {
+            entry = table->slots[(pos + __builtin_ctz(bits)) &
+                (table->capacity - 1)];
+            if (entry != NULL && compare_key(sharding_ctx,
+                        key, &entry->key) == 0)
+            {
+                return entry;
+            }
+            bits &= bits - 1;
+        }
+
+        if (open_htable_group_match(group, OPEN_HTABLE_CTRL_EMPTY) != 0) {
+            return NULL;
+        }
+        OPEN_HTABLE_PROBE_NEXT(table, pos, step);
+    }
+
+    *torn = true;
+    return NULL;
+}
+
+/* return the index of the first empty or deleted slot */
+static inline int64_t open_htable_find_free(SFOpenHashtable *table,
+        const uint64_t hash)
+{
+    uint32_t bits;
+    int64_t pos;
+    int64_t step;
+
+    pos = OPEN_HTABLE_H1(hash) & (table->capacity - 1);
+    step = 0;
+    while ((bits=open_htable_group_match_free(table->ctrls + pos)) == 0) {
+        OPEN_HTABLE_PROBE_NEXT(table, pos, step);
+    }
+    return (pos + __builtin_ctz(bits)) & (table->capacity - 1);
+}
+
+static inline void open_htable_put(SFOpenHashtable *table,
+        SFShardingHashEntry *entry, const uint64_t hash)
+{
+    int64_t index;
+
+    index = open_htable_find_free(table, hash);
+    if (table->ctrls[index] == OPEN_HTABLE_CTRL_EMPTY) {
+        table->growth_left--;
+    }
+    table->slots[index] = entry;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    open_htable_set_ctrl(table, index, OPEN_HTABLE_H2(hash));
+    table->size++;
+}
+
+/* the table arrays are replaced by the rehash */
+#define TABLE_REPLACEABLE(sharding_ctx) \
+    (OPEN_ADDRESSING_ENABLED(sharding_ctx) || \
+     DLINK_RESIZE_ENABLED(sharding_ctx))
+
+static void reader_slot_release(void *arg)
+{
+    SFHtableReaderSlot *slot;
+
+    slot = (SFHtableReaderSlot *)arg;
+    slot->depth = 0;
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+}
+
+static void reader_slot_key_init()
+{
+    reader_slot_key_result = pthread_key_create(
+            &reader_slot_key, reader_slot_release);
+}
+
+/* the slot is released when the thread exits,
+   return NULL when the slots are used up */
+static SFHtableReaderSlot *reader_slot_alloc()
+{
+    SFHtableReaderSlot *slot;
+    int count;
+    int i;
+
+    for (i=0; i<READER_SLOT_COUNT; i++) {
+        slot = reader_slots + i;
+        if (slot->used == 0 && __sync_bool_compare_and_swap(
+                    &slot->used, 0, 1))
+        {
+            break;
+        }
+    }
+    if (i == READER_SLOT_COUNT) {
+        logWarning("file: "__FILE__", line: %d, "
+                "the %d reader slots are used up, the optimistic "
+                "read falls back to the lock", __LINE__, READER_SLOT_COUNT);
+        return NULL;
+    }
+
+    while ((count=reader_slot_count) <= i) {
+        __sync_bool_compare_and_swap(&reader_slot_count, count, i + 1);
+    }
+    slot->depth = 0;
+    if (pthread_setspecific(reader_slot_key, slot) != 0) {
+        reader_slot_release(slot);
+        return NULL;
+    }
+    return slot;
+}
+
+/* the optimistic reader publishes the epoch before loading the table,
+   the slot key is created by sf_sharding_htable_init_ex,
+   slot is NULL when the table is never replaced
+   return false for falling back to the lock */
+static inline bool sharding_reader_enter(SFHtableShardingContext
+        *sharding_ctx, SFHtableReaderSlot **slot)
+{
+    if (!TABLE_REPLACEABLE(sharding_ctx)) {
+        *slot = NULL;
+        return true;
+    }
+
+    if ((*slot=(SFHtableReaderSlot *)pthread_getspecific(
+                    reader_slot_key)) == NULL)
+    {
+        if ((*slot=reader_slot_alloc()) == NULL) {
+            return false;
+        }
+    }
+
+    if ((*slot)->depth++ == 0) {
+        (*slot)->epoch = reader_epoch;
+        __sync_synchronize();  //the store before the table loading
+    }
+    return true;
+}
+
+static inline void sharding_reader_leave(SFHtableReaderSlot *slot)
+{
+    if (slot != NULL && --slot->depth == 0) {
+        __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/* the min epoch of the readers, INT64_MAX for no reader */
+static int64_t reader_min_epoch()
+{
+    SFHtableReaderSlot *slot;
+    SFHtableReaderSlot *end;
+    int64_t min_epoch;
+    int64_t epoch;
+
+    __sync_synchronize();  //the table replacement before the slot loading
+    min_epoch = INT64_MAX;
+    end = reader_slots + reader_slot_count;
+    for (slot=reader_slots; slot<end; slot++) {
+        epoch = slot->epoch;
+        if (epoch != 0 && epoch < min_epoch) {
+            min_epoch = epoch;
+        }
+    }
+    return min_epoch;
+}
+
+/* the caller MUST hold the lock */
+static void sharding_free_retired(SFHtableSharding *sharding)
+{
+    SFHtableRetiredArrays **pp;
+    SFHtableRetiredArrays *retired;
+    int64_t min_epoch;
+
+    min_epoch = reader_min_epoch();
+    pp = &sharding->retired;
+    while (*pp != NULL) {
+        retired = *pp;
+        if (retired->epoch <= min_epoch) {
+            *pp = retired->next;
+            free(retired->array1);
+            free(retired->array2);
+            free(retired);
+            sharding->retired_count--;
+        } else {
+            pp = &retired->next;
+        }
+    }
+}
+
+static inline void sharding_check_free_retired(SFHtableSharding *sharding)
+{
+    if (sharding->retired != NULL) {
+        sharding_free_retired(sharding);
+    }
+}
+
+/* the caller MUST hold the lock and the table arrays MUST be replaced
+   before calling. only the readers entered before the replacement can
+   reach the retired arrays, and they never wait for the lock, so the
+   waiting is bounded when out of memory or too many arrays retired */
+static void sharding_retire_arrays(SFHtableSharding *sharding,
+        void *array1, void *array2)
+{
+    SFHtableRetiredArrays *retired;
+    int64_t epoch;
+
+    if (!OPTIMISTIC_READ_ENABLED(sharding->ctx)) {
+        free(array1);
+        free(array2);
+        return;
+    }
+
+    /* the full barrier publishes the replacement before the epoch */
+    epoch = __sync_add_and_fetch(&reader_epoch, 1);
+    if (sharding->retired_count < SHARDING_MAX_RETIRED_COUNT) {
+        retired = (SFHtableRetiredArrays *)fc_malloc(
+                sizeof(SFHtableRetiredArrays));
+    } else {
+        retired = NULL;
+    }
+
+    if (retired == NULL) {
+        while (reader_min_epoch() < epoch) {
+            sched_yield();
+        }
+        free(array1);
+        free(array2);
+    } else {
+        retired->array1 = array1;
+        retired->array2 = array2;
+        retired->epoch = epoch;
+        retired->next = sharding->retired;
+        sharding->retired = retired;
+        sharding->retired_count++;
+    }
+    sharding_free_retired(sharding);
+}
+
+/* grow when the table is more than 7/16 full,
+   otherwise rebuild in place to drop the deleted slots */
+static int open_htable_rehash(SFHtableSharding *sharding)
+{
+    SFHtableShardingContext *sharding_ctx;
+    SFOpenHashtable *table;
+    SFOpenHashtable new_table;
+    SFOpenHashtable old_table;
+    int64_t capacity;
+    int64_t index;
+    int result;
+
+    sharding_ctx = sharding->ctx;
+    table = &sharding->otable;
+    if (table->size * 16 > table->capacity * 7) {
+        capacity = table->capacity * 2;
+    } else {
+        capacity = table->capacity;
+    }
+    if ((result=open_htable_init(&new_table, capacity)) != 0) {
+        return result;
+    }
+
+    for (index=0; index<table->capacity; index++) {
+        if (table->ctrls[index] >= 0) {
+            open_htable_put(&new_table, table->slots[index],
+                    sharding_htable_hash(sharding_ctx,
+                        &table->slots[index]->key));
+        }
+    }
+
+    old_table = *table;
+    *table = new_table;
+    sharding_retire_arrays(sharding, old_table.ctrls, old_table.slots);
+    return 0;
+}
+
+static inline int open_htable_insert(SFHtableSharding *sharding,
+        SFShardingHashEntry *entry, const uint64_t hash)
+{
+    SFOpenHashtable *table;
+    int result;
+    int64_t index;
+
+    sharding_check_free_retired(sharding);
+    table = &sharding->otable;
+    index = open_htable_find_free(table, hash);
+    if (table->ctrls[index] == OPEN_HTABLE_CTRL_EMPTY &&
+            table->growth_left == 0)
+    {
+        if ((result=open_htable_rehash(sharding)) != 0) {
+            return result;
+        }
+    }
+
+    open_htable_put(table, entry, hash);
+    return 0;
+}
+
+static inline void open_htable_remove(SFOpenHashtable *table,
+        SFShardingHashEntry *entry, const uint64_t hash)
+{
+    uint32_t bits;
+    int64_t index;
+    int64_t pos;
+    int64_t step;
+
+    pos = OPEN_HTABLE_H1(hash) & (table->capacity - 1);
+    step = 0;
+    while (1) {
+        bits = open_htable_group_match(table->ctrls + pos,
+                OPEN_HTABLE_H2(hash));
+        while (bits != 0) {
+            index = (pos + __builtin_ctz(bits)) & (table->capacity - 1);
+            if (table->slots[index] == entry) {
+                open_htable_set_ctrl(table, index, OPEN_HTABLE_CTRL_DELETED);
+                table->size--;
+                return;
+            }
+            bits &= bits - 1;
+        }
+
+        if (open_htable_group_match(table->ctrls + pos,
+                    OPEN_HTABLE_CTRL_EMPTY) != 0)
+        {
+            return;
+        }
+        OPEN_HTABLE_PROBE_NEXT(table, pos, step);
+    }
+}
+
 static int init_allocators(SFHtableShardingContext *sharding_ctx,
         const int allocator_count, const int element_size,
         const int64_t element_limit)
@@ -54,319 +726,2079 @@ static int init_allocators(SFHtableShardingContext *sharding_ctx,
     return 0;
 }
 
-static int init_sharding(SFHtableSharding *sharding,
-        const int64_t per_capacity)
+static int dlink_htable_init(SFDlinkHashtable *table,
+        const int64_t capacity)
+{
+    struct fc_list_head *ph;
+    struct fc_list_head *end;
+
+    table->buckets = (struct fc_list_head *)fc_malloc(
+            sizeof(struct fc_list_head) * capacity);
+    if (table->buckets == NULL) {
+        return ENOMEM;
+    }
+    end = table->buckets + capacity;
+    for (ph=table->buckets; ph<end; ph++) {
+        FC_INIT_LIST_HEAD(ph);
+    }
+
+    table->capacity = capacity;
+    return 0;
+}
+
+static int init_stripes(SFHtableSharding *sharding)
+{
+    int result;
+    SFHtableStripe *stripe;
+    SFHtableStripe *end;
+
+    if (sharding->ctx->stripe_count == 1) {
+        sharding->stripes = &sharding->stripe;
+    } else {
+        /* the stripe of the sharding is inited but not used */
+        if ((result=init_pthread_lock(&sharding->lock)) != 0) {
+            return result;
+        }
+        sharding->seq = 0;
+        FC_INIT_LIST_HEAD(&sharding->lru);
+        memset(&sharding->stripe.stats, 0, sizeof(sharding->stripe.stats));
+
+        sharding->stripes = (SFHtableStripe *)fc_malloc(
+                sizeof(SFHtableStripe) * sharding->ctx->stripe_count);
+        if (sharding->stripes == NULL) {
+            return ENOMEM;
+        }
+    }
+
+    end = sharding->stripes + sharding->ctx->stripe_count;
+    for (stripe=sharding->stripes; stripe<end; stripe++) {
+        if ((result=init_pthread_lock(&stripe->lock)) != 0) {
+            return result;
+        }
+        stripe->seq = 0;
+        FC_INIT_LIST_HEAD(&stripe->lru);
+        memset(&stripe->stats, 0, sizeof(stripe->stats));
+    }
+
+    return 0;
+}
+
+static int init_sharding(SFHtableSharding *sharding,
+        const int64_t per_capacity)
+{
+    int result;
+
+    if ((result=init_stripes(sharding)) != 0) {
+        return result;
+    }
+
+    sharding->retired = NULL;
+    sharding->retired_count = 0;
+    sharding->element_count = 0;
+    sharding->memory.used = 0;
+    sharding->memory.limit = 0;
+    sharding->last_reclaim_time_sec = get_current_time();
+    sharding->rehash.old.buckets = NULL;
+    sharding->rehash.old.capacity = 0;
+    sharding->rehash.index = 0;
+    if (OPEN_ADDRESSING_ENABLED(sharding->ctx)) {
+        sharding->hashtable.buckets = NULL;
+        sharding->hashtable.capacity = 0;
+        return open_htable_init(&sharding->otable, per_capacity);
+    }
+
+    return dlink_htable_init(&sharding->hashtable, per_capacity);
+}
+
+static int init_sharding_array(SFHtableShardingContext *sharding_ctx,
+        const int sharding_count, const int64_t per_elt_limit,
+        const int64_t per_capacity)
+{
+    int result;
+    int bytes;
+    SFHtableSharding *ps;
+    SFHtableSharding *end;
+
+    bytes = sizeof(SFHtableSharding) * sharding_count;
+    sharding_ctx->sharding_array.entries = (SFHtableSharding *)fc_malloc(bytes);
+    if (sharding_ctx->sharding_array.entries == NULL) {
+        return ENOMEM;
+    }
+
+    end = sharding_ctx->sharding_array.entries + sharding_count;
+    for (ps=sharding_ctx->sharding_array.entries; ps<end; ps++) {
+        ps->allocator = sharding_ctx->allocators.elts +
+            (ps - sharding_ctx->sharding_array.entries) %
+            sharding_ctx->allocators.count;
+        ps->element_limit = per_elt_limit;
+        ps->ctx = sharding_ctx;
+        if ((result=init_sharding(ps, per_capacity)) != 0) {
+            return result;
+        }
+    }
+
+    sharding_ctx->sharding_array.count = sharding_count;
+    return 0;
+}
+
+int sf_sharding_htable_init_ex(SFHtableShardingContext *sharding_ctx,
+        const SFShardingHtableKeyType key_type,
+        sf_sharding_htable_insert_callback insert_callback,
+        sf_sharding_htable_find_callback find_callback,
+        sf_sharding_htable_accept_reclaim_callback reclaim_callback,
+        const int sharding_count, const int64_t htable_capacity,
+        const int allocator_count, const int element_size,
+        int64_t element_limit, const int64_t min_ttl_sec,
+        const int64_t max_ttl_sec, const int flags)
+{
+    int result;
+    int64_t per_elt_limit;
+    int64_t per_capacity;
+
+    if ((flags & SF_SHARDING_HTABLE_FLAGS_STRIPE_LOCK) != 0 &&
+            (flags & SF_SHARDING_HTABLE_FLAGS_OPEN_ADDRESSING) != 0)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "the stripe lock is not supported by the open addressing",
+                __LINE__);
+        return EINVAL;
+    }
+    if ((flags & SF_SHARDING_HTABLE_FLAGS_OPTIMISTIC_READ) != 0) {
+        pthread_once(&reader_slot_once, reader_slot_key_init);
+        if (reader_slot_key_result != 0) {
+            logError("file: "__FILE__", line: %d, "
+                    "create the reader slot key fail, "
+                    "errno: %d, error info: %s", __LINE__,
+                    reader_slot_key_result,
+                    STRERROR(reader_slot_key_result));
+            return reader_slot_key_result;
+        }
+    }
+    if ((flags & SF_SHARDING_HTABLE_FLAGS_LEGACY_HASH) != 0 &&
+            (flags & SF_SHARDING_HTABLE_FLAGS_OPEN_ADDRESSING) != 0)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "the legacy hash is not supported by the open addressing",
+                __LINE__);
+        return EINVAL;
+    }
+
+    if (element_limit <= 0) {
+        element_limit = 1000 * 1000;
+    }
+    if ((result=init_allocators(sharding_ctx, allocator_count,
+                    element_size, element_limit)) != 0)
+    {
+        return result;
+    }
+
+    sharding_ctx->key_type = key_type;
+    sharding_ctx->flags = flags;
+    sharding_ctx->stripe_count = STRIPE_LOCK_ENABLED(sharding_ctx) ?
+        SF_SHARDING_HTABLE_STRIPE_COUNT : 1;
+    sharding_ctx->element_size = element_size;
+    sharding_ctx->charge_callback = NULL;
+    per_elt_limit = (element_limit + sharding_count - 1) / sharding_count;
+    if (OPEN_ADDRESSING_ENABLED(sharding_ctx)) {
+        per_capacity = open_htable_round_capacity(
+                htable_capacity / sharding_count);
+    } else {
+        per_capacity = fc_ceil_prime(htable_capacity / sharding_count);
+        if (STRIPE_LOCK_ENABLED(sharding_ctx)) {  //the multiple of stripes
+            per_capacity = (per_capacity + sharding_ctx->stripe_count - 1) /
+                sharding_ctx->stripe_count * sharding_ctx->stripe_count;
+        }
+    }
+    if ((result=init_sharding_array(sharding_ctx, sharding_count,
+                    per_elt_limit, per_capacity)) != 0)
+    {
+        return result;
+    }
+
+    sharding_ctx->reclaim_thread.running = false;
+    sharding_ctx->reclaim_thread.continue_flag = false;
+    sharding_ctx->insert_callback = insert_callback;
+    sharding_ctx->find_callback = find_callback;
+    sharding_ctx->accept_reclaim_callback = reclaim_callback;
+    sharding_ctx->sharding_reclaim.elt_water_mark = per_elt_limit * 0.10;
+    sharding_ctx->sharding_reclaim.min_ttl_sec = min_ttl_sec;
+    sharding_ctx->sharding_reclaim.max_ttl_sec = max_ttl_sec;
+    sharding_ctx->sharding_reclaim.elt_ttl_sec = (double)(sharding_ctx->
+            sharding_reclaim.max_ttl_sec - sharding_ctx->
+            sharding_reclaim.min_ttl_sec) / per_elt_limit;
+
+    /*
+    logInfo("per_elt_limit: %"PRId64", elt_water_mark: %d, "
+            "elt_ttl_sec: %.2f", per_elt_limit, (int)sharding_ctx->
+            sharding_reclaim.elt_water_mark, sharding_ctx->
+            sharding_reclaim.elt_ttl_sec);
+            */
+    return 0;
+}
+
+int sf_sharding_htable_init(SFHtableShardingContext *sharding_ctx,
+        const SFShardingHtableKeyType key_type,
+        sf_sharding_htable_insert_callback insert_callback,
+        sf_sharding_htable_find_callback find_callback,
+        sf_sharding_htable_accept_reclaim_callback reclaim_callback,
+        const int sharding_count, const int64_t htable_capacity,
+        const int allocator_count, const int element_size,
+        int64_t element_limit, const int64_t min_ttl_sec,
+        const int64_t max_ttl_sec)
+{
+    return sf_sharding_htable_init_ex(sharding_ctx, key_type,
+            insert_callback, find_callback, reclaim_callback,
+            sharding_count, htable_capacity, allocator_count,
+            element_size, element_limit, min_ttl_sec, max_ttl_sec, 0);
+}
+
+static inline SFShardingHashEntry *dlink_htable_find(
+        SFHtableShardingContext *sharding_ctx, const SFTwoIdsHashKey *key,
+        struct fc_list_head *bucket, int *steps)
+{
+    int r;
+    SFShardingHashEntry *current;
+
+    fc_list_for_each_entry(current, bucket, dlinks.htable) {
+        ++(*steps);
+        r = compare_key(sharding_ctx, key, &current->key);
+        if (r < 0) {
+            return NULL;
+        } else if (r == 0) {
+            return current;
+        }
+    }
+
+    return NULL;
+}
+
+static inline void dlink_htable_insert(SFHtableShardingContext *sharding_ctx,
+        SFShardingHashEntry *entry, struct fc_list_head *bucket)
+{
+    struct fc_list_head *previous;
+    struct fc_list_head *current;
+    SFShardingHashEntry *pe;
+
+    previous = bucket;
+    fc_list_for_each(current, bucket) {
+        pe = fc_list_entry(current, SFShardingHashEntry, dlinks.htable);
+        if (compare_key(sharding_ctx, &entry->key, &pe->key) < 0) {
+            break;
+        }
+
+        previous = current;
+    }
+
+    fc_list_add_internal(&entry->dlinks.htable, previous, previous->next);
+}
+
+/* the chain maybe changed by the writer, even be a loop because the
+   removed entry points to itself, so the walking steps are bounded */
+static inline SFShardingHashEntry *dlink_htable_find_optimistic(
+        SFHtableShardingContext *sharding_ctx, const SFTwoIdsHashKey *key,
+        struct fc_list_head *bucket, int64_t max_steps, bool *torn)
+{
+    int r;
+    struct fc_list_head *node;
+    SFShardingHashEntry *current;
+
+    for (node=bucket->next; node!=bucket; node=node->next) {
+        if (--max_steps < 0) {
+            *torn = true;
+            return NULL;
+        }
+
+        current = fc_list_entry(node, SFShardingHashEntry, dlinks.htable);
+        r = compare_key(sharding_ctx, key, &current->key);
+        if (r < 0) {
+            return NULL;
+        } else if (r == 0) {
+            return current;
+        }
+    }
+
+    return NULL;
+}
+
+#define DLINK_HTABLE_BUCKET_INDEX(table, hash_code) \
+    (BUCKET_HASH_INDEX(hash_code) % (table)->capacity)
+
+#define DLINK_HTABLE_BUCKET(table, hash_code) \
+    ((table)->buckets + DLINK_HTABLE_BUCKET_INDEX(table, hash_code))
+
+/* return the bucket of the old table which is not migrated yet,
+   NULL for not rehashing or migrated */
+static inline struct fc_list_head *dlink_htable_old_bucket(
+        const SFDlinkHashtable *old, const int64_t migrate_index,
+        const uint64_t hash_code)
+{
+    int64_t index;
+
+    if (old->buckets == NULL) {
+        return NULL;
+    }
+    index = DLINK_HTABLE_BUCKET_INDEX(old, hash_code);
+    return index >= migrate_index ? old->buckets + index : NULL;
+}
+
+/* the caller MUST hold the stripe lock */
+static inline SFShardingHashEntry *htable_find(
+        SFHtableShardingContext *sharding_ctx, SFHtableSharding *sharding,
+        SFHtableStripe *stripe, const SFTwoIdsHashKey *key,
+        const uint64_t hash_code)
+{
+    SFShardingHashEntry *entry;
+    struct fc_list_head *old_bucket;
+    int steps;
+
+    steps = 0;
+    if (OPEN_ADDRESSING_ENABLED(sharding_ctx)) {
+        entry = open_htable_find(sharding_ctx, &sharding->otable,
+                key, hash_code, &steps);
+    } else {
+        entry = dlink_htable_find(sharding_ctx, key, DLINK_HTABLE_BUCKET(
+                    &sharding->hashtable, hash_code), &steps);
+        if (entry == NULL && (old_bucket=dlink_htable_old_bucket(
+                        &sharding->rehash.old, sharding->rehash.index,
+                        hash_code)) != NULL)
+        {
+            entry = dlink_htable_find(sharding_ctx, key,
+                    old_bucket, &steps);
+        }
+    }
+
+    if (CONTENTION_STATS_ENABLED(sharding_ctx)) {
+        stripe->stats.lookup_count++;
+        stripe->stats.lookup_steps += steps;
+    }
+    return entry;
+}
+
+static inline int htable_insert(SFHtableShardingContext *sharding_ctx,
+        SFHtableSharding *sharding, SFShardingHashEntry *entry,
+        const uint64_t hash_code)
+{
+    if (OPEN_ADDRESSING_ENABLED(sharding_ctx)) {
+        return open_htable_insert(sharding, entry, hash_code);
+    } else {
+        dlink_htable_insert(sharding_ctx, entry, DLINK_HTABLE_BUCKET(
+                    &sharding->hashtable, hash_code));
+        return 0;
+    }
+}
+
+static inline void htable_remove(SFHtableSharding *sharding,
+        SFShardingHashEntry *entry)
+{
+    if (OPEN_ADDRESSING_ENABLED(sharding->ctx)) {
+        open_htable_remove(&sharding->otable, entry,
+                sharding_htable_hash(sharding->ctx, &entry->key));
+    } else {
+        fc_list_del_init(&entry->dlinks.htable);
+    }
+}
+
+/* migrate some buckets of the old table to the new table */
+static void dlink_htable_migrate(SFHtableSharding *sharding)
+{
+    SFDlinkHashtable *old;
+    struct fc_list_head *bucket;
+    SFShardingHashEntry *entry;
+    int64_t end;
+
+    old = &sharding->rehash.old;
+    end = FC_MIN(sharding->rehash.index + SF_SHARDING_HTABLE_REHASH_STEP,
+            old->capacity);
+    while (sharding->rehash.index < end) {
+        bucket = old->buckets + sharding->rehash.index++;
+        while (!fc_list_empty(bucket)) {
+            entry = fc_list_entry(bucket->next,
+                    SFShardingHashEntry, dlinks.htable);
+            fc_list_del_init(&entry->dlinks.htable);
+            dlink_htable_insert(sharding->ctx, entry, DLINK_HTABLE_BUCKET(
+                        &sharding->hashtable, sharding_htable_hash(
+                            sharding->ctx, &entry->key)));
+        }
+    }
+
+    if (sharding->rehash.index == old->capacity) {
+        bucket = old->buckets;
+        old->buckets = NULL;
+        old->capacity = 0;
+        sharding_retire_arrays(sharding, bucket, NULL);
+    }
+}
+
+/* called by the write operations with the lock and the write sequence */
+static void dlink_htable_check_resize(SFHtableSharding *sharding)
+{
+    SFDlinkHashtable table;
+    int64_t capacity;
+
+    sharding_check_free_retired(sharding);
+    if (sharding->rehash.old.buckets != NULL) {
+        dlink_htable_migrate(sharding);
+        return;
+    }
+
+    if (sharding->element_count > sharding->hashtable.capacity) {
+        capacity = fc_ceil_prime(sharding->hashtable.capacity * 2);
+    } else if (sharding->element_count < sharding->hashtable.capacity / 8
+            && sharding->hashtable.capacity > DLINK_HTABLE_MIN_CAPACITY)
+    {
+        capacity = fc_ceil_prime(FC_MAX(sharding->hashtable.capacity / 2,
+                    DLINK_HTABLE_MIN_CAPACITY));
+    } else {
+        return;
+    }
+
+    if (dlink_htable_init(&table, capacity) != 0) {
+        return;  //keep the current table
+    }
+    sharding->rehash.old = sharding->hashtable;
+    sharding->rehash.index = 0;
+    sharding->hashtable = table;
+    dlink_htable_migrate(sharding);
+}
+
+/* scan from the head of the LRU chain of the stripe, the referenced entry
+   is moved to the tail with the reference bit cleared as the second chance
+   first: keep the first reclaimed entry for reuse, NULL for free all
+   return the reclaimed count */
+static int64_t otid_entry_reclaim(SFHtableSharding *sharding,
+        SFHtableStripe *stripe, SFShardingHashEntry **first)
+{
+    int64_t reclaim_ttl_sec;
+    int64_t delta;
+    int64_t reclaim_count;
+    int64_t reclaim_limit;
+    int64_t scan_limit;
+    SFShardingHashEntry *entry;
+    SFShardingHashEntry *tmp;
+
+    if (sharding->element_count <= sharding->element_limit) {
+        delta = sharding->element_count;
+        reclaim_limit = sharding->ctx->sharding_reclaim.elt_water_mark;
+    } else {
+        delta = sharding->element_limit;
+        reclaim_limit = (sharding->element_count - sharding->element_limit) +
+            sharding->ctx->sharding_reclaim.elt_water_mark;
+    }
+    if (sharding->ctx->stripe_count > 1) {  //the share of the stripe
+        reclaim_limit = reclaim_limit / sharding->ctx->stripe_count + 1;
+    }
+
+    reclaim_count = 0;
+    scan_limit = sharding->element_count;
+    reclaim_ttl_sec = (int64_t)(sharding->ctx->sharding_reclaim.max_ttl_sec -
+            sharding->ctx->sharding_reclaim.elt_ttl_sec * delta);
+    fc_list_for_each_entry_safe(entry, tmp, &stripe->lru, dlinks.lru) {
+        if (--scan_limit < 0) {
+            break;
+        }
+
+        if (entry->referenced) {
+            entry->referenced = false;
+            fc_list_move_tail(&entry->dlinks.lru, &stripe->lru);
+            continue;
+        }
+
+        if (!SHARDING_MEMORY_OVER_LOW_WATER(sharding) &&
+                get_current_time() - entry->last_update_time_sec <=
+                reclaim_ttl_sec)
+        {
+            break;
+        }
+
+        if (sharding->ctx->accept_reclaim_callback != NULL &&
+                !sharding->ctx->accept_reclaim_callback(entry))
+        {
+            continue;
+        }
+
+        htable_remove(sharding, entry);
+        fc_list_del_init(&entry->dlinks.lru);
+        SHARDING_COUNTER_ADD(sharding, memory.used, -entry->charge);
+        entry->charge = 0;
+        if (first != NULL && *first == NULL) {
+            *first = entry;  //keep the first
+        } else {
+            fast_mblock_free_object(sharding->allocator, entry);
+            SHARDING_COUNTER_ADD(sharding, element_count, -1);
+        }
+
+        if (++reclaim_count > reclaim_limit &&
+                !SHARDING_MEMORY_OVER_LOW_WATER(sharding))
+        {
+            break;
+        }
+    }
+
+    if (reclaim_count > 0 && first != NULL) {
+        logInfo("sharding index: %d, element_count: %"PRId64", "
+                "reclaim_ttl_sec: %"PRId64" ms, reclaim_count: %"PRId64", "
+                "reclaim_limit: %"PRId64, (int)(sharding - sharding->ctx->
+                    sharding_array.entries), sharding->element_count,
+                reclaim_ttl_sec, reclaim_count, reclaim_limit);
+    }
+
+    return reclaim_count;
+}
+
+static inline SFShardingHashEntry *htable_entry_alloc(
+        SFHtableSharding *sharding, SFHtableStripe *stripe)
+{
+    SFShardingHashEntry *entry;
+    bool need_reclaim;
+
+    if (sharding->ctx->reclaim_thread.running) {
+        need_reclaim = sharding->element_count > sharding->element_limit;
+    } else {
+        need_reclaim = (sharding->element_count > sharding->ctx->
+            sharding_reclaim.elt_water_mark && get_current_time() -
+            sharding->last_reclaim_time_sec > 1000) ||
+            SHARDING_MEMORY_EXCEEDED(sharding);
+    }
+
+    if (need_reclaim) {
+        sharding->last_reclaim_time_sec = get_current_time();
+        entry = NULL;
+        otid_entry_reclaim(sharding, stripe, &entry);
+        if (entry != NULL) {
+            return entry;
+        }
+    }
+
+    entry = (SFShardingHashEntry *)fast_mblock_alloc_object(
+            sharding->allocator);
+    if (entry != NULL) {
+        SHARDING_COUNTER_ADD(sharding, element_count, 1);
+        entry->sharding = sharding;
+        entry->charge = 0;
+    }
+
+    return entry;
+}
+
+#define SHARDING_HTABLE_GET_SHARDING(sharding_ctx, hash_code) \
+    ((sharding_ctx)->sharding_array.entries + SHARDING_HASH_INDEX( \
+        hash_code) % (sharding_ctx)->sharding_array.count)
+
+/* the same as the stripe of the bucket because the bucket count is
+   the multiple of the stripe count */
+#define SHARDING_HTABLE_GET_STRIPE(sharding_ctx, sharding, hash_code) \
+    ((sharding)->stripes + ((sharding_ctx)->stripe_count == 1 ? 0 : \
+        BUCKET_HASH_INDEX(hash_code) % (sharding_ctx)->stripe_count))
+
+#define SET_SHARDING_AND_HASH_CODE(sharding_ctx, key) \
+    SFHtableSharding *sharding; \
+    SFHtableStripe *stripe; \
+    uint64_t hash_code;    \
+    \
+    hash_code = sharding_htable_hash(sharding_ctx, key); \
+    sharding = SHARDING_HTABLE_GET_SHARDING(sharding_ctx, hash_code); \
+    stripe = SHARDING_HTABLE_GET_STRIPE(sharding_ctx, sharding, hash_code)
+
+/* find without the lock, the entry memory from the mblock is never
+   returned to the system, so reading the stale entry is safe
+   return 0 for success, EAGAIN for the validation fail */
+static inline int optimistic_find(SFHtableShardingContext *sharding_ctx,
+        SFHtableSharding *sharding, SFHtableStripe *stripe,
+        const SFTwoIdsHashKey *key, const uint64_t hash_code,
+        void *arg, void **data)
+{
+    int64_t seq;
+    bool torn;
+    SFOpenHashtable table;
+    SFDlinkHashtable dtable;
+    SFDlinkHashtable old;
+    int64_t migrate_index;
+    struct fc_list_head *old_bucket;
+    SFShardingHashEntry *entry;
+    void *found;
+
+    seq = stripe_read_begin(stripe);
+    torn = false;
+    if (OPEN_ADDRESSING_ENABLED(sharding_ctx)) {
+        table = sharding->otable;  //the arrays and capacity MUST match
+        if (stripe_read_retry(stripe, seq)) {
+            return EAGAIN;
+        }
+        entry = open_htable_find_optimistic(sharding_ctx,
+                &table, key, hash_code, &torn);
+    } else {
+        dtable = sharding->hashtable;
+        old = sharding->rehash.old;
+        migrate_index = sharding->rehash.index;
+        if (stripe_read_retry(stripe, seq)) {
+            return EAGAIN;
+        }
+        entry = dlink_htable_find_optimistic(sharding_ctx, key,
+                DLINK_HTABLE_BUCKET(&dtable, hash_code),
+                sharding->element_count + 1, &torn);
+        if (entry == NULL && !torn && (old_bucket=dlink_htable_old_bucket(
+                        &old, migrate_index, hash_code)) != NULL)
+        {
+            entry = dlink_htable_find_optimistic(sharding_ctx, key,
+                    old_bucket, sharding->element_count + 1, &torn);
+        }
+    }
+    if (torn) {
+        return EAGAIN;
+    }
+
+    if (entry != NULL && sharding_ctx->find_callback != NULL) {
+        found = sharding_ctx->find_callback(entry, arg);
+    } else {
+        found = entry;
+    }
+    if (stripe_read_retry(stripe, seq)) {
+        return EAGAIN;
+    }
+
+    *data = found;
+    return 0;
+}
+
+/* the caller MUST hold the stripe lock */
+static inline void *sharding_find(SFHtableShardingContext *sharding_ctx,
+        SFHtableSharding *sharding, SFHtableStripe *stripe,
+        const SFTwoIdsHashKey *key, const uint64_t hash_code, void *arg)
+{
+    SFShardingHashEntry *entry;
+
+    entry = htable_find(sharding_ctx, sharding, stripe, key, hash_code);
+    if (entry != NULL && sharding_ctx->find_callback != NULL) {
+        return sharding_ctx->find_callback(entry, arg);
+    } else {
+        return entry;
+    }
+}
+
+static inline void sharding_charge_entry(SFHtableShardingContext
+        *sharding_ctx, SFHtableSharding *sharding, SFShardingHashEntry *entry)
+{
+    int charge;
+
+    charge = sharding_ctx->element_size;
+    if (sharding_ctx->charge_callback != NULL) {
+        charge += sharding_ctx->charge_callback(entry);
+    }
+    SHARDING_COUNTER_ADD(sharding, memory.used, charge - entry->charge);
+    entry->charge = charge;
+}
+
+/* the caller MUST hold the stripe lock and the write sequence */
+static int sharding_insert(SFHtableShardingContext *sharding_ctx,
+        SFHtableSharding *sharding, SFHtableStripe *stripe,
+        const SFTwoIdsHashKey *key, const uint64_t hash_code, void *arg)
+{
+    SFShardingHashEntry *entry;
+    bool new_create;
+    int result;
+
+    if ((entry=htable_find(sharding_ctx, sharding, stripe,
+                    key, hash_code)) == NULL)
+    {
+        if ((entry=htable_entry_alloc(sharding, stripe)) == NULL) {
+            return ENOMEM;
+        }
+
+        new_create = true;
+        entry->key = *key;
+        entry->referenced = false;
+        if ((result=htable_insert(sharding_ctx, sharding,
+                        entry, hash_code)) != 0)
+        {
+            fast_mblock_free_object(sharding->allocator, entry);
+            SHARDING_COUNTER_ADD(sharding, element_count, -1);
+            return result;
+        }
+        fc_list_add_tail(&entry->dlinks.lru, &stripe->lru);
+    } else {
+        new_create = false;
+        entry->referenced = true;  //instead of moving to the LRU tail
+    }
+
+    entry->last_update_time_sec = get_current_time();
+    result = sharding_ctx->insert_callback(entry, arg, new_create);
+    sharding_charge_entry(sharding_ctx, sharding, entry);
+    if (DLINK_RESIZE_ENABLED(sharding_ctx)) {
+        dlink_htable_check_resize(sharding);
+    }
+    return result;
+}
+
+void *sf_sharding_htable_find(SFHtableShardingContext
+        *sharding_ctx, const SFTwoIdsHashKey *key, void *arg)
+{
+    SFHtableReaderSlot *slot;
+    void *data;
+    int i;
+    SET_SHARDING_AND_HASH_CODE(sharding_ctx, key);
+
+    /* MUST leave before locking, the retiring waits for the readers */
+    if (OPTIMISTIC_READ_ENABLED(sharding_ctx) &&
+            sharding_reader_enter(sharding_ctx, &slot))
+    {
+        for (i=0; i<SF_SHARDING_HTABLE_OPTIMISTIC_RETRIES; i++) {
+            if (optimistic_find(sharding_ctx, sharding, stripe,
+                        key, hash_code, arg, &data) == 0)
+            {
+                sharding_reader_leave(slot);
+                return data;
+            }
+        }
+        sharding_reader_leave(slot);
+    }
+
+    stripe_lock(sharding_ctx, stripe);
+    if (OPTIMISTIC_READ_ENABLED(sharding_ctx) &&
+            CONTENTION_STATS_ENABLED(sharding_ctx))
+    {
+        stripe->stats.optimistic_fallbacks++;
+    }
+    data = sharding_find(sharding_ctx, sharding, stripe,
+            key, hash_code, arg);
+    PTHREAD_MUTEX_UNLOCK(&stripe->lock);
+
+    return data;
+}
+
+int sf_sharding_htable_insert(SFHtableShardingContext
+        *sharding_ctx, const SFTwoIdsHashKey *key, void *arg)
+{
+    int result;
+    SET_SHARDING_AND_HASH_CODE(sharding_ctx, key);
+
+    stripe_lock(sharding_ctx, stripe);
+    stripe_write_begin(sharding_ctx, stripe);
+    result = sharding_insert(sharding_ctx, sharding, stripe,
+            key, hash_code, arg);
+    stripe_write_end(sharding_ctx, stripe);
+    PTHREAD_MUTEX_UNLOCK(&stripe->lock);
+
+    return result;
+}
+
+int sf_sharding_htable_delete(SFHtableShardingContext
+        *sharding_ctx, const SFTwoIdsHashKey *key)
+{
+    SFShardingHashEntry *entry;
+    int result;
+    SET_SHARDING_AND_HASH_CODE(sharding_ctx, key);
+
+    stripe_lock(sharding_ctx, stripe);
+    stripe_write_begin(sharding_ctx, stripe);
+    if ((entry=htable_find(sharding_ctx, sharding, stripe,
+                    key, hash_code)) != NULL)
+    {
+        htable_remove(sharding, entry);
+        fc_list_del_init(&entry->dlinks.lru);
+        SHARDING_COUNTER_ADD(sharding, memory.used, -entry->charge);
+        fast_mblock_free_object(sharding->allocator, entry);
+        SHARDING_COUNTER_ADD(sharding, element_count, -1);
+        if (DLINK_RESIZE_ENABLED(sharding_ctx)) {
+            dlink_htable_check_resize(sharding);
+        }
+        result = 0;
+    } else {
+        result = ENOENT;
+    }
+    stripe_write_end(sharding_ctx, stripe);
+    PTHREAD_MUTEX_UNLOCK(&stripe->lock);
+
+    return result;
+}
+
+pthread_mutex_t *sf_sharding_htable_entry_lock(SFShardingHashEntry *entry)
+{
+    SFHtableShardingContext *sharding_ctx;
+    uint64_t hash_code;
+
+    sharding_ctx = entry->sharding->ctx;
+    if (sharding_ctx->stripe_count == 1) {
+        return &entry->sharding->lock;
+    }
+
+    hash_code = sharding_htable_hash(sharding_ctx, &entry->key);
+    return &SHARDING_HTABLE_GET_STRIPE(sharding_ctx,
+            entry->sharding, hash_code)->lock;
+}
+
+typedef struct sf_sharding_batch_item {
+    SFHtableSharding *sharding;
+    SFHtableStripe *stripe;
+    uint64_t hash_code;
+    int index;   //the index of the key
+} SFShardingBatchItem;
+
+#define SHARDING_BATCH_FIXED_COUNT  64
+
+static int compare_batch_item(const void *p1, const void *p2)
+{
+    const SFShardingBatchItem *item1;
+    const SFShardingBatchItem *item2;
+
+    item1 = (const SFShardingBatchItem *)p1;
+    item2 = (const SFShardingBatchItem *)p2;
+    if (item1->stripe != item2->stripe) {
+        return item1->stripe < item2->stripe ? -1 : 1;
+    }
+    return item1->index - item2->index;  //keep the order of the same key
+}
+
+/* sort the keys by the stripe, use the fixed items when enough */
+static SFShardingBatchItem *sharding_batch_prepare(SFHtableShardingContext
+        *sharding_ctx, const SFTwoIdsHashKey *keys, const int count,
+        SFShardingBatchItem *fixed_items)
+{
+    SFShardingBatchItem *items;
+    int i;
+
+    if (count <= SHARDING_BATCH_FIXED_COUNT) {
+        items = fixed_items;
+    } else if ((items=(SFShardingBatchItem *)fc_malloc(
+                    sizeof(SFShardingBatchItem) * count)) == NULL)
+    {
+        return NULL;
+    }
+
+    for (i=0; i<count; i++) {
+        items[i].hash_code = sharding_htable_hash(sharding_ctx, keys + i);
+        items[i].sharding = SHARDING_HTABLE_GET_SHARDING(
+                sharding_ctx, items[i].hash_code);
+        items[i].stripe = SHARDING_HTABLE_GET_STRIPE(sharding_ctx,
+                items[i].sharding, items[i].hash_code);
+        items[i].index = i;
+    }
+
+    if (count > 1) {
+        qsort(items, count, sizeof(SFShardingBatchItem), compare_batch_item);
+    }
+    return items;
+}
+
+int sf_sharding_htable_batch_find(SFHtableShardingContext *sharding_ctx,
+        const SFTwoIdsHashKey *keys, void **args, const int count,
+        void **results)
+{
+    SFShardingBatchItem fixed_items[SHARDING_BATCH_FIXED_COUNT];
+    SFShardingBatchItem *items;
+    SFShardingBatchItem *item;
+    SFShardingBatchItem *end;
+    SFHtableStripe *stripe;
+
+    if ((items=sharding_batch_prepare(sharding_ctx, keys,
+                    count, fixed_items)) == NULL)
+    {
+        return ENOMEM;
+    }
+
+    end = items + count;
+    item = items;
+    while (item < end) {
+        stripe = item->stripe;
+        stripe_lock(sharding_ctx, stripe);
+        do {
+            results[item->index] = sharding_find(sharding_ctx,
+                    item->sharding, stripe, keys + item->index,
+                    item->hash_code, (args != NULL ?
+                        args[item->index] : NULL));
+        } while (++item < end && item->stripe == stripe);
+        PTHREAD_MUTEX_UNLOCK(&stripe->lock);
+    }
+
+    if (items != fixed_items) {
+        free(items);
+    }
+    return 0;
+}
+
+int sf_sharding_htable_batch_insert(SFHtableShardingContext *sharding_ctx,
+        const SFTwoIdsHashKey *keys, void **args, const int count,
+        int *results)
+{
+    SFShardingBatchItem fixed_items[SHARDING_BATCH_FIXED_COUNT];
+    SFShardingBatchItem *items;
+    SFShardingBatchItem *item;
+    SFShardingBatchItem *end;
+    SFHtableStripe *stripe;
+    int result;
+    int first_error;
+
+    if ((items=sharding_batch_prepare(sharding_ctx, keys,
+                    count, fixed_items)) == NULL)
+    {
+        return ENOMEM;
+    }
+
+    first_error = 0;
+    end = items + count;
+    item = items;
+    while (item < end) {
+        stripe = item->stripe;
+        stripe_lock(sharding_ctx, stripe);
+        stripe_write_begin(sharding_ctx, stripe);
+        do {
+            result = sharding_insert(sharding_ctx, item->sharding, stripe,
+                    keys + item->index, item->hash_code, (args != NULL ?
+                        args[item->index] : NULL));
+            if (results != NULL) {
+                results[item->index] = result;
+            }
+            if (result != 0 && first_error == 0) {
+                first_error = result;
+            }
+        } while (++item < end && item->stripe == stripe);
+        stripe_write_end(sharding_ctx, stripe);
+        PTHREAD_MUTEX_UNLOCK(&stripe->lock);
+    }
+
+    if (items != fixed_items) {
+        free(items);
+    }
+    return first_error;
+}
+
+/* stripe_done is called after each stripe is unlocked, can be NULL */
+static int sharding_iterate_stripes(SFHtableShardingContext *sharding_ctx,
+        const int thread_index, const int thread_count,
+        sf_sharding_htable_iterate_callback callback,
+        int (*stripe_done)(void *arg), void *arg)
+{
+    SFHtableSharding *sharding;
+    SFHtableSharding *end;
+    SFHtableStripe *stripe;
+    SFHtableStripe *send;
+    SFShardingHashEntry *entry;
+    int result;
+
+    result = 0;
+    end = sharding_ctx->sharding_array.entries +
+        sharding_ctx->sharding_array.count;
+    for (sharding=sharding_ctx->sharding_array.entries + thread_index;
+            sharding<end; sharding+=thread_count)
+    {
+        send = sharding->stripes + sharding_ctx->stripe_count;
+        for (stripe=sharding->stripes; stripe<send; stripe++) {
+            stripe_lock(sharding_ctx, stripe);
+            fc_list_for_each_entry(entry, &stripe->lru, dlinks.lru) {
+                if ((result=callback(entry, arg)) != 0) {
+                    break;
+                }
+            }
+            PTHREAD_MUTEX_UNLOCK(&stripe->lock);
+
+            if (result != 0) {
+                return result;
+            }
+            if (stripe_done != NULL && (result=stripe_done(arg)) != 0) {
+                return result;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int sf_sharding_htable_iterate_ex(SFHtableShardingContext *sharding_ctx,
+        const int thread_index, const int thread_count,
+        sf_sharding_htable_iterate_callback callback, void *arg)
+{
+    return sharding_iterate_stripes(sharding_ctx, thread_index,
+            thread_count, callback, NULL, arg);
+}
+
+static void *sharding_reclaim_thread_func(void *arg)
+{
+    SFHtableShardingContext *sharding_ctx;
+    SFHtableSharding *sharding;
+    SFHtableSharding *end;
+    SFHtableStripe *stripe;
+    SFHtableStripe *send;
+    int64_t reclaim_count;
+    int sleep_ms;
+
+    sharding_ctx = (SFHtableShardingContext *)arg;
+    end = sharding_ctx->sharding_array.entries +
+        sharding_ctx->sharding_array.count;
+    while (sharding_ctx->reclaim_thread.continue_flag) {
+        for (sleep_ms=0; sleep_ms<sharding_ctx->reclaim_thread.interval_ms &&
+                sharding_ctx->reclaim_thread.continue_flag; sleep_ms+=100)
+        {
+            fc_sleep_ms(FC_MIN(100, sharding_ctx->reclaim_thread.
+                        interval_ms - sleep_ms));
+        }
+
+        reclaim_count = 0;
+        for (sharding=sharding_ctx->sharding_array.entries;
+                sharding<end; sharding++)
+        {
+            if (sharding->element_count <= sharding_ctx->
+                    sharding_reclaim.elt_water_mark &&
+                    !SHARDING_MEMORY_EXCEEDED(sharding))
+            {
+                continue;
+            }
+
+            send = sharding->stripes + sharding_ctx->stripe_count;
+            for (stripe=sharding->stripes; stripe<send; stripe++) {
+                stripe_lock(sharding_ctx, stripe);
+                stripe_write_begin(sharding_ctx, stripe);
+                reclaim_count += otid_entry_reclaim(sharding, stripe, NULL);
+                if (DLINK_RESIZE_ENABLED(sharding_ctx)) {
+                    dlink_htable_check_resize(sharding);
+                }
+                stripe_write_end(sharding_ctx, stripe);
+                PTHREAD_MUTEX_UNLOCK(&stripe->lock);
+            }
+            sharding->last_reclaim_time_sec = get_current_time();
+        }
+
+        if (reclaim_count > 0) {
+            logDebug("file: "__FILE__", line: %d, "
+                    "background reclaim count: %"PRId64,
+                    __LINE__, reclaim_count);
+        }
+    }
+
+    sharding_ctx->reclaim_thread.running = false;
+    return NULL;
+}
+
+/* the thread is joinable for stopping, so not by fc_create_thread */
+int sf_sharding_htable_start_reclaim_thread(SFHtableShardingContext
+        *sharding_ctx, const int interval_ms)
+{
+    pthread_attr_t thread_attr;
+    int result;
+
+    if (sharding_ctx->reclaim_thread.continue_flag) {
+        return EEXIST;
+    }
+
+    if ((result=pthread_attr_init(&thread_attr)) != 0) {
+        return result;
+    }
+    if (SF_G_THREAD_STACK_SIZE > 0 && (result=pthread_attr_setstacksize(
+                    &thread_attr, SF_G_THREAD_STACK_SIZE)) != 0)
+    {
+        pthread_attr_destroy(&thread_attr);
+        return result;
+    }
+
+    sharding_ctx->reclaim_thread.interval_ms = interval_ms > 0 ?
+        interval_ms : 1000;
+    sharding_ctx->reclaim_thread.continue_flag = true;
+    sharding_ctx->reclaim_thread.running = true;
+    if ((result=pthread_create(&sharding_ctx->reclaim_thread.tid,
+                    &thread_attr, sharding_reclaim_thread_func,
+                    sharding_ctx)) != 0)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "create thread fail, errno: %d, error info: %s",
+                __LINE__, result, STRERROR(result));
+        sharding_ctx->reclaim_thread.continue_flag = false;
+        sharding_ctx->reclaim_thread.running = false;
+    }
+    pthread_attr_destroy(&thread_attr);
+    return result;
+}
+
+void sf_sharding_htable_stop_reclaim_thread(SFHtableShardingContext
+        *sharding_ctx)
+{
+    int result;
+
+    if (!sharding_ctx->reclaim_thread.continue_flag) {
+        return;  //not started or stopped
+    }
+
+    sharding_ctx->reclaim_thread.continue_flag = false;
+    if ((result=pthread_join(sharding_ctx->reclaim_thread.tid,
+                    NULL)) != 0)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "join the reclaim thread fail, "
+                "errno: %d, error info: %s",
+                __LINE__, result, STRERROR(result));
+    }
+}
+
+void sf_sharding_htable_set_memory_limit(SFHtableShardingContext
+        *sharding_ctx, sf_sharding_htable_charge_callback
+        charge_callback, const int64_t memory_limit)
+{
+    SFHtableSharding *sharding;
+    SFHtableSharding *end;
+
+    sharding_ctx->charge_callback = charge_callback;
+    end = sharding_ctx->sharding_array.entries +
+        sharding_ctx->sharding_array.count;
+    for (sharding=sharding_ctx->sharding_array.entries;
+            sharding<end; sharding++)
+    {
+        sharding->memory.limit = memory_limit /
+            sharding_ctx->sharding_array.count;
+    }
+}
+
+void sf_sharding_htable_get_memory_stats(SFHtableShardingContext
+        *sharding_ctx, SFShardingHtableMemoryStats *stats)
+{
+    SFHtableSharding *sharding;
+    SFHtableSharding *end;
+
+    memset(stats, 0, sizeof(*stats));
+    end = sharding_ctx->sharding_array.entries +
+        sharding_ctx->sharding_array.count;
+    for (sharding=sharding_ctx->sharding_array.entries;
+            sharding<end; sharding++)
+    {
+        stats->element_count += sharding->element_count;
+        stats->memory_used += sharding->memory.used;
+        stats->memory_limit += sharding->memory.limit;
+        if (sharding->memory.used > stats->max_sharding_used) {
+            stats->max_sharding_used = sharding->memory.used;
+        }
+
+        if (OPEN_ADDRESSING_ENABLED(sharding_ctx)) {
+            stats->htable_bytes += sharding->otable.capacity *
+                (sizeof(SFShardingHashEntry *) + 1);
+        } else {
+            stats->htable_bytes += (sharding->hashtable.capacity +
+                    sharding->rehash.old.capacity) *
+                sizeof(struct fc_list_head);
+        }
+    }
+}
+
+/* the groups probed to reach the slot */
+static inline int open_htable_probe_length(SFOpenHashtable *table,
+        const int64_t index, const uint64_t hash)
+{
+    int64_t pos;
+    int64_t step;
+    int length;
+
+    pos = OPEN_HTABLE_H1(hash) & (table->capacity - 1);
+    step = 0;
+    length = 1;
+    while (((index - pos) & (table->capacity - 1)) >=
+            OPEN_HTABLE_GROUP_WIDTH)
+    {
+        OPEN_HTABLE_PROBE_NEXT(table, pos, step);
+        length++;
+    }
+    return length;
+}
+
+static inline void chain_stats_add(SFShardingHtableChainStats *stats,
+        const int length)
+{
+    stats->histogram[FC_MIN(length, SF_SHARDING_HTABLE_CHAIN_HISTOGRAM_SIZE
+            - 1)]++;
+    if (length > stats->max_length) {
+        stats->max_length = length;
+    }
+}
+
+static void dlink_chain_stats(const SFDlinkHashtable *table,
+        const int64_t start, SFShardingHtableChainStats *stats)
+{
+    struct fc_list_head *bucket;
+    struct fc_list_head *end;
+    struct fc_list_head *node;
+    int length;
+
+    stats->bucket_count += table->capacity - start;
+    end = table->buckets + table->capacity;
+    for (bucket=table->buckets + start; bucket<end; bucket++) {
+        length = 0;
+        fc_list_for_each(node, bucket) {
+            length++;
+        }
+        if (length > 0) {
+            stats->used_buckets++;
+        }
+        chain_stats_add(stats, length);
+    }
+}
+
+static void sharding_chain_stats(SFHtableSharding *sharding,
+        SFShardingHtableChainStats *stats)
+{
+    SFOpenHashtable *table;
+    int64_t index;
+
+    if (OPEN_ADDRESSING_ENABLED(sharding->ctx)) {
+        table = &sharding->otable;
+        stats->bucket_count += table->capacity;
+        for (index=0; index<table->capacity; index++) {
+            if (table->ctrls[index] >= 0) {
+                stats->used_buckets++;
+                chain_stats_add(stats, open_htable_probe_length(table,
+                            index, sharding_htable_hash(sharding->ctx,
+                                &table->slots[index]->key)));
+            }
+        }
+        return;
+    }
+
+    dlink_chain_stats(&sharding->hashtable, 0, stats);
+    if (sharding->rehash.old.buckets != NULL) {  //the buckets to migrate
+        dlink_chain_stats(&sharding->rehash.old,
+                sharding->rehash.index, stats);
+    }
+}
+
+/* lock the stripes in order, no one else holds two stripe locks */
+static void sharding_lock_all(SFHtableSharding *sharding)
+{
+    SFHtableStripe *stripe;
+    SFHtableStripe *end;
+
+    end = sharding->stripes + sharding->ctx->stripe_count;
+    for (stripe=sharding->stripes; stripe<end; stripe++) {
+        stripe_lock(sharding->ctx, stripe);
+    }
+}
+
+static void sharding_unlock_all(SFHtableSharding *sharding)
+{
+    SFHtableStripe *stripe;
+    SFHtableStripe *end;
+
+    end = sharding->stripes + sharding->ctx->stripe_count;
+    for (stripe=sharding->stripes; stripe<end; stripe++) {
+        PTHREAD_MUTEX_UNLOCK(&stripe->lock);
+    }
+}
+
+void sf_sharding_htable_get_chain_stats(SFHtableShardingContext
+        *sharding_ctx, SFShardingHtableChainStats *stats)
+{
+    SFHtableSharding *sharding;
+    SFHtableSharding *end;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->min_sharding_elements = -1;
+    end = sharding_ctx->sharding_array.entries +
+        sharding_ctx->sharding_array.count;
+    for (sharding=sharding_ctx->sharding_array.entries;
+            sharding<end; sharding++)
+    {
+        sharding_lock_all(sharding);
+        sharding_chain_stats(sharding, stats);
+        stats->element_count += sharding->element_count;
+        if (stats->min_sharding_elements < 0 || sharding->element_count <
+                stats->min_sharding_elements)
+        {
+            stats->min_sharding_elements = sharding->element_count;
+        }
+        if (sharding->element_count > stats->max_sharding_elements) {
+            stats->max_sharding_elements = sharding->element_count;
+        }
+        sharding_unlock_all(sharding);
+    }
+}
+
+static inline void stripe_stats_add(SFHtableStripeStats *total,
+        const SFHtableStripeStats *stats)
+{
+    total->lock_count += stats->lock_count;
+    total->wait_count += stats->wait_count;
+    total->wait_time_us += stats->wait_time_us;
+    total->lookup_count += stats->lookup_count;
+    total->lookup_steps += stats->lookup_steps;
+    total->optimistic_fallbacks += stats->optimistic_fallbacks;
+}
+
+void sf_sharding_htable_get_contention_stats(SFHtableShardingContext
+        *sharding_ctx, const int sharding_index,
+        SFShardingHtableContentionStats *stats)
+{
+    SFHtableSharding *sharding;
+    SFHtableSharding *start;
+    SFHtableSharding *end;
+    SFHtableStripe *stripe;
+    SFHtableStripe *send;
+    int64_t wait_time_us;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->hottest_sharding = -1;
+    if (sharding_index >= 0) {
+        if (sharding_index >= sharding_ctx->sharding_array.count) {
+            return;
+        }
+        start = sharding_ctx->sharding_array.entries + sharding_index;
+        end = start + 1;
+    } else {
+        start = sharding_ctx->sharding_array.entries;
+        end = start + sharding_ctx->sharding_array.count;
+    }
+
+    for (sharding=start; sharding<end; sharding++) {
+        wait_time_us = 0;
+        send = sharding->stripes + sharding_ctx->stripe_count;
+        for (stripe=sharding->stripes; stripe<send; stripe++) {
+            stripe_stats_add(&stats->total, &stripe->stats);
+            wait_time_us += stripe->stats.wait_time_us;
+        }
+
+        if (stats->hottest_sharding < 0 ||
+                wait_time_us > stats->hottest_wait_time_us)
+        {
+            stats->hottest_sharding = sharding -
+                sharding_ctx->sharding_array.entries;
+            stats->hottest_wait_time_us = wait_time_us;
+        }
+    }
+}
+
+void sf_sharding_htable_reset_contention_stats(SFHtableShardingContext
+        *sharding_ctx)
+{
+    SFHtableSharding *sharding;
+    SFHtableSharding *end;
+    SFHtableStripe *stripe;
+    SFHtableStripe *send;
+
+    end = sharding_ctx->sharding_array.entries +
+        sharding_ctx->sharding_array.count;
+    for (sharding=sharding_ctx->sharding_array.entries;
+            sharding<end; sharding++)
+    {
+        send = sharding->stripes + sharding_ctx->stripe_count;
+        for (stripe=sharding->stripes; stripe<send; stripe++) {
+            PTHREAD_MUTEX_LOCK(&stripe->lock);
+            memset(&stripe->stats, 0, sizeof(stripe->stats));
+            PTHREAD_MUTEX_UNLOCK(&stripe->lock);
+        }
+    }
+}
+
+#define SNAPSHOT_FILE_MAGIC      "SFHS"
+#define SNAPSHOT_BLOCK_MAGIC     "SFHB"
+#define SNAPSHOT_FORMAT_VERSION  1
+
+typedef struct sf_sharding_snapshot_header {
+    char magic[4];
+    char version[4];
+    char key_type[4];
+    char crc32[4];
+} SFShardingSnapshotHeader;
+
+/* the block body is the records:
+   id1 (8 bytes), id2 (8 bytes, the two ids key only),
+   update time (4 bytes), payload length (4 bytes), payload */
+typedef struct sf_sharding_snapshot_block_header {
+    char magic[4];
+    char body_len[4];
+    char record_count[4];
+    char body_crc32[4];
+    char header_crc32[4];  //crc32 of the fields before
+} SFShardingSnapshotBlockHeader;
+
+#define SNAPSHOT_RECORD_FIXED_SIZE(sharding_ctx) \
+    (8 * (int)(sharding_ctx)->key_type + 4 + 4)
+
+typedef struct sf_sharding_dump_context {
+    SFHtableShardingContext *sharding_ctx;
+    int fd;
+    int thread_count;
+    int max_payload_size;
+    int max_record_size;
+    volatile int64_t file_offset;  //the offset of the next block
+    sf_sharding_htable_pack_callback pack_callback;
+    void *arg;
+    const char *filename;
+} SFShardingDumpContext;
+
+/* the buffer holds the sealed blocks followed by the open block,
+   the sealed blocks are written after the stripe is unlocked */
+typedef struct sf_sharding_dump_thread {
+    SFShardingDumpContext *dump_ctx;
+    int thread_index;
+    int result;
+    int record_count;  //the records in the open block
+    int block_start;   //the offset of the open block
+    int block_size;    //the max size of the block
+    int length;        //including the block headers
+    int size;
+    char *buff;
+} SFShardingDumpThread;
+
+typedef struct sf_sharding_load_context {
+    SFHtableShardingContext *sharding_ctx;
+    sf_sharding_htable_unpack_callback unpack_callback;
+    void *arg;
+    struct fast_mblock_chain *chains;  //the free entries of each allocator
+    int64_t loaded_count;
+    int64_t skipped_count;
+} SFShardingLoadContext;
+
+static int snapshot_pwrite(const int fd, const char *filename,
+        const char *buff, const int length, const int64_t offset)
+{
+    int result;
+    int bytes;
+    int done;
+
+    done = 0;
+    while (done < length) {
+        if ((bytes=pwrite(fd, buff + done, length - done,
+                        offset + done)) <= 0)
+        {
+            result = (bytes < 0 && errno != 0) ? errno : EIO;
+            logError("file: "__FILE__", line: %d, "
+                    "write file \"%s\" fail, offset: %"PRId64", "
+                    "errno: %d, error info: %s", __LINE__, filename,
+                    offset + done, result, STRERROR(result));
+            return result;
+        }
+        done += bytes;
+    }
+
+    return 0;
+}
+
+/* return 0 for success, ENOENT for the end of file,
+   EINVAL for the incomplete data */
+static int snapshot_pread(const int fd, const char *filename,
+        char *buff, const int length, const int64_t offset)
+{
+    int result;
+    int bytes;
+    int done;
+
+    done = 0;
+    while (done < length) {
+        if ((bytes=pread(fd, buff + done, length - done,
+                        offset + done)) < 0)
+        {
+            result = errno != 0 ? errno : EIO;
+            logError("file: "__FILE__", line: %d, "
+                    "read file \"%s\" fail, offset: %"PRId64", "
+                    "errno: %d, error info: %s", __LINE__, filename,
+                    offset + done, result, STRERROR(result));
+            return result;
+        } else if (bytes == 0) {
+            return done == 0 ? ENOENT : EINVAL;
+        }
+        done += bytes;
+    }
+
+    return 0;
+}
+
+static void dump_seal_block(SFShardingDumpThread *thread)
+{
+    SFShardingSnapshotBlockHeader *header;
+    int body_len;
+
+    if (thread->record_count == 0) {
+        return;
+    }
+
+    header = (SFShardingSnapshotBlockHeader *)
+        (thread->buff + thread->block_start);
+    body_len = thread->length - thread->block_start -
+        sizeof(SFShardingSnapshotBlockHeader);
+    memcpy(header->magic, SNAPSHOT_BLOCK_MAGIC, sizeof(header->magic));
+    int2buff(body_len, header->body_len);
+    int2buff(thread->record_count, header->record_count);
+    int2buff(sf_crc32c(0, header + 1, body_len), header->body_crc32);
+    int2buff(sf_crc32c(0, header, header->header_crc32 -
+                (char *)header), header->header_crc32);
+
+    thread->block_start = thread->length;
+    thread->length += sizeof(SFShardingSnapshotBlockHeader);
+    thread->record_count = 0;
+}
+
+/* write the sealed blocks and keep the open block,
+   MUST be called without the stripe lock */
+static int dump_thread_flush(void *arg)
+{
+    SFShardingDumpThread *thread;
+    int64_t offset;
+    int result;
+
+    thread = (SFShardingDumpThread *)arg;
+    if (thread->block_start == 0) {
+        return 0;
+    }
+
+    /* reserve the file space for the blocks */
+    offset = __sync_fetch_and_add(&thread->dump_ctx->file_offset,
+            thread->block_start);
+    result = snapshot_pwrite(thread->dump_ctx->fd, thread->dump_ctx->
+            filename, thread->buff, thread->block_start, offset);
+
+    thread->length -= thread->block_start;
+    memmove(thread->buff, thread->buff + thread->block_start,
+            thread->length);
+    thread->block_start = 0;
+    return result;
+}
+
+/* the stripe holds more records than the buffer */
+static int dump_thread_expand(SFShardingDumpThread *thread)
+{
+    char *buff;
+    int size;
+
+    size = 2 * thread->size;
+    if ((buff=(char *)fc_malloc(size)) == NULL) {
+        return ENOMEM;
+    }
+    memcpy(buff, thread->buff, thread->length);
+    free(thread->buff);
+    thread->buff = buff;
+    thread->size = size;
+    return 0;
+}
+
+/* the iterate callback with the stripe lock, only pack the records
+   into the buffer, the file IO is done by dump_thread_flush */
+static int dump_pack_entry(SFShardingHashEntry *entry, void *arg)
 {
+    SFShardingDumpThread *thread;
+    SFShardingDumpContext *dump_ctx;
+    char *p;
+    int payload_len;
     int result;
-    int bytes;
-    struct fc_list_head *ph;
-    struct fc_list_head *end;
 
-    if ((result=init_pthread_lock(&sharding->lock)) != 0) {
-        return result;
+    thread = (SFShardingDumpThread *)arg;
+    dump_ctx = thread->dump_ctx;
+    if ((thread->length - thread->block_start) + dump_ctx->
+            max_record_size > thread->block_size)
+    {
+        dump_seal_block(thread);
+    }
+    if (thread->size - thread->length < (int)sizeof(
+                SFShardingSnapshotBlockHeader) + dump_ctx->max_record_size)
+    {
+        if ((result=dump_thread_expand(thread)) != 0) {
+            return result;
+        }
     }
 
-    bytes = sizeof(struct fc_list_head) * per_capacity;
-    sharding->hashtable.buckets = (struct fc_list_head *)fc_malloc(bytes);
-    if (sharding->hashtable.buckets == NULL) {
-        return ENOMEM;
+    p = thread->buff + thread->length;
+    long2buff(entry->key.id1, p);
+    p += 8;
+    if (dump_ctx->sharding_ctx->key_type == sf_sharding_htable_key_ids_two) {
+        long2buff(entry->key.id2, p);
+        p += 8;
     }
-    end = sharding->hashtable.buckets + per_capacity;
-    for (ph=sharding->hashtable.buckets; ph<end; ph++) {
-        FC_INIT_LIST_HEAD(ph);
+    int2buff(entry->last_update_time_sec, p);
+    p += 4;
+
+    if (dump_ctx->pack_callback != NULL) {
+        payload_len = dump_ctx->pack_callback(entry, p + 4,
+                dump_ctx->max_payload_size, dump_ctx->arg);
+        if (payload_len < 0 || payload_len > dump_ctx->max_payload_size) {
+            result = payload_len < 0 ? -1 * payload_len : EOVERFLOW;
+            logError("file: "__FILE__", line: %d, "
+                    "pack the payload of the entry fail, "
+                    "payload length: %d, max payload size: %d",
+                    __LINE__, payload_len, dump_ctx->max_payload_size);
+            return result;
+        }
+    } else {
+        payload_len = 0;
     }
+    int2buff(payload_len, p);
+    p += 4 + payload_len;
 
-    sharding->hashtable.capacity = per_capacity;
-    sharding->element_count = 0;
-    sharding->last_reclaim_time_sec = get_current_time();
-    FC_INIT_LIST_HEAD(&sharding->lru);
+    thread->length = p - thread->buff;
+    thread->record_count++;
     return 0;
 }
 
-static int init_sharding_array(SFHtableShardingContext *sharding_ctx,
-        const int sharding_count, const int64_t per_elt_limit,
-        const int64_t per_capacity)
+static void *dump_thread_func(void *arg)
+{
+    SFShardingDumpThread *thread;
+
+    thread = (SFShardingDumpThread *)arg;
+    if ((thread->result=sharding_iterate_stripes(thread->dump_ctx->
+                    sharding_ctx, thread->thread_index, thread->dump_ctx->
+                    thread_count, dump_pack_entry, dump_thread_flush,
+                    thread)) == 0)
+    {
+        dump_seal_block(thread);
+        thread->result = dump_thread_flush(thread);
+    }
+    return NULL;
+}
+
+static int dump_run_threads(SFShardingDumpContext *dump_ctx)
 {
+    SFShardingDumpThread *threads;
+    pthread_t *tids;
+    int buffer_size;
+    int alloc_count;
     int result;
-    int bytes;
-    SFHtableSharding *ps;
-    SFHtableSharding *end;
+    int i;
 
-    bytes = sizeof(SFHtableSharding) * sharding_count;
-    sharding_ctx->sharding_array.entries = (SFHtableSharding *)fc_malloc(bytes);
-    if (sharding_ctx->sharding_array.entries == NULL) {
+    threads = (SFShardingDumpThread *)fc_malloc((sizeof(
+                    SFShardingDumpThread) + sizeof(pthread_t)) *
+            dump_ctx->thread_count);
+    if (threads == NULL) {
         return ENOMEM;
     }
+    tids = (pthread_t *)(threads + dump_ctx->thread_count);
 
-    end = sharding_ctx->sharding_array.entries + sharding_count;
-    for (ps=sharding_ctx->sharding_array.entries; ps<end; ps++) {
-        ps->allocator = sharding_ctx->allocators.elts +
-            (ps - sharding_ctx->sharding_array.entries) %
-            sharding_ctx->allocators.count;
-        ps->element_limit = per_elt_limit;
-        ps->ctx = sharding_ctx;
-        if ((result=init_sharding(ps, per_capacity)) != 0) {
-            return result;
+    buffer_size = FC_MAX(SF_SHARDING_SNAPSHOT_BLOCK_SIZE, sizeof(
+                SFShardingSnapshotBlockHeader) + dump_ctx->max_record_size);
+    result = 0;
+    for (i=0; i<dump_ctx->thread_count; i++) {
+        threads[i].dump_ctx = dump_ctx;
+        threads[i].thread_index = i;
+        threads[i].result = 0;
+        threads[i].record_count = 0;
+        threads[i].block_start = 0;
+        threads[i].block_size = buffer_size;
+        threads[i].length = sizeof(SFShardingSnapshotBlockHeader);
+        threads[i].size = buffer_size;
+        if ((threads[i].buff=(char *)fc_malloc(buffer_size)) == NULL) {
+            result = ENOMEM;
+            break;
         }
     }
+    alloc_count = i;
 
-    sharding_ctx->sharding_array.count = sharding_count;
-    return 0;
+    if (result == 0) {
+        if (dump_ctx->thread_count == 1) {
+            dump_thread_func(threads);
+        } else {
+            for (i=0; i<dump_ctx->thread_count; i++) {
+                if ((result=fc_create_thread(tids + i, dump_thread_func,
+                                threads + i, SF_G_THREAD_STACK_SIZE)) != 0)
+                {
+                    break;
+                }
+            }
+            while (--i >= 0) {
+                pthread_join(tids[i], NULL);
+            }
+        }
+
+        for (i=0; i<dump_ctx->thread_count && result == 0; i++) {
+            result = threads[i].result;
+        }
+    }
+
+    for (i=0; i<alloc_count; i++) {
+        free(threads[i].buff);
+    }
+    free(threads);
+    return result;
 }
 
-int sf_sharding_htable_init(SFHtableShardingContext *sharding_ctx,
-        const SFShardingHtableKeyType key_type,
-        sf_sharding_htable_insert_callback insert_callback,
-        sf_sharding_htable_find_callback find_callback,
-        sf_sharding_htable_accept_reclaim_callback reclaim_callback,
-        const int sharding_count, const int64_t htable_capacity,
-        const int allocator_count, const int element_size,
-        int64_t element_limit, const int64_t min_ttl_sec,
-        const int64_t max_ttl_sec)
+int sf_sharding_htable_dump(SFHtableShardingContext *sharding_ctx,
+        const char *filename, const int thread_count,
+        const int max_payload_size, sf_sharding_htable_pack_callback
+        pack_callback, void *arg)
 {
+    SFShardingDumpContext dump_ctx;
+    SFShardingSnapshotHeader header;
+    char tmp_filename[PATH_MAX];
     int result;
-    int64_t per_elt_limit;
-    int64_t per_capacity;
 
-    if (element_limit <= 0) {
-        element_limit = 1000 * 1000;
-    }
-    if ((result=init_allocators(sharding_ctx, allocator_count,
-                    element_size, element_limit)) != 0)
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+    if ((dump_ctx.fd=open(tmp_filename, O_WRONLY | O_CREAT |
+                    O_TRUNC, 0644)) < 0)
     {
+        result = errno != 0 ? errno : EACCES;
+        logError("file: "__FILE__", line: %d, "
+                "open file \"%s\" fail, errno: %d, error info: %s",
+                __LINE__, tmp_filename, result, STRERROR(result));
         return result;
     }
 
-    per_elt_limit = (element_limit + sharding_count - 1) / sharding_count;
-    per_capacity = fc_ceil_prime(htable_capacity / sharding_count);
-    if ((result=init_sharding_array(sharding_ctx, sharding_count,
-                    per_elt_limit, per_capacity)) != 0)
+    memcpy(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic));
+    int2buff(SNAPSHOT_FORMAT_VERSION, header.version);
+    int2buff(sharding_ctx->key_type, header.key_type);
+    int2buff(sf_crc32c(0, &header, header.crc32 - (char *)&header),
+            header.crc32);
+    if ((result=snapshot_pwrite(dump_ctx.fd, tmp_filename, (char *)
+                    &header, sizeof(header), 0)) == 0)
     {
-        return result;
+        dump_ctx.sharding_ctx = sharding_ctx;
+        dump_ctx.thread_count = FC_MAX(FC_MIN(thread_count,
+                    sharding_ctx->sharding_array.count), 1);
+        dump_ctx.max_payload_size = pack_callback != NULL ?
+            FC_MAX(max_payload_size, 0) : 0;
+        dump_ctx.max_record_size = SNAPSHOT_RECORD_FIXED_SIZE(
+                sharding_ctx) + dump_ctx.max_payload_size;
+        dump_ctx.file_offset = sizeof(header);
+        dump_ctx.pack_callback = pack_callback;
+        dump_ctx.arg = arg;
+        dump_ctx.filename = tmp_filename;
+        result = dump_run_threads(&dump_ctx);
     }
 
-    sharding_ctx->key_type = key_type;
-    sharding_ctx->insert_callback = insert_callback;
-    sharding_ctx->find_callback = find_callback;
-    sharding_ctx->accept_reclaim_callback = reclaim_callback;
-    sharding_ctx->sharding_reclaim.elt_water_mark = per_elt_limit * 0.10;
-    sharding_ctx->sharding_reclaim.min_ttl_sec = min_ttl_sec;
-    sharding_ctx->sharding_reclaim.max_ttl_sec = max_ttl_sec;
-    sharding_ctx->sharding_reclaim.elt_ttl_sec = (double)(sharding_ctx->
-            sharding_reclaim.max_ttl_sec - sharding_ctx->
-            sharding_reclaim.min_ttl_sec) / per_elt_limit;
+    if (result == 0 && fsync(dump_ctx.fd) != 0) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "fsync file \"%s\" fail, errno: %d, error info: %s",
+                __LINE__, tmp_filename, result, STRERROR(result));
+    }
+    close(dump_ctx.fd);
 
-    /*
-    logInfo("per_elt_limit: %"PRId64", elt_water_mark: %d, "
-            "elt_ttl_sec: %.2f", per_elt_limit, (int)sharding_ctx->
-            sharding_reclaim.elt_water_mark, sharding_ctx->
-            sharding_reclaim.elt_ttl_sec);
-            */
-    return 0;
+    if (result == 0 && rename(tmp_filename, filename) != 0) {
+        result = errno != 0 ? errno : EPERM;
+        logError("file: "__FILE__", line: %d, "
+                "rename file \"%s\" to \"%s\" fail, "
+                "errno: %d, error info: %s", __LINE__, tmp_filename,
+                filename, result, STRERROR(result));
+    }
+    if (result != 0) {
+        unlink(tmp_filename);
+        return result;
+    }
+
+    /* persist the renaming */
+    return sf_fsync_parent_dir(filename);
 }
 
-static inline int compare_key(SFHtableShardingContext *sharding_ctx,
-        const SFTwoIdsHashKey *key1, const SFTwoIdsHashKey *key2)
+/* the element limit and the memory budget are checked as the insertion */
+static SFShardingHashEntry *snapshot_entry_alloc(
+        SFShardingLoadContext *load_ctx, SFHtableSharding *sharding,
+        SFHtableStripe *stripe)
 {
-    int sub;
-
-    if (sharding_ctx->key_type == sf_sharding_htable_key_ids_one) {
-        return fc_compare_int64(key1->id1, key2->id1);
-    } else {
-        if ((sub=fc_compare_int64(key1->id1, key2->id1)) != 0) {
-            return sub;
-        }
+    struct fast_mblock_chain *chain;
+    struct fast_mblock_node *node;
 
-        return fc_compare_int64(key1->id2, key2->id2);
+    if (sharding->element_count >= sharding->element_limit ||
+            SHARDING_MEMORY_EXCEEDED(sharding))
+    {
+        otid_entry_reclaim(sharding, stripe, NULL);
     }
-}
-
-static inline SFShardingHashEntry *htable_find(
-        SFHtableShardingContext *sharding_ctx,
-        const SFTwoIdsHashKey *key, struct fc_list_head *bucket)
-{
-    int r;
-    SFShardingHashEntry *current;
 
-    fc_list_for_each_entry(current, bucket, dlinks.htable) {
-        r = compare_key(sharding_ctx, key, &current->key);
-        if (r < 0) {
+    chain = load_ctx->chains + (sharding->allocator -
+            load_ctx->sharding_ctx->allocators.elts);
+    if (chain->head == NULL) {
+        if (fast_mblock_batch_alloc(sharding->allocator,
+                    SF_SHARDING_SNAPSHOT_ALLOC_BATCH, chain) != 0)
+        {
+            chain->head = chain->tail = NULL;
             return NULL;
-        } else if (r == 0) {
-            return current;
         }
     }
 
-    return NULL;
+    node = chain->head;
+    if ((chain->head=node->next) == NULL) {
+        chain->tail = NULL;
+    }
+    return (SFShardingHashEntry *)node->data;
 }
 
-static inline void htable_insert(SFHtableShardingContext *sharding_ctx,
-        SFShardingHashEntry *entry, struct fc_list_head *bucket)
+/* the entry is appended to the LRU tail, so the dumped order is kept */
+static int load_record(SFHtableShardingContext *sharding_ctx,
+        SFShardingLoadContext *load_ctx, const SFTwoIdsHashKey *key,
+        const int64_t update_time, const string_t *payload)
 {
-    struct fc_list_head *previous;
-    struct fc_list_head *current;
-    SFShardingHashEntry *pe;
+    SFShardingHashEntry *entry;
+    int result;
+    SET_SHARDING_AND_HASH_CODE(sharding_ctx, key);
 
-    previous = bucket;
-    fc_list_for_each(current, bucket) {
-        pe = fc_list_entry(current, SFShardingHashEntry, dlinks.htable);
-        if (compare_key(sharding_ctx, &entry->key, &pe->key) < 0) {
-            break;
+    stripe_lock(sharding_ctx, stripe);
+    stripe_write_begin(sharding_ctx, stripe);
+    if (htable_find(sharding_ctx, sharding, stripe,
+                key, hash_code) != NULL)
+    {
+        load_ctx->skipped_count++;
+        result = 0;
+    } else if ((entry=snapshot_entry_alloc(load_ctx,
+                    sharding, stripe)) == NULL)
+    {
+        result = ENOMEM;
+    } else {
+        entry->key = *key;
+        entry->sharding = sharding;
+        entry->referenced = false;
+        entry->charge = 0;
+        entry->last_update_time_sec = update_time;
+        if (load_ctx->unpack_callback != NULL) {
+            result = load_ctx->unpack_callback(entry,
+                    payload, load_ctx->arg);
+        } else {
+            result = 0;
+        }
+        if (result == 0) {
+            result = htable_insert(sharding_ctx, sharding,
+                    entry, hash_code);
         }
 
-        previous = current;
+        if (result == 0) {
+            fc_list_add_tail(&entry->dlinks.lru, &stripe->lru);
+            SHARDING_COUNTER_ADD(sharding, element_count, 1);
+            sharding_charge_entry(sharding_ctx, sharding, entry);
+            if (DLINK_RESIZE_ENABLED(sharding_ctx)) {
+                dlink_htable_check_resize(sharding);
+            }
+            load_ctx->loaded_count++;
+        } else {
+            fast_mblock_free_object(sharding->allocator, entry);
+        }
     }
+    stripe_write_end(sharding_ctx, stripe);
+    PTHREAD_MUTEX_UNLOCK(&stripe->lock);
 
-    fc_list_add_internal(&entry->dlinks.htable, previous, previous->next);
+    return result;
 }
 
-static SFShardingHashEntry *otid_entry_reclaim(SFHtableSharding *sharding)
+static int load_block(SFShardingLoadContext *load_ctx, const char *filename,
+        const int64_t offset, char *body, const int body_len,
+        const int record_count)
 {
-    int64_t reclaim_ttl_sec;
-    int64_t delta;
-    int64_t reclaim_count;
-    int64_t reclaim_limit;
-    SFShardingHashEntry *first;
-    SFShardingHashEntry *entry;
-    SFShardingHashEntry *tmp;
-
-    if (sharding->element_count <= sharding->element_limit) {
-        delta = sharding->element_count;
-        reclaim_limit = sharding->ctx->sharding_reclaim.elt_water_mark;
-    } else {
-        delta = sharding->element_limit;
-        reclaim_limit = (sharding->element_count - sharding->element_limit) +
-            sharding->ctx->sharding_reclaim.elt_water_mark;
-    }
+    SFTwoIdsHashKey key;
+    string_t payload;
+    int64_t update_time;
+    char *p;
+    char *end;
+    int result;
+    int i;
 
-    first = NULL;
-    reclaim_count = 0;
-    reclaim_ttl_sec = (int64_t)(sharding->ctx->sharding_reclaim.max_ttl_sec -
-            sharding->ctx->sharding_reclaim.elt_ttl_sec * delta);
-    fc_list_for_each_entry_safe(entry, tmp, &sharding->lru, dlinks.lru) {
-        if (get_current_time() - entry->last_update_time_sec <=
-                reclaim_ttl_sec)
-        {
+    p = body;
+    end = body + body_len;
+    key.id2 = 0;
+    for (i=0; i<record_count; i++) {
+        if (end - p < SNAPSHOT_RECORD_FIXED_SIZE(load_ctx->sharding_ctx)) {
             break;
         }
 
-        if (sharding->ctx->accept_reclaim_callback != NULL &&
-                !sharding->ctx->accept_reclaim_callback(entry))
+        key.id1 = buff2long(p);
+        p += 8;
+        if (load_ctx->sharding_ctx->key_type ==
+                sf_sharding_htable_key_ids_two)
         {
-            continue;
+            key.id2 = buff2long(p);
+            p += 8;
         }
-
-        fc_list_del_init(&entry->dlinks.htable);
-        fc_list_del_init(&entry->dlinks.lru);
-        if (first == NULL) {
-            first = entry;  //keep the first
-        } else {
-            fast_mblock_free_object(sharding->allocator, entry);
-            sharding->element_count--;
+        update_time = (uint32_t)buff2int(p);
+        p += 4;
+        payload.len = buff2int(p);
+        p += 4;
+        if (payload.len < 0 || payload.len > end - p) {
+            break;
         }
+        payload.str = p;
+        p += payload.len;
 
-        if (++reclaim_count > reclaim_limit) {
-            break;
+        if ((result=load_record(load_ctx->sharding_ctx, load_ctx,
+                        &key, update_time, &payload)) != 0)
+        {
+            return result;
         }
     }
 
-    if (reclaim_count > 0) {
-        logInfo("sharding index: %d, element_count: %"PRId64", "
-                "reclaim_ttl_sec: %"PRId64" ms, reclaim_count: %"PRId64", "
-                "reclaim_limit: %"PRId64, (int)(sharding - sharding->ctx->
-                    sharding_array.entries), sharding->element_count,
-                reclaim_ttl_sec, reclaim_count, reclaim_limit);
+    if (i < record_count || p != end) {
+        logError("file: "__FILE__", line: %d, "
+                "snapshot file \"%s\", the block at offset: %"PRId64" "
+                "is invalid, record count: %d, the parsed: %d",
+                __LINE__, filename, offset, record_count, i);
+        return EINVAL;
     }
-
-    return first;
+    return 0;
 }
 
-static inline SFShardingHashEntry *htable_entry_alloc(
-        SFHtableSharding *sharding)
+static int load_check_header(SFHtableShardingContext *sharding_ctx,
+        const int fd, const char *filename)
 {
-    SFShardingHashEntry *entry;
+    SFShardingSnapshotHeader header;
+    int result;
 
-    if (sharding->element_count > sharding->ctx->sharding_reclaim.
-            elt_water_mark && get_current_time() - sharding->
-            last_reclaim_time_sec > 1000)
+    if ((result=snapshot_pread(fd, filename, (char *)&header,
+                    sizeof(header), 0)) != 0)
     {
-        sharding->last_reclaim_time_sec = get_current_time();
-        if ((entry=otid_entry_reclaim(sharding)) != NULL) {
-            return entry;
+        if (result == ENOENT || result == EINVAL) {
+            logError("file: "__FILE__", line: %d, "
+                    "snapshot file \"%s\" is too short",
+                    __LINE__, filename);
+            result = EINVAL;
         }
+        return result;
     }
 
-    entry = (SFShardingHashEntry *)fast_mblock_alloc_object(
-            sharding->allocator);
-    if (entry != NULL) {
-        sharding->element_count++;
-        entry->sharding = sharding;
+    if (memcmp(header.magic, SNAPSHOT_FILE_MAGIC,
+                sizeof(header.magic)) != 0 ||
+            (uint32_t)buff2int(header.crc32) != sf_crc32c(0, &header,
+                header.crc32 - (char *)&header))
+    {
+        logError("file: "__FILE__", line: %d, "
+                "snapshot file \"%s\", invalid file header",
+                __LINE__, filename);
+        return EINVAL;
     }
 
-    return entry;
+    if (buff2int(header.version) != SNAPSHOT_FORMAT_VERSION ||
+            buff2int(header.key_type) != sharding_ctx->key_type)
+    {
+        logError("file: "__FILE__", line: %d, "
+                "snapshot file \"%s\", the format version: %d or "
+                "the key type: %d mismatch, expect: %d and %d",
+                __LINE__, filename, buff2int(header.version),
+                buff2int(header.key_type), SNAPSHOT_FORMAT_VERSION,
+                sharding_ctx->key_type);
+        return EINVAL;
+    }
+
+    return 0;
 }
 
-#define SET_SHARDING_AND_BUCKET(sharding_ctx, key) \
-    SFHtableSharding *sharding; \
-    struct fc_list_head *bucket;   \
-    SFShardingHashEntry *entry; \
-    uint64_t hash_code;    \
-    \
-    hash_code = sf_sharding_htable_key_ids_one == sharding_ctx-> \
-                key_type ? key->id1 : key->id1 + key->id2; \
-    sharding = sharding_ctx->sharding_array.entries +   \
-        hash_code % sharding_ctx->sharding_array.count; \
-    bucket = sharding->hashtable.buckets +   \
-        key->id1 % sharding->hashtable.capacity
+static int load_blocks(SFShardingLoadContext *load_ctx,
+        const int fd, const char *filename)
+{
+    SFShardingSnapshotBlockHeader header;
+    struct stat stbuf;
+    int64_t offset;
+    char *buff;
+    int size;
+    int body_len;
+    int result;
 
+    if (fstat(fd, &stbuf) != 0) {
+        result = errno != 0 ? errno : EIO;
+        logError("file: "__FILE__", line: %d, "
+                "stat file \"%s\" fail, errno: %d, error info: %s",
+                __LINE__, filename, result, STRERROR(result));
+        return result;
+    }
 
-void *sf_sharding_htable_find(SFHtableShardingContext
-        *sharding_ctx, const SFTwoIdsHashKey *key, void *arg)
-{
-    void *data;
-    SET_SHARDING_AND_BUCKET(sharding_ctx, key);
+    buff = NULL;
+    size = 0;
+    offset = sizeof(SFShardingSnapshotHeader);
+    while ((result=snapshot_pread(fd, filename, (char *)&header,
+                    sizeof(header), offset)) == 0)
+    {
+        body_len = buff2int(header.body_len);
+        if (memcmp(header.magic, SNAPSHOT_BLOCK_MAGIC,
+                    sizeof(header.magic)) != 0 || body_len < 0 ||
+                (uint32_t)buff2int(header.header_crc32) != sf_crc32c(0,
+                    &header, header.header_crc32 - (char *)&header))
+        {
+            logError("file: "__FILE__", line: %d, "
+                    "snapshot file \"%s\", invalid block header "
+                    "at offset: %"PRId64, __LINE__, filename, offset);
+            result = EINVAL;
+            break;
+        }
 
-    PTHREAD_MUTEX_LOCK(&sharding->lock);
-    entry = htable_find(sharding_ctx, key, bucket);
-    if (entry != NULL && sharding_ctx->find_callback != NULL) {
-        data = sharding_ctx->find_callback(entry, arg);
-    } else {
-        data = entry;
+        /* avoid the huge allocation by the corrupted length */
+        if (body_len > stbuf.st_size - (offset + (int64_t)sizeof(header))) {
+            logError("file: "__FILE__", line: %d, "
+                    "snapshot file \"%s\", the block at offset: "
+                    "%"PRId64" is truncated, body length: %d, "
+                    "file size: %"PRId64, __LINE__, filename, offset,
+                    body_len, (int64_t)stbuf.st_size);
+            result = EINVAL;
+            break;
+        }
+
+        if (body_len > size) {
+            free(buff);
+            size = FC_MAX(body_len, SF_SHARDING_SNAPSHOT_BLOCK_SIZE);
+            if ((buff=(char *)fc_malloc(size)) == NULL) {
+                return ENOMEM;
+            }
+        }
+
+        if ((result=snapshot_pread(fd, filename, buff, body_len,
+                        offset + sizeof(header))) != 0 &&
+                result != ENOENT && result != EINVAL)
+        {
+            break;
+        }
+        if (result != 0 || (uint32_t)buff2int(header.body_crc32) !=
+                sf_crc32c(0, buff, body_len))
+        {
+            logError("file: "__FILE__", line: %d, "
+                    "snapshot file \"%s\", the block at offset: "
+                    "%"PRId64" is truncated or crc32 mismatch",
+                    __LINE__, filename, offset);
+            result = EINVAL;
+            break;
+        }
+
+        if ((result=load_block(load_ctx, filename, offset, buff, body_len,
+                        buff2int(header.record_count))) != 0)
+        {
+            break;
+        }
+        offset += sizeof(header) + body_len;
     }
-    PTHREAD_MUTEX_UNLOCK(&sharding->lock);
 
-    return data;
+    free(buff);
+    return result == ENOENT ? 0 : result;
 }
 
-int sf_sharding_htable_insert(SFHtableShardingContext
-        *sharding_ctx, const SFTwoIdsHashKey *key, void *arg)
+int sf_sharding_htable_load(SFHtableShardingContext *sharding_ctx,
+        const char *filename, sf_sharding_htable_unpack_callback
+        unpack_callback, void *arg, int64_t *loaded_count)
 {
-    bool new_create;
+    SFShardingLoadContext load_ctx;
+    struct fast_mblock_chain *chain;
+    struct fast_mblock_chain *end;
     int result;
-    SET_SHARDING_AND_BUCKET(sharding_ctx, key);
-
-    PTHREAD_MUTEX_LOCK(&sharding->lock);
-    do {
-        if ((entry=htable_find(sharding_ctx, key, bucket)) == NULL) {
-            if ((entry=htable_entry_alloc(sharding)) == NULL) {
-                result = ENOMEM;
-                break;
-            }
+    int fd;
 
-            new_create = true;
-            entry->key = *key;
-            htable_insert(sharding_ctx, entry, bucket);
-            fc_list_add_tail(&entry->dlinks.lru, &sharding->lru);
-        } else {
-            new_create = false;
-            fc_list_move_tail(&entry->dlinks.lru, &sharding->lru);
+    if (loaded_count != NULL) {
+        *loaded_count = 0;
+    }
+    if ((fd=open(filename, O_RDONLY)) < 0) {
+        result = errno != 0 ? errno : EACCES;
+        if (result != ENOENT) {
+            logError("file: "__FILE__", line: %d, "
+                    "open file \"%s\" fail, errno: %d, error info: %s",
+                    __LINE__, filename, result, STRERROR(result));
         }
+        return result;
+    }
+
+    if ((result=load_check_header(sharding_ctx, fd, filename)) != 0) {
+        close(fd);
+        return result;
+    }
+
+    load_ctx.chains = (struct fast_mblock_chain *)fc_calloc(sharding_ctx->
+            allocators.count, sizeof(struct fast_mblock_chain));
+    if (load_ctx.chains == NULL) {
+        close(fd);
+        return ENOMEM;
+    }
+    load_ctx.sharding_ctx = sharding_ctx;
+    load_ctx.unpack_callback = unpack_callback;
+    load_ctx.arg = arg;
+    load_ctx.loaded_count = 0;
+    load_ctx.skipped_count = 0;
 
-        entry->last_update_time_sec = get_current_time();
-        result = sharding_ctx->insert_callback(
-                entry, arg, new_create);
-    } while (0);
-    PTHREAD_MUTEX_UNLOCK(&sharding->lock);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    result = load_blocks(&load_ctx, fd, filename);
+    close(fd);
 
+    /* return the unused entries of the batches */
+    end = load_ctx.chains + sharding_ctx->allocators.count;
+    for (chain=load_ctx.chains; chain<end; chain++) {
+        if (chain->head != NULL) {
+            fast_mblock_batch_free(sharding_ctx->allocators.elts +
+                    (chain - load_ctx.chains), chain);
+        }
+    }
+    free(load_ctx.chains);
+
+    if (loaded_count != NULL) {
+        *loaded_count = load_ctx.loaded_count;
+    }
+    logInfo("file: "__FILE__", line: %d, "
+            "load snapshot file \"%s\", loaded entries: %"PRId64", "
+            "skipped the existing: %"PRId64, __LINE__, filename,
+            load_ctx.loaded_count, load_ctx.skipped_count);
     return result;
 }
@@ -23,6 +23,53 @@
 #include "fastcommon/fc_list.h"
 #include "fastcommon/pthread_func.h"
 
+#define SF_SHARDING_HTABLE_FLAGS_OPEN_ADDRESSING  1  //swiss table style
+
+/* find without the sharding lock, validated by the sequence lock and
+   falls back to the lock after some retries. the find callback maybe
+   called on the entry being changed, so it MUST only read the entry and
+   its result is dropped when the validation fails */
+#define SF_SHARDING_HTABLE_FLAGS_OPTIMISTIC_READ  2
+
+#define SF_SHARDING_HTABLE_OPTIMISTIC_RETRIES  4
+
+/* grow the buckets of the sharding when the elements exceed the bucket
+   count and shrink when less than 1/8, the entries are migrated
+   incrementally by the write operations. for the chained buckets only,
+   the open addressing table grows by itself */
+#define SF_SHARDING_HTABLE_FLAGS_RESIZABLE  4
+
+/* the buckets migrated by each write operation */
+#define SF_SHARDING_HTABLE_REHASH_STEP  8
+
+/* split the buckets of the sharding into the stripes, each stripe has its
+   own lock and LRU chain, so the operations of the different keys in the
+   same sharding run concurrently. for the chained buckets only, and
+   the buckets are not resizable in this mode */
+#define SF_SHARDING_HTABLE_FLAGS_STRIPE_LOCK  8
+
+#define SF_SHARDING_HTABLE_STRIPE_COUNT  16
+
+/* count the lock waits and the lookup steps of each stripe for the
+   profiling, the lock is tried first and the wait is timed when busy */
+#define SF_SHARDING_HTABLE_FLAGS_CONTENTION_STATS  16
+
+/* select the sharding by id1 + id2 and the bucket by id1 as the old
+   versions instead of the mixing hash, to compare with the old mapping
+   in the benchmark only. for the chained buckets only */
+#define SF_SHARDING_HTABLE_FLAGS_LEGACY_HASH  32
+
+/* the control byte group of the open addressing hashtable */
+#define SF_OPEN_HTABLE_GROUP_WIDTH  16
+
+#define SF_SHARDING_HTABLE_CHAIN_HISTOGRAM_SIZE  16
+
+/* the records are written in the blocks of this size at least */
+#define SF_SHARDING_SNAPSHOT_BLOCK_SIZE  (1024 * 1024)
+
+/* the entries allocated from the allocator at once when loading */
+#define SF_SHARDING_SNAPSHOT_ALLOC_BATCH  256
+
 typedef enum {
     sf_sharding_htable_key_ids_one = 1,
     sf_sharding_htable_key_ids_two = 2
@@ -30,6 +77,7 @@ typedef enum {
 
 struct sf_sharding_hash_entry;
 struct sf_htable_sharding;
+struct sf_htable_retired_arrays;
 
 typedef int (*sf_sharding_htable_insert_callback)
     (struct sf_sharding_hash_entry *entry, void *arg, const bool new_create);
@@ -40,6 +88,26 @@ typedef void *(*sf_sharding_htable_find_callback)
 typedef bool (*sf_sharding_htable_accept_reclaim_callback)
     (struct sf_sharding_hash_entry *entry);
 
+/* return the bytes of the payload out of the entry */
+typedef int (*sf_sharding_htable_charge_callback)
+    (struct sf_sharding_hash_entry *entry);
+
+/* return 0 to continue, != 0 to stop the iteration */
+typedef int (*sf_sharding_htable_iterate_callback)
+    (struct sf_sharding_hash_entry *entry, void *arg);
+
+/* pack the payload of the entry into the buffer for the snapshot
+   return the payload length, < 0 for the negative errno */
+typedef int (*sf_sharding_htable_pack_callback)
+    (struct sf_sharding_hash_entry *entry, char *buff,
+     const int size, void *arg);
+
+/* restore the payload of the new entry from the snapshot
+   return 0 for success, != 0 to stop the loading */
+typedef int (*sf_sharding_htable_unpack_callback)
+    (struct sf_sharding_hash_entry *entry, const string_t *payload,
+     void *arg);
+
 typedef struct sf_two_ids_hash_key {
     union {
         uint64_t id1;
@@ -61,6 +129,8 @@ typedef struct sf_sharding_hash_entry {
     } dlinks;
     int64_t last_update_time_sec;
     struct sf_htable_sharding *sharding;  //hold for lock
+    bool referenced;  //the reference bit for the second chance reclaim
+    int charge;       //the element size + the payload bytes
 } SFShardingHashEntry;
 
 typedef struct sf_dlink_hashtable {
@@ -68,14 +138,62 @@ typedef struct sf_dlink_hashtable {
     int64_t capacity;
 } SFDlinkHashtable;
 
+/* the control bytes are scanned one group at a time, the 7 bits hash in
+   the control byte filters the slots before comparing the key */
+typedef struct sf_open_hashtable {
+    signed char *ctrls;  //capacity + GROUP_WIDTH, the tail mirrors the head
+    SFShardingHashEntry **slots;
+    int64_t capacity;    //power of 2
+    int64_t size;
+    int64_t growth_left; //the empty slots can be used before rehash
+} SFOpenHashtable;
+
+/* updated with the stripe lock, the time unit is microsecond */
+typedef struct sf_htable_stripe_stats {
+    int64_t lock_count;
+    int64_t wait_count;     //the lock is held by others
+    int64_t wait_time_us;
+    int64_t lookup_count;   //the finds with the lock
+    int64_t lookup_steps;   //the compared entries or the probed groups
+    int64_t optimistic_fallbacks;  //the optimistic finds fall to the lock
+} SFHtableStripeStats;
+
+/* the bucket index % stripe count is the stripe of the bucket */
+typedef struct sf_htable_stripe {
+    pthread_mutex_t lock;
+    volatile int64_t seq;  //the sequence lock, odd when writing
+    struct fc_list_head lru;
+    SFHtableStripeStats stats;  //for SF_SHARDING_HTABLE_FLAGS_CONTENTION_STATS
+} SFHtableStripe;
+
 struct sf_htable_sharding_context;
 typedef struct sf_htable_sharding {
-    pthread_mutex_t lock;
+    /* the lock and the LRU chain of the sharding are the first stripe
+       without STRIPE_LOCK, use sf_sharding_htable_entry_lock otherwise */
+    union {
+        SFHtableStripe stripe;
+        struct {
+            pthread_mutex_t lock;
+            volatile int64_t seq;
+            struct fc_list_head lru;
+        };
+    };
+    SFHtableStripe *stripes;  //point to the above stripe without STRIPE_LOCK
+    struct sf_htable_retired_arrays *retired;
+    int retired_count;
     struct fast_mblock_man *allocator;
-    struct fc_list_head lru;
     SFDlinkHashtable hashtable;
-    int64_t element_count;
+    struct {
+        SFDlinkHashtable old;  //buckets is NULL when not rehashing
+        int64_t index;         //the next bucket of the old to migrate
+    } rehash;
+    SFOpenHashtable otable;  //for SF_SHARDING_HTABLE_FLAGS_OPEN_ADDRESSING
+    volatile int64_t element_count;  //atomic with the stripe lock
     int64_t element_limit;
+    struct {
+        volatile int64_t used;   //the charge sum of the entries
+        int64_t limit;  //0 for no limit
+    } memory;
     int64_t last_reclaim_time_sec;
     struct sf_htable_sharding_context *ctx;
 } SFHtableSharding;
@@ -93,18 +211,55 @@ typedef struct sf_htable_sharding_context {
         int elt_water_mark;  //trigger reclaim when elements exceeds water mark
     } sharding_reclaim;
 
+    struct {
+        volatile bool running;
+        volatile bool continue_flag;
+        int interval_ms;
+        pthread_t tid;  //joined when stopping
+    } reclaim_thread;
+
     struct {
         int count;
         struct fast_mblock_man *elts;
     } allocators;
 
     SFShardingHtableKeyType key_type;  //id count in the hash entry
+    int flags;
+    int stripe_count;
+    int element_size;
+    sf_sharding_htable_charge_callback charge_callback;
     sf_sharding_htable_insert_callback insert_callback;
     sf_sharding_htable_find_callback find_callback;
     sf_sharding_htable_accept_reclaim_callback accept_reclaim_callback;
     SFHtableShardingArray sharding_array;
 } SFHtableShardingContext;
 
+/* the chain length is the entry count of the bucket for the chained
+   buckets, and the probed groups of the entry for the open addressing */
+typedef struct sf_sharding_htable_chain_stats {
+    int64_t element_count;
+    int64_t bucket_count;
+    int64_t used_buckets;   //the non-empty buckets or the full slots
+    int64_t min_sharding_elements;
+    int64_t max_sharding_elements;
+    int max_length;
+    int64_t histogram[SF_SHARDING_HTABLE_CHAIN_HISTOGRAM_SIZE]; //by length
+} SFShardingHtableChainStats;
+
+typedef struct sf_sharding_htable_memory_stats {
+    int64_t element_count;
+    int64_t memory_used;
+    int64_t memory_limit;
+    int64_t max_sharding_used;
+    int64_t htable_bytes;  //the bucket or slot arrays
+} SFShardingHtableMemoryStats;
+
+typedef struct sf_sharding_htable_contention_stats {
+    SFHtableStripeStats total;
+    int hottest_sharding;   //the sharding index of the max wait time
+    int64_t hottest_wait_time_us;
+} SFShardingHtableContentionStats;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -119,12 +274,133 @@ extern "C" {
             int64_t element_limit, const int64_t min_ttl_sec,
             const int64_t max_ttl_sec);
 
+    /* flags: SF_SHARDING_HTABLE_FLAGS_xxx */
+    int sf_sharding_htable_init_ex(SFHtableShardingContext *sharding_ctx,
+            const SFShardingHtableKeyType key_type,
+            sf_sharding_htable_insert_callback insert_callback,
+            sf_sharding_htable_find_callback find_callback,
+            sf_sharding_htable_accept_reclaim_callback reclaim_callback,
+            const int sharding_count, const int64_t htable_capacity,
+            const int allocator_count, const int element_size,
+            int64_t element_limit, const int64_t min_ttl_sec,
+            const int64_t max_ttl_sec, const int flags);
+
+    /* limit the charged bytes of each sharding to memory_limit /
+     * sharding_count, the reclaim ignores the TTL until the sharding
+     * drops to 90% of the budget. MUST be called before the insertion
+     * charge_callback: the payload bytes of the entry, can be NULL
+     * memory_limit: the bytes of all shardings, 0 for no limit
+     */
+    void sf_sharding_htable_set_memory_limit(SFHtableShardingContext
+            *sharding_ctx, sf_sharding_htable_charge_callback
+            charge_callback, const int64_t memory_limit);
+
     int sf_sharding_htable_insert(SFHtableShardingContext
             *sharding_ctx, const SFTwoIdsHashKey *key, void *arg);
 
     void *sf_sharding_htable_find(SFHtableShardingContext
             *sharding_ctx, const SFTwoIdsHashKey *key, void *arg);
 
+    /* remove the entry and free it to the allocator
+     * return 0 for success, ENOENT for not found
+     */
+    int sf_sharding_htable_delete(SFHtableShardingContext
+            *sharding_ctx, const SFTwoIdsHashKey *key);
+
+    /* the lock which protects the entry, the same as
+     * entry->sharding->lock without SF_SHARDING_HTABLE_FLAGS_STRIPE_LOCK
+     */
+    pthread_mutex_t *sf_sharding_htable_entry_lock(
+            SFShardingHashEntry *entry);
+
+    /* the batch operations sort the keys by the sharding and lock
+     * each sharding once, the same keys are processed in order
+     * args: the arg of each key, can be NULL
+     * results: return the found data of each key
+     * return 0 for success, ENOMEM for out of memory
+     */
+    int sf_sharding_htable_batch_find(SFHtableShardingContext *sharding_ctx,
+            const SFTwoIdsHashKey *keys, void **args, const int count,
+            void **results);
+
+    /* results: return the result of each key, can be NULL
+     * return the first error
+     */
+    int sf_sharding_htable_batch_insert(SFHtableShardingContext
+            *sharding_ctx, const SFTwoIdsHashKey *keys, void **args,
+            const int count, int *results);
+
+#define sf_sharding_htable_iterate(sharding_ctx, callback, arg) \
+    sf_sharding_htable_iterate_ex(sharding_ctx, 0, 1, callback, arg)
+
+    /* iterate the entries of the shardings whose index % thread_count
+     * equals to thread_index in the LRU order, so the threads can
+     * iterate the disjoint shardings in parallel. the stripe is locked
+     * during the iteration, the callback MUST NOT call the htable API
+     * return 0 for success, or the result of the callback which stops
+     */
+    int sf_sharding_htable_iterate_ex(SFHtableShardingContext *sharding_ctx,
+            const int thread_index, const int thread_count,
+            sf_sharding_htable_iterate_callback callback, void *arg);
+
+    /* reclaim the shardings over the water mark in the background thread,
+     * then the inserting thread reclaims only when the sharding exceeds
+     * the element limit
+     */
+    int sf_sharding_htable_start_reclaim_thread(SFHtableShardingContext
+            *sharding_ctx, const int interval_ms);
+
+    /* notify the reclaim thread to stop and wait for its exit */
+    void sf_sharding_htable_stop_reclaim_thread(SFHtableShardingContext
+            *sharding_ctx);
+
+    /* dump the entries to the snapshot file in the LRU order of each
+     * stripe, the threads dump the disjoint shardings in parallel and
+     * write the blocks to the same file. the file is written to a
+     * temp file then renamed, so the old snapshot is kept when fail
+     * thread_count: the dump threads, <= 1 for the current thread only
+     * max_payload_size: the buffer size passed to the pack callback
+     * pack_callback: called by the dump threads with the stripe lock,
+     *                NULL for the keys only
+     * return 0 for success, != 0 for error
+     */
+    int sf_sharding_htable_dump(SFHtableShardingContext *sharding_ctx,
+            const char *filename, const int thread_count,
+            const int max_payload_size, sf_sharding_htable_pack_callback
+            pack_callback, void *arg);
+
+    /* load the snapshot file at startup, the entries are allocated
+     * from the allocators in batch and keep the update time and the
+     * LRU order. the sharding count can differ from the dumped one,
+     * and the keys already exist are skipped
+     * unpack_callback: can be NULL for the keys only
+     * loaded_count: return the loaded entries, can be NULL
+     * return 0 for success, ENOENT for no snapshot, != 0 for error
+     */
+    int sf_sharding_htable_load(SFHtableShardingContext *sharding_ctx,
+            const char *filename, sf_sharding_htable_unpack_callback
+            unpack_callback, void *arg, int64_t *loaded_count);
+
+    /* sum the gauges of the shardings without the lock */
+    void sf_sharding_htable_get_memory_stats(SFHtableShardingContext
+            *sharding_ctx, SFShardingHtableMemoryStats *stats);
+
+    /* sum the counters of the stripes without the lock, the sharding_ctx
+     * MUST be inited with SF_SHARDING_HTABLE_FLAGS_CONTENTION_STATS
+     * sharding_index: the sharding to sum, < 0 for all shardings
+     */
+    void sf_sharding_htable_get_contention_stats(SFHtableShardingContext
+            *sharding_ctx, const int sharding_index,
+            SFShardingHtableContentionStats *stats);
+
+    /* clear the counters with the stripe lock, such as after warm up */
+    void sf_sharding_htable_reset_contention_stats(SFHtableShardingContext
+            *sharding_ctx);
+
+    /* walk all shardings with the lock, for diagnosis only */
+    void sf_sharding_htable_get_chain_stats(SFHtableShardingContext
+            *sharding_ctx, SFShardingHtableChainStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -38,6 +38,17 @@ typedef int (*sf_set_body_length_callback)(struct fast_task_info *task);
 typedef int (*sf_deal_task_func)(struct fast_task_info *task, const int stage);
 typedef int (*sf_recv_timeout_callback)(struct fast_task_info *task);
 
+/* the file region to send after the data of the task buffer */
+typedef struct sf_sendfile_context {
+    int fd;
+    int64_t offset;  //the file offset to send from
+    int64_t length;  //the remain bytes to send
+} SFSendfileContext;
+
+/* return NULL when the task has no file region to send */
+typedef SFSendfileContext *(*sf_get_sendfile_context_callback)(
+        struct fast_task_info *task);
+
 typedef struct sf_context {
     struct nio_thread_data *thread_data;
     volatile int thread_count;
@@ -60,6 +71,7 @@ typedef struct sf_context {
     sf_accept_done_callback accept_done_func;
     TaskCleanUpCallback task_cleanup_func;
     sf_recv_timeout_callback timeout_callback;
+    sf_get_sendfile_context_callback get_sendfile_context;
 } SFContext;
 
 typedef struct {